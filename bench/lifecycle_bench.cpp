@@ -0,0 +1,105 @@
+// Opens, moves and destroys virtual wiimotes that report nothing unless asked to, with a read and a write thread each
+// or serviced by a reactor, and prints one JSON line per configuration with the time each step took and the CPU the
+// idle devices used.
+//
+// mote_lifecycle_bench [--rounds=20] [--idle-ms=500]
+
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <fmt/format.h>
+
+#include "wmote/logging.hpp"
+#include "wmote/wiimote.hpp"
+#include "wmote/latency_histogram.hpp"
+#include "wmote/virtual_wiimote_transport.hpp"
+
+using namespace std::chrono;
+
+namespace {
+    struct options {
+        size_t rounds = 20;
+        milliseconds idle{500};
+    };
+
+    options parse(int argc, char **argv) {
+        options opts;
+        for (auto i = 1; i < argc; ++i) {
+            std::string_view arg(argv[i]);
+            const auto eq = arg.find('=');
+            const auto key = arg.substr(0, eq);
+            const auto value = eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+            if (key == "--rounds")
+                opts.rounds = std::max(1, std::atoi(std::string(value).c_str()));
+            else if (key == "--idle-ms")
+                opts.idle = milliseconds(std::atoi(std::string(value).c_str()));
+            else {
+                std::cerr << "Unknown option " << arg << '\n';
+                std::exit(1);
+            }
+        }
+        return opts;
+    }
+
+    nanoseconds cpu_time() {
+        timespec ts{};
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+    }
+
+    template <typename F>
+    void time(latency_histogram &histogram, F &&step) {
+        const auto start = steady_clock::now();
+        step();
+        histogram.record(steady_clock::now() - start);
+    }
+
+    std::string summary_json(latency_histogram const &histogram) {
+        const auto summary = histogram.summary();
+        const auto us = [](nanoseconds value) { return duration<double, std::micro>(value).count(); };
+        return fmt::format(R"({{"p50_us":{:.1f},"p99_us":{:.1f},"max_us":{:.1f}}})",
+                           us(summary.p50), us(summary.p99), us(summary.max));
+    }
+
+    void run(std::string_view name, reactor *loop, options const &opts) {
+        latency_histogram opened, moved, destroyed;
+        nanoseconds idle_cpu{};
+        for (auto i = 0u; i < opts.rounds; ++i) {
+            std::optional<wiimote> first;
+            time(opened, [&] { first.emplace(std::make_unique<virtual_wiimote_transport>(), loop); });
+            // Without subscribers only button changes are reported, so the reader mostly waits
+            const auto cpu_before = cpu_time();
+            std::this_thread::sleep_for(opts.idle);
+            idle_cpu += cpu_time() - cpu_before;
+
+            std::optional<wiimote> second;
+            time(moved, [&] { second.emplace(std::move(*first)); });
+            time(destroyed, [&] {
+                first.reset();
+                second.reset();
+            });
+        }
+
+        const auto idle_cpu_percent = 100 * duration<double>(idle_cpu).count() /
+                                      duration<double>(opts.idle * opts.rounds).count();
+        std::cout << fmt::format(R"({{"mode":"{}","rounds":{},"open":{},"move":{},"destroy":{},"idle_cpu_percent":{:.2f}}})",
+                                 name, opts.rounds, summary_json(opened), summary_json(moved), summary_json(destroyed),
+                                 idle_cpu_percent) << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    const auto opts = parse(argc, argv);
+
+    set_info_logger([](std::string const &) {});
+
+    run("threads", nullptr, opts);
+    reactor loop(1);
+    run("reactor", &loop, opts);
+}
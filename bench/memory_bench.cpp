@@ -0,0 +1,131 @@
+// Moves blocks of EEPROM to and from a virtual wiimote, and prints one JSON line per block size with the throughput
+// of the bulk calls against doing the same transfer one 16 byte transaction at a time.
+//
+// mote_memory_bench [--sizes=16,256,1024,4096] [--rounds=3]
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fmt/format.h>
+
+#include "wmote/logging.hpp"
+#include "wmote/wiimote.hpp"
+#include "wmote/virtual_wiimote_transport.hpp"
+
+using namespace std::chrono;
+
+namespace {
+    struct options {
+        std::vector<size_t> sizes{16, 256, 1024, 4096};
+        size_t rounds = 3;
+    };
+
+    // Past the calibration data, which the wiimote reads when it connects
+    constexpr address_t base{{0x00, 0x00, 0x01, 0x00}};
+    constexpr size_t max_size = 0x1600;
+    // Every round goes to the device, rather than being answered from the register shadow
+    constexpr mem_policy uncached{.shadowed = false};
+
+    std::vector<size_t> parse_list(std::string_view text) {
+        std::vector<size_t> out;
+        while (!text.empty()) {
+            const auto comma = text.find(',');
+            const auto item = text.substr(0, comma);
+            size_t value = 0;
+            std::from_chars(item.data(), item.data() + item.size(), value);
+            if (value)
+                out.push_back(std::min(value, max_size));
+            text = comma == std::string_view::npos ? std::string_view{} : text.substr(comma + 1);
+        }
+        return out;
+    }
+
+    options parse(int argc, char **argv) {
+        options opts;
+        for (auto i = 1; i < argc; ++i) {
+            std::string_view arg(argv[i]);
+            const auto eq = arg.find('=');
+            const auto key = arg.substr(0, eq);
+            const auto value = eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+            if (key == "--sizes")
+                opts.sizes = parse_list(value);
+            else if (key == "--rounds")
+                opts.rounds = std::max(1, std::atoi(std::string(value).c_str()));
+            else {
+                std::cerr << "Unknown option " << arg << '\n';
+                std::exit(1);
+            }
+        }
+        return opts;
+    }
+
+    std::atomic<size_t> s_failed = 0;
+
+    template <typename F>
+    double bytes_per_second(size_t size, size_t rounds, F &&transfer) {
+        const auto start = steady_clock::now();
+        for (auto i = 0u; i < rounds; ++i)
+            transfer();
+        return double(size * rounds) / duration<double>(steady_clock::now() - start).count();
+    }
+
+    void run(wiimote &mote, size_t size, options const &opts) {
+        std::vector<uint8_t> out(size);
+        std::iota(out.begin(), out.end(), uint8_t(size));
+        std::vector<uint8_t> in(size);
+
+        const auto bulk_write = bytes_per_second(size, opts.rounds, [&] {
+            if (!mote.write_memory(base, out, uncached).get())
+                ++s_failed;
+        });
+        const auto bulk_read = bytes_per_second(size, opts.rounds, [&] {
+            if (!mote.read_memory(base, in, uncached).get())
+                ++s_failed;
+        });
+        const bool verified = in == out;
+
+        const auto chunked_write = bytes_per_second(size, opts.rounds, [&] {
+            for (size_t offset = 0; offset < size; offset += 16) {
+                const auto chunk = std::span(out).subspan(offset, std::min<size_t>(16, size - offset));
+                if (!mote.write_memory(base + offset, chunk, uncached).get())
+                    ++s_failed;
+            }
+        });
+        const auto chunked_read = bytes_per_second(size, opts.rounds, [&] {
+            for (size_t offset = 0; offset < size; offset += 16) {
+                if (!mote.read_memory(base + offset, uint16_t(std::min<size_t>(16, size - offset)), uncached).get())
+                    ++s_failed;
+            }
+        });
+
+        std::cout << fmt::format(
+                R"({{"size":{},"rounds":{},"write_bytes_per_second":{:.0f},"read_bytes_per_second":{:.0f},)"
+                R"("chunked_write_bytes_per_second":{:.0f},"chunked_read_bytes_per_second":{:.0f},"verified":{}}})",
+                size, opts.rounds, bulk_write, bulk_read, chunked_write, chunked_read, verified) << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    const auto opts = parse(argc, argv);
+
+    set_info_logger([](std::string const &) {});
+    // Probing for an extension that isn't there logs errors, so only failed transfers are counted
+    set_error_logger([](std::string const &) {});
+
+    wiimote mote(std::make_unique<virtual_wiimote_transport>());
+    // Let the wiimote get through its init sequence first
+    std::this_thread::sleep_for(500ms);
+
+    for (const auto size: opts.sizes)
+        run(mote, size, opts);
+    if (s_failed)
+        std::cerr << s_failed << " transfers failed\n";
+}
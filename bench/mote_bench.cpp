@@ -0,0 +1,460 @@
+// Microbenchmarks of the per-sample work done while decoding and serving DSU clients.
+// Prints one JSON line per benchmark, so results can be kept and compared per commit.
+//
+// mote_bench [filter]
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fmt/format.h>
+
+#include "dsulib/crc.hpp"
+#include "dsulib/dsu_server.hpp"
+#include "dsulib/remap.hpp"
+#include "wmote/batch_decoder.hpp"
+#include "wmote/fusion.hpp"
+#include "wmote/latency_histogram.hpp"
+#include "wmote/logging.hpp"
+#include "wmote/recording.hpp"
+#include "wmote/speaker.hpp"
+#include "wmote/virtual_wiimote_transport.hpp"
+#include "wmote/wiimote.hpp"
+
+using namespace std::chrono;
+
+namespace {
+    // Keeps the compiler from optimising away a value
+    template<typename T>
+    void keep(T const &value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    // Runs body in growing batches until a batch takes long enough to time, then reports the best of a few.
+    // Bodies that each handle many items also report the items per second.
+    template<typename Body>
+    void run(std::string_view filter, std::string_view name, Body &&body, size_t items_per_op = 1) {
+        if (!filter.empty() && name.find(filter) == std::string_view::npos)
+            return;
+
+        size_t iterations = 1000;
+        for (;;) {
+            const auto start = steady_clock::now();
+            for (auto i = 0u; i < iterations; ++i)
+                body(i);
+            if (steady_clock::now() - start > 50ms)
+                break;
+            iterations *= 4;
+        }
+
+        auto best = duration<double, std::nano>::max();
+        for (auto round = 0; round < 5; ++round) {
+            const auto start = steady_clock::now();
+            for (auto i = 0u; i < iterations; ++i)
+                body(i);
+            best = std::min(best, duration<double, std::nano>(steady_clock::now() - start) / iterations);
+        }
+        if (items_per_op > 1)
+            std::cout << fmt::format(R"({{"benchmark":"{}","iterations":{},"ns_per_op":{:.2f},"items_per_second":{:.0f}}})",
+                                     name, iterations, best.count(), items_per_op * 1e9 / best.count()) << std::endl;
+        else
+            std::cout << fmt::format(R"({{"benchmark":"{}","iterations":{},"ns_per_op":{:.2f}}})", name, iterations,
+                                     best.count()) << std::endl;
+    }
+
+    // Passes reports through until closed, then produces nothing, leaving the wiimote free to be fed by hand
+    class gated_transport : public hid_transport {
+    public:
+        explicit gated_transport(std::unique_ptr<hid_transport> inner) : m_inner(std::move(inner)) {}
+
+        void close() { m_open = false; }
+
+        ssize_t read(std::span<uint8_t> report, int timeout_ms) override {
+            if (m_open)
+                return m_inner->read(report, timeout_ms);
+            std::this_thread::sleep_for(10ms);
+            return 0;
+        }
+
+        ssize_t write(std::span<const uint8_t> report) override { return m_inner->write(report); }
+
+        std::string identifier() const override { return m_inner->identifier(); }
+
+    private:
+        std::unique_ptr<hid_transport> m_inner;
+        std::atomic_bool m_open = true;
+    };
+
+    // Reports in the given mode, as a virtual wiimote with a nunchuk and a lit sensor bar sends them.
+    // With motionplus, the nunchuk sits behind an active motionplus in passthrough mode.
+    std::vector<std::vector<uint8_t>> canned_reports(uint8_t mode, size_t count, bool motionplus = false) {
+        virtual_wiimote_transport device(
+                {.report_interval = 1ms, .extension = virtual_extension::NUNCHUK, .motionplus = motionplus});
+        if (motionplus) {
+            std::array<uint8_t, 22> activate{REP_OUT_WRITE_TO_MEMORY, MEM_REGISTER, 0xA6, 0x00, 0xFE, 1, 0x05};
+            device.write(activate);
+        }
+        device.write(std::array<uint8_t, 2>{REP_OUT_IR_PIXEL_CLOCK_ENABLE, 0x04});
+        device.write(std::array<uint8_t, 2>{REP_OUT_IR_LOGIC_ENABLE, 0x04});
+        device.write(std::array<uint8_t, 3>{REP_OUT_DATA_REPORT_MODE, 0x04, mode});
+
+        std::vector<std::vector<uint8_t>> reports;
+        std::array<uint8_t, 32> buffer{};
+        while (reports.size() < count) {
+            const auto size = device.read(buffer, 100);
+            // The interleaved mode alternates between two ids
+            if (size > 0 && (buffer[0] == mode || (mode == REP_IN_BUTTONS_ACC_IR_36B && buffer[0] == mode + 1)))
+                reports.emplace_back(buffer.begin(), buffer.begin() + size);
+        }
+        return reports;
+    }
+
+    void bench_decode(std::string_view filter) {
+        constexpr std::array<uint8_t, 10> modes{0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x3d, 0x3e};
+        constexpr std::array<uint8_t, 12> ids{0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x3d, 0x3e,
+                                              REP_IN_STATUS_INFORMATION, REP_IN_ACK_OUTPUT_REPORT};
+        const auto name = [](uint8_t id) { return fmt::format("decode_{:#x}", id); };
+        // Setting up takes a while, so skip it if nothing here is wanted
+        if (std::none_of(ids.begin(), ids.end(), [&](uint8_t id) {
+            return filter.empty() || name(id).find(filter) != std::string::npos;
+        }))
+            return;
+
+        // Let the wiimote find its nunchuk, then take over feeding it
+        auto transport = std::make_unique<gated_transport>(
+                std::make_unique<virtual_wiimote_transport>(virtual_wiimote_config{.extension = virtual_extension::NUNCHUK}));
+        auto &gate = *transport;
+        wiimote mote(std::move(transport));
+        std::this_thread::sleep_for(500ms);
+        gate.close();
+        std::this_thread::sleep_for(50ms);
+
+        for (const auto mode: modes) {
+            const auto reports = canned_reports(mode, 8);
+            run(filter, name(mode), [&](size_t i) {
+                mote.decode(reports[i % reports.size()]);
+            });
+        }
+
+        // Status with the nunchuk still connected, and an acknowledgement of a LED change
+        const std::array<uint8_t, 7> status{REP_IN_STATUS_INFORMATION, 0, 0, 0x1a, 0, 0, 0xc0};
+        run(filter, name(REP_IN_STATUS_INFORMATION), [&](size_t) {
+            mote.decode(status);
+        });
+        const std::array<uint8_t, 5> ack{REP_IN_ACK_OUTPUT_REPORT, 0, 0, REP_OUT_PLAYER_LED, 0};
+        run(filter, name(REP_IN_ACK_OUTPUT_REPORT), [&](size_t) {
+            mote.decode(ack);
+        });
+    }
+
+    bool same_columns(report_columns const &a, report_columns const &b) {
+        return a.size == b.size && a.buttons == b.buttons && a.acc == b.acc && a.gyro == b.gyro &&
+               a.gyro_valid == b.gyro_valid && a.gyro_slow == b.gyro_slow && a.ir_x == b.ir_x && a.ir_y == b.ir_y &&
+               a.ir_size == b.ir_size;
+    }
+
+    // Decodes a recording sized stream of reports laid out like recording_format::record, with each implementation
+    bool bench_batch_decode(std::string_view filter) {
+        constexpr size_t stream_size = 4096;
+        constexpr size_t stride = sizeof(recording_format::record);
+        for (auto const &[mode, motionplus]: {std::pair<uint8_t, bool>{0x31, false}, {0x33, false}, {0x35, true},
+                                             {0x37, true}}) {
+            const auto name = fmt::format("batch_decode_{:#x}", mode);
+            if (!filter.empty() && name.find(filter) == std::string::npos)
+                continue;
+
+            const auto reports = canned_reports(mode, 64, motionplus);
+            std::vector<recording_format::record> stream(stream_size);
+            for (auto i = 0u; i < stream.size(); ++i) {
+                auto const &report = reports[i % reports.size()];
+                stream[i].size = report.size();
+                std::copy(report.begin(), report.end(), stream[i].data.begin());
+            }
+            const std::span bytes(&stream[0].data[0], stream.size() * stride - offsetof(recording_format::record, data));
+
+            report_columns expected;
+            batch_decoder(mode, motionplus, batch_decoder::isa::SCALAR).decode(bytes, stride, expected);
+            for (const auto isa: {batch_decoder::isa::SCALAR, batch_decoder::isa::AVX2}) {
+                if (isa > batch_decoder::best_isa())
+                    continue;
+                const batch_decoder decoder(mode, motionplus, isa);
+                report_columns columns;
+                decoder.decode(bytes, stride, columns);
+                if (!same_columns(columns, expected)) {
+                    std::cerr << name << ": implementations disagree" << std::endl;
+                    return false;
+                }
+                run(filter, fmt::format("{}_{}", name, isa == batch_decoder::isa::AVX2 ? "avx2" : "scalar"),
+                    [&](size_t) {
+                        decoder.decode(bytes, stride, columns);
+                        keep(columns.size);
+                    }, stream_size);
+            }
+        }
+        return true;
+    }
+
+    void bench_fusion(std::string_view filter) {
+        madgwick_filter fusion;
+        run(filter, "madgwick_update", [&](size_t i) {
+            const auto wobble = float(i & 7) * 0.01f;
+            fusion.update({0.1f + wobble, 0.2f, -0.05f}, {0.1f, 1 - wobble, 0.9f}, 0.01f);
+            keep(fusion);
+        });
+
+        // Same cost without an accelerometer reading
+        run(filter, "madgwick_update_gyro_only", [&](size_t) {
+            fusion.update({0.1f, 0.2f, -0.05f}, {0, 0, 0}, 0.01f);
+            keep(fusion);
+        });
+    }
+
+    // The server's default mapping, without the nunchuk
+    constexpr std::array remap_entries{
+            remap_entry{u32(button_flags::DPAD_UP), remap_target::DPAD_UP},
+            remap_entry{u32(button_flags::DPAD_DOWN), remap_target::DPAD_DOWN},
+            remap_entry{u32(button_flags::DPAD_LEFT), remap_target::DPAD_LEFT},
+            remap_entry{u32(button_flags::DPAD_RIGHT), remap_target::DPAD_RIGHT},
+            remap_entry{u32(button_flags::HOME), remap_target::HOME},
+            remap_entry{u32(button_flags::A), remap_target::A},
+            remap_entry{u32(button_flags::B), remap_target::B},
+            remap_entry{u32(button_flags::ONE), remap_target::X},
+            remap_entry{u32(button_flags::TWO), remap_target::Y},
+            remap_entry{u32(button_flags::PLUS), remap_target::OPTIONS},
+            remap_entry{u32(button_flags::MINUS), remap_target::SHARE},
+    };
+
+    // The same mapping, as the handler wrote it out before remap tables
+    void remap_by_branches(button_flags buttons, msg::controller_data_report &rep) {
+        rep.buttons.dpad_down = !!(buttons & button_flags::DPAD_DOWN);
+        rep.buttons.dpad_up = !!(buttons & button_flags::DPAD_UP);
+        rep.buttons.dpad_left = !!(buttons & button_flags::DPAD_LEFT);
+        rep.buttons.dpad_right = !!(buttons & button_flags::DPAD_RIGHT);
+        rep.buttons.home = !!(buttons & button_flags::HOME);
+        rep.buttons.a = !!(buttons & button_flags::A);
+        rep.buttons.b = !!(buttons & button_flags::B);
+        rep.buttons.x = !!(buttons & button_flags::ONE);
+        rep.buttons.y = !!(buttons & button_flags::TWO);
+        rep.buttons.options = !!(buttons & button_flags::PLUS);
+        rep.buttons.share = !!(buttons & button_flags::MINUS);
+        rep.analog_buttons.dpad_left = rep.buttons.dpad_left * 255;
+        rep.analog_buttons.dpad_down = rep.buttons.dpad_down * 255;
+        rep.analog_buttons.dpad_up = rep.buttons.dpad_up * 255;
+        rep.analog_buttons.dpad_right = rep.buttons.dpad_right * 255;
+        rep.analog_buttons.a = rep.buttons.a * 255;
+        rep.analog_buttons.x = rep.buttons.x * 255;
+        rep.analog_buttons.b = rep.buttons.b * 255;
+        rep.analog_buttons.y = rep.buttons.y * 255;
+    }
+
+    // Controller data for one wiimote, built the way the server's handler builds it
+    msg::controller_data_report assemble_report(wiimote const &mote, remap_table const &remap) {
+        msg::controller_data_report rep{};
+        rep.dev.slot = 0;
+        rep.dev.slot_state = types::SlotState::CONNECTED;
+        rep.dev.model = types::GyroModel::LIMITED;
+        rep.dev.conn_type = types::ConnectionType::BT;
+        rep.dev.battery = mote.status().battery_very_low ? types::BatteryLevel::DYING : types::BatteryLevel::CHARGED;
+        rep.connected = true;
+        remap.apply(u32(mote.get_buttons()), rep);
+
+        const auto acc = mote.accelerometer();
+        rep.acc.x = acc.x / 8;
+        rep.acc.y = -acc.z / 8;
+        rep.acc.z = -acc.y / 8;
+        if (const auto gyro = mote.motionplus()) {
+            rep.dev.model = types::GyroModel::FULL;
+            rep.gyro.pitch = gyro->x;
+            rep.gyro.yaw = gyro->y;
+            rep.gyro.roll = gyro->z;
+        }
+
+        const auto pointer = mote.pointer();
+        rep.touch_1.active = pointer.visible;
+        rep.touch_1.x = u16(std::clamp(pointer.position.x, 0.0f, 1.0f) * 1919);
+        rep.touch_1.y = u16(std::clamp(pointer.position.y, 0.0f, 1.0f) * 941);
+        return rep;
+    }
+
+    void bench_dsu(std::string_view filter) {
+        // Header and controller data, and header and status
+        for (const auto size: {100u, 32u}) {
+            std::vector<uint8_t> packet(size);
+            for (auto i = 0u; i < packet.size(); ++i)
+                packet[i] = uint8_t(i * 7);
+            run(filter, fmt::format("crc_{}b", size), [&](size_t i) {
+                packet[0] = uint8_t(i);
+                keep(crc(packet.begin(), packet.end()));
+            });
+        }
+
+        const dsu_server server;
+        msg::controller_data_report rep{};
+        run(filter, "dsu_encode_controller_data", [&](size_t i) {
+            rep.acc.x = float(i & 255);
+            const auto packet = server.encode(types::event_type::CONTROLLER_DATA,
+                                              {reinterpret_cast<const u8 *>(&rep), sizeof(rep)});
+            keep(packet.data());
+        });
+
+        // Every combination of the wiimote's buttons in turn, so the branches can't all be predicted
+        const remap_table remap(remap_entries);
+        run(filter, "dsu_remap_branches", [&](size_t i) {
+            remap_by_branches(button_flags(i * 0x9e37) & button_flags::ALL_BUTTONS_PRESSED, rep);
+            keep(rep);
+        });
+        run(filter, "dsu_remap_table", [&](size_t i) {
+            remap.apply(u32(i * 0x9e37) & u32(button_flags::ALL_BUTTONS_PRESSED), rep);
+            keep(rep);
+        });
+
+        run(filter, "endpoint_from_string", [&](size_t i) {
+            const sns::endpoint ep("127.0.0.1", uint16_t(26760 + (i & 7)));
+            keep(ep);
+        });
+        // As made for every packet the server receives
+        sockaddr_storage storage{};
+        auto &address = reinterpret_cast<sockaddr_in &>(storage);
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        run(filter, "endpoint_from_sockaddr", [&](size_t i) {
+            address.sin_port = htons(uint16_t(26760 + (i & 7)));
+            const sns::endpoint ep(storage);
+            keep(ep);
+        });
+
+        if (!filter.empty() && std::string_view("dsu_assemble_report").find(filter) == std::string_view::npos)
+            return;
+        wiimote mote(std::make_unique<virtual_wiimote_transport>(
+                virtual_wiimote_config{.extension = virtual_extension::NUNCHUK}));
+        const auto sensors = mote.subscribe(sensor_flags::ACCELEROMETER | sensor_flags::IR | sensor_flags::EXTENSION);
+        std::this_thread::sleep_for(500ms);
+        run(filter, "dsu_assemble_report", [&](size_t) {
+            keep(assemble_report(mote, remap));
+        });
+    }
+
+    // Reading the accelerometer and motionplus from one thread while others do the same, and a decoding thread
+    // writes a report every millisecond
+    void bench_readers(std::string_view filter) {
+        constexpr std::array<size_t, 3> reader_counts{0, 1, 3};
+        const auto name = [](std::string_view getter, size_t readers) {
+            return fmt::format("{}_{}_readers", getter, readers);
+        };
+        if (std::none_of(reader_counts.begin(), reader_counts.end(), [&](size_t readers) {
+            return filter.empty() || name("accelerometer", readers).find(filter) != std::string::npos ||
+                   name("motionplus", readers).find(filter) != std::string::npos;
+        }))
+            return;
+
+        // With a motionplus passing the nunchuk through, so motionplus() has a reading to copy
+        auto transport = std::make_unique<gated_transport>(std::make_unique<virtual_wiimote_transport>(
+                virtual_wiimote_config{.extension = virtual_extension::NUNCHUK, .motionplus = true}));
+        auto &gate = *transport;
+        wiimote mote(std::move(transport));
+        std::this_thread::sleep_for(500ms);
+        gate.close();
+        std::this_thread::sleep_for(50ms);
+
+        const auto reports = canned_reports(REP_IN_BUTTONS_ACC_EXT_16B, 8, true);
+        std::atomic_bool running = true;
+        std::thread decoder([&] {
+            for (auto i = 0u; running.load(std::memory_order_relaxed); ++i) {
+                mote.decode(reports[i % reports.size()]);
+                std::this_thread::sleep_for(1ms);
+            }
+        });
+
+        for (const auto readers: reader_counts) {
+            std::atomic_bool reading = true;
+            std::vector<std::thread> threads;
+            for (auto i = 0u; i < readers; ++i)
+                threads.emplace_back([&] {
+                    while (reading.load(std::memory_order_relaxed)) {
+                        keep(mote.accelerometer());
+                        keep(mote.motionplus());
+                    }
+                });
+
+            run(filter, name("accelerometer", readers), [&](size_t) {
+                keep(mote.accelerometer());
+            });
+            run(filter, name("motionplus", readers), [&](size_t) {
+                keep(mote.motionplus());
+            });
+
+            reading = false;
+            for (auto &thread: threads)
+                thread.join();
+        }
+        running = false;
+        decoder.join();
+    }
+
+    void bench_speaker(std::string_view filter) {
+        std::array<int16_t, speaker_engine::frame_bytes * 2> samples{};
+        for (auto i = 0u; i < samples.size(); ++i)
+            samples[i] = int16_t(8000 * std::sin(double(i) * 0.9));
+        adpcm_encoder encoder;
+        std::array<uint8_t, speaker_engine::frame_bytes> frame{};
+        run(filter, "speaker_adpcm_frame", [&](size_t) {
+            encoder.encode(samples, frame);
+            keep(frame);
+        }, samples.size());
+
+        // Queueing a frame's samples and taking the frame out, as the output slot does
+        speaker_engine engine;
+        engine.start({}, steady_clock::time_point{});
+        run(filter, "speaker_pop_frame", [&](size_t) {
+            engine.push(samples);
+            keep(engine.pop_frame(steady_clock::time_point{}, steady_clock::time_point::max()));
+        });
+    }
+
+    void bench_latency(std::string_view filter) {
+        latency_histogram histogram;
+        run(filter, "latency_record", [&](size_t i) {
+            histogram.record(nanoseconds(1000 + (i & 1023) * 37));
+        });
+
+        // What each instrumented stage pays: reading the clock, then recording the time since a report was read
+        const auto read = steady_clock::now();
+        run(filter, "latency_record_with_clock", [&](size_t) {
+            histogram.record(steady_clock::now() - read);
+        });
+
+        // Recording while another thread records into the same histogram, as the reading and sending threads do
+        std::atomic_bool running = true;
+        std::thread other([&] {
+            for (auto i = 0u; running.load(std::memory_order_relaxed); ++i)
+                histogram.record(nanoseconds(1000 + (i & 1023) * 37));
+        });
+        run(filter, "latency_record_contended", [&](size_t i) {
+            histogram.record(nanoseconds(1000 + (i & 1023) * 37));
+        });
+        running = false;
+        other.join();
+        keep(histogram.summary());
+    }
+}
+
+int main(int argc, char **argv) {
+    const std::string_view filter = argc > 1 ? argv[1] : "";
+    set_info_logger([](std::string const &) {});
+    set_error_logger([](std::string const &) {});
+    bench_fusion(filter);
+    bench_latency(filter);
+    bench_speaker(filter);
+    bench_dsu(filter);
+    bench_decode(filter);
+    bench_readers(filter);
+    if (!bench_batch_decode(filter))
+        return 1;
+}
@@ -0,0 +1,100 @@
+// Resamples a virtual wiimote onto steady output clocks, and prints one JSON line per rate with the delay the
+// resampling adds and the jitter of the reports against that of the output.
+//
+// mote_resample_bench [--rates=250,1000] [--seconds=3] [--delay-us=12000] [--motionplus]
+
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fmt/format.h>
+
+#include "wmote/logging.hpp"
+#include "wmote/resampler.hpp"
+#include "wmote/virtual_wiimote_transport.hpp"
+#include "wmote/wiimote.hpp"
+
+using namespace std::chrono;
+
+namespace {
+    struct options {
+        std::vector<size_t> rates{250, 1000};
+        seconds duration{3};
+        microseconds delay{12'000};
+        bool motionplus = false;
+    };
+
+    std::vector<size_t> parse_list(std::string_view text) {
+        std::vector<size_t> out;
+        while (!text.empty()) {
+            const auto comma = text.find(',');
+            const auto item = text.substr(0, comma);
+            size_t value = 0;
+            std::from_chars(item.data(), item.data() + item.size(), value);
+            if (value)
+                out.push_back(value);
+            text = comma == std::string_view::npos ? std::string_view{} : text.substr(comma + 1);
+        }
+        return out;
+    }
+
+    options parse(int argc, char **argv) {
+        options opts;
+        for (auto i = 1; i < argc; ++i) {
+            std::string_view arg(argv[i]);
+            const auto eq = arg.find('=');
+            const auto key = arg.substr(0, eq);
+            const auto value = eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+            if (key == "--rates")
+                opts.rates = parse_list(value);
+            else if (key == "--seconds")
+                opts.duration = seconds(std::atoi(std::string(value).c_str()));
+            else if (key == "--delay-us")
+                opts.delay = microseconds(std::atoi(std::string(value).c_str()));
+            else if (key == "--motionplus")
+                opts.motionplus = true;
+            else {
+                std::cerr << "Unknown option " << arg << '\n';
+                std::exit(1);
+            }
+        }
+        return opts;
+    }
+
+    void run(options const &opts, size_t rate) {
+        wiimote mote(std::make_unique<virtual_wiimote_transport>(virtual_wiimote_config{
+                .extension = virtual_extension::NUNCHUK, .motionplus = opts.motionplus}));
+        const auto sensors = mote.subscribe(sensor_flags::ACCELEROMETER | sensor_flags::EXTENSION);
+        // Let it settle into its reporting mode
+        std::this_thread::sleep_for(1s);
+
+        motion_resampler resampler(mote, opts.delay);
+        const auto period = duration_cast<steady_clock::duration>(duration<double>(1.0 / double(rate)));
+        const auto end = steady_clock::now() + opts.duration;
+        for (auto next = steady_clock::now(); next < end; next += period) {
+            std::this_thread::sleep_until(next);
+            resampler.sample(steady_clock::now());
+        }
+
+        const auto stats = resampler.stats();
+        const auto us = [](nanoseconds value) { return duration<double, std::micro>(value).count(); };
+        std::cout << fmt::format(R"({{"rate_hz":{},"delay_setting_us":{},"outputs":{},"held":{},)"
+                                 R"("added_delay_avg_us":{:.1f},"added_delay_max_us":{:.1f},)"
+                                 R"("raw_jitter_us":{:.1f},"output_jitter_us":{:.1f}}})",
+                                 rate, opts.delay.count(), stats.outputs, stats.held, us(stats.delay_mean),
+                                 us(stats.delay_max), us(stats.raw_jitter), us(stats.output_jitter)) << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    const auto opts = parse(argc, argv);
+    set_info_logger([](std::string const &) {});
+    set_error_logger([](std::string const &) {});
+    for (const auto rate: opts.rates)
+        run(opts, rate);
+}
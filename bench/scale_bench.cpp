@@ -0,0 +1,171 @@
+// Runs many virtual wiimotes, either with a read and a write thread each or serviced by a reactor,
+// and prints one JSON line per configuration with the CPU, threads and latency it took.
+//
+// mote_scale_bench [--devices=1,8,32,128] [--loops=1,2,4] [--seconds=3] [--interval-us=10000]
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <fmt/format.h>
+
+#include "wmote/logging.hpp"
+#include "wmote/wiimote.hpp"
+#include "wmote/virtual_wiimote_transport.hpp"
+
+using namespace std::chrono;
+
+namespace {
+    struct options {
+        std::vector<size_t> devices{1, 8, 32, 128};
+        std::vector<size_t> loops{1, 2, 4};
+        seconds duration{3};
+        microseconds interval{10'000};
+    };
+
+    std::vector<size_t> parse_list(std::string_view text) {
+        std::vector<size_t> out;
+        while (!text.empty()) {
+            const auto comma = text.find(',');
+            const auto item = text.substr(0, comma);
+            size_t value = 0;
+            std::from_chars(item.data(), item.data() + item.size(), value);
+            if (value)
+                out.push_back(value);
+            text = comma == std::string_view::npos ? std::string_view{} : text.substr(comma + 1);
+        }
+        return out;
+    }
+
+    options parse(int argc, char **argv) {
+        options opts;
+        for (auto i = 1; i < argc; ++i) {
+            std::string_view arg(argv[i]);
+            const auto eq = arg.find('=');
+            const auto key = arg.substr(0, eq);
+            const auto value = eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+            if (key == "--devices")
+                opts.devices = parse_list(value);
+            else if (key == "--loops")
+                opts.loops = parse_list(value);
+            else if (key == "--seconds")
+                opts.duration = seconds(std::atoi(std::string(value).c_str()));
+            else if (key == "--interval-us")
+                opts.interval = microseconds(std::atoi(std::string(value).c_str()));
+            else {
+                std::cerr << "Unknown option " << arg << '\n';
+                std::exit(1);
+            }
+        }
+        return opts;
+    }
+
+    size_t thread_count() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.starts_with("Threads:"))
+                return std::strtoul(line.c_str() + 8, nullptr, 10);
+        }
+        return 0;
+    }
+
+    microseconds cpu_time() {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        const auto tv = [](timeval t) { return seconds(t.tv_sec) + microseconds(t.tv_usec); };
+        return tv(usage.ru_utime) + tv(usage.ru_stime);
+    }
+
+    transport_stats total(std::vector<virtual_wiimote_transport *> const &transports) {
+        transport_stats sum;
+        for (auto *t: transports) {
+            const auto s = t->stats();
+            sum.syscalls += s.syscalls;
+            sum.reports_read += s.reports_read;
+            sum.reports_written += s.reports_written;
+            sum.wakeups += s.wakeups;
+            sum.latency_samples += s.latency_samples;
+            sum.latency_total += s.latency_total;
+            sum.latency_max = std::max(sum.latency_max, s.latency_max);
+        }
+        return sum;
+    }
+
+    std::atomic<size_t> s_errors = 0;
+
+    // loops == 0 runs every wiimote on its own threads
+    void run(size_t devices, size_t loops, options const &opts) {
+        const auto threads_before = thread_count();
+        std::unique_ptr<reactor> event_loop;
+        if (loops)
+            event_loop = std::make_unique<reactor>(loops);
+
+        std::vector<std::unique_ptr<wiimote>> motes;
+        std::vector<sensor_subscription> subscriptions;
+        std::vector<virtual_wiimote_transport *> transports;
+        for (auto i = 0u; i < devices; ++i) {
+            auto transport = std::make_unique<virtual_wiimote_transport>(virtual_wiimote_config{
+                    .report_interval = opts.interval,
+                    .seed = i,
+                    .identifier = fmt::format("virtual-{}", i)});
+            transports.push_back(transport.get());
+            motes.push_back(std::make_unique<wiimote>(std::move(transport), event_loop.get()));
+            // Keep every device reporting continuously
+            subscriptions.push_back(motes.back()->subscribe(sensor_flags::ACCELEROMETER | sensor_flags::IR));
+        }
+
+        // Let every wiimote get through its init sequence first
+        std::this_thread::sleep_for(500ms);
+        const auto threads = thread_count() - threads_before;
+        const auto before = total(transports);
+        const auto cpu_before = cpu_time();
+        const auto start = steady_clock::now();
+        std::this_thread::sleep_for(opts.duration);
+        const auto cpu = cpu_time() - cpu_before;
+        const auto wall = duration_cast<microseconds>(steady_clock::now() - start);
+        const auto after = total(transports);
+
+        subscriptions.clear();
+        motes.clear();
+        event_loop.reset();
+
+        const auto reports = after.reports_read - before.reports_read;
+        const auto samples = after.latency_samples - before.latency_samples;
+        const auto latency = after.latency_total - before.latency_total;
+        const auto expected = double(devices) * wall.count() / opts.interval.count();
+        std::cout << fmt::format(
+                R"({{"model":"{}","devices":{},"loops":{},"threads":{},"cpu_percent_per_device":{:.3f},)"
+                R"("reports_per_second":{:.1f},"delivered":{:.4f},"syscalls_per_report":{:.3f},)"
+                R"("latency_avg_us":{:.1f},"latency_max_us":{:.1f}}})",
+                loops ? "reactor" : "threads", devices, loops, threads,
+                100.0 * cpu.count() / wall.count() / devices,
+                reports * 1e6 / wall.count(), reports / expected,
+                reports ? double(after.syscalls - before.syscalls) / reports : 0.0,
+                samples ? duration<double, std::micro>(latency).count() / samples : 0.0,
+                duration<double, std::micro>(after.latency_max).count()) << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    const auto opts = parse(argc, argv);
+
+    set_info_logger([](std::string const &) {});
+    set_error_logger([](std::string const &) { ++s_errors; });
+
+    for (const auto devices: opts.devices) {
+        run(devices, 0, opts);
+        for (const auto loops: opts.loops)
+            run(devices, loops, opts);
+    }
+    if (s_errors)
+        std::cerr << s_errors << " errors were logged\n";
+}
@@ -11,7 +11,7 @@
 
 
 // Generates a lookup table for the checksums of all 8-bit values.
-std::array<std::uint32_t, 256> generate_crc_lookup_table() noexcept
+inline std::array<std::uint32_t, 256> generate_crc_lookup_table() noexcept
 {
     auto const reversed_polynomial = std::uint32_t{0xEDB88320uL};
 
@@ -31,13 +31,13 @@ bool dsu_server::start(sns::endpoint const &ep) {
         return false;
     }
     log_info("Successfully started dsu server");
+    m_running = true;
     m_read_thread = std::jthread([this] { read_loop(); });
     m_write_thread = std::jthread([this] {send_loop(); });
     return true;
 }
 
 void dsu_server::read_loop() {
-    m_running = true;
     sns::endpoint endpoint{};
     buffer<512> buffer;
     while (m_running.load(std::memory_order_relaxed)) {
@@ -111,7 +111,15 @@ void dsu_server::set_controller_data_handler(const controller_data_handler &hand
     m_controller_data_handler = handler;
 }
 
-void dsu_server::send(types::event_type type, std::span<const u8> data, dsu_server::client_t &client) {
+void dsu_server::set_send_observer(const send_observer &observer) {
+    m_send_observer = observer;
+}
+
+void dsu_server::set_send_interval(std::chrono::microseconds interval) {
+    m_send_interval = interval;
+}
+
+std::vector<u8> dsu_server::encode(types::event_type type, std::span<const u8> data) const {
     // Message size, no header
     const auto size = out_msg_size(type);
     constexpr auto header_size = sizeof(msg::header);
@@ -126,9 +134,19 @@ void dsu_server::send(types::event_type type, std::span<const u8> data, dsu_serv
     header->crc32 = 0;
     std::copy(data.begin(), data.end(), out_data.begin() + header_size);
     header->crc32 = crc(out_data.begin(), out_data.end());
+    return out_data;
+}
 
+void dsu_server::send(types::event_type type, std::span<const u8> data, dsu_server::client_t &client) {
+    auto out_data = encode(type, data);
+
+    const bool observed = m_send_observer && type == types::event_type::CONTROLLER_DATA;
+    const auto encoded = observed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
     const auto res = m_socket.send_to(out_data, client.ep, 0);
     assert(res.has_value());
+    if (observed)
+        m_send_observer(*reinterpret_cast<msg::controller_data_report const *>(data.data()), encoded,
+                        std::chrono::steady_clock::now());
 }
 
 void dsu_server::stop() {
@@ -137,14 +155,17 @@ void dsu_server::stop() {
 
 void dsu_server::send_loop() {
     using namespace std::chrono;
-    using namespace std::chrono_literals;
-    auto prev = system_clock::now();
-    auto time = prev;
+    // Sends on a fixed clock, so clients see a steady stream
+    auto next = steady_clock::now();
 
     while (m_running.load(std::memory_order_relaxed)){
-        for (time = system_clock::now(); (time - prev) < 5ms; time = system_clock::now()){
-            // Waste time
-        }
+        const auto interval = m_send_interval.load(std::memory_order_relaxed);
+        next += interval;
+        // After falling a whole interval behind, start the clock again rather than sending a burst
+        if (steady_clock::now() - next > interval)
+            next = steady_clock::now();
+        std::this_thread::sleep_until(next);
+
         if (m_controller_data_handler){
             for (auto&[id, client] : m_clients){
                 msg::controller_data_request req{};
@@ -158,11 +179,6 @@ void dsu_server::send_loop() {
                     send(types::event_type::CONTROLLER_DATA, span_of(response), client);
                 }
             }
-            prev = system_clock::now();
-
         }
-
     }
 }
-
-
@@ -1,10 +1,13 @@
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <functional>
 #include <queue>
 #include <span>
 #include <unordered_map>
+#include <vector>
 
 #include "net/udp_socket.hpp"
 #include "net/endpoint.hpp"
@@ -12,6 +15,10 @@
 
 using status_handler = std::function<std::vector<msg::status_report>(msg::status_request const&)>;
 using controller_data_handler = std::function<std::vector<msg::controller_data_report>(msg::controller_data_request const&)>;
+// Called from the thread that sent a controller data report, right after its handler returned it, with when it was
+// encoded and when sendto returned
+using send_observer = std::function<void(msg::controller_data_report const&, std::chrono::steady_clock::time_point encoded,
+                                         std::chrono::steady_clock::time_point sent)>;
 
 class dsu_server {
     constexpr static u16 protocol_version = 1001;
@@ -34,9 +41,16 @@ public:
 
     void set_status_handler(const status_handler& handler);
     void set_controller_data_handler(const controller_data_handler& handler);
+    void set_send_observer(const send_observer& observer);
+    // Time between controller data sent to each client, 5ms by default
+    void set_send_interval(std::chrono::microseconds interval);
+
+    // The packet sent to clients for a message, with its header and checksum
+    std::vector<u8> encode(types::event_type type, std::span<const u8> data) const;
 private:
     status_handler m_status_handler;
     controller_data_handler m_controller_data_handler;
+    send_observer m_send_observer;
 private:
     void send(types::event_type type, std::span<const u8> data, client_t& client);
     void read_loop();
@@ -49,6 +63,7 @@ private:
     std::jthread m_read_thread;
     std::jthread m_write_thread;
     std::atomic_bool m_running;
+    std::atomic<std::chrono::microseconds> m_send_interval{std::chrono::microseconds(5000)};
 };
 
 
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+
+#include "remap.hpp"
+
+namespace {
+    constexpr size_t no_analog = 0xff;
+
+    // Index into analog_buttons, which is laid out in its own order
+    constexpr size_t analog_index(remap_target target) {
+        switch (target) {
+            case remap_target::DPAD_LEFT:
+                return 0;
+            case remap_target::DPAD_DOWN:
+                return 1;
+            case remap_target::DPAD_RIGHT:
+                return 2;
+            case remap_target::DPAD_UP:
+                return 3;
+            case remap_target::Y:
+                return 4;
+            case remap_target::B:
+                return 5;
+            case remap_target::A:
+                return 6;
+            case remap_target::X:
+                return 7;
+            case remap_target::L1:
+                return 8;
+            case remap_target::R1:
+                return 9;
+            case remap_target::R2:
+                return 10;
+            case remap_target::L2:
+                return 11;
+            default:
+                return no_analog;
+        }
+    }
+
+    using report_buttons = decltype(msg::controller_data_report::buttons);
+    using report_analog = decltype(msg::controller_data_report::analog_buttons);
+    static_assert(sizeof(report_buttons) == 4);
+    static_assert(sizeof(report_analog) == 12);
+    constexpr size_t buttons_offset = sizeof(report_analog);
+
+    using u32x4 = u32 __attribute__((vector_size(16)));
+    using u64x2 = u64 __attribute__((vector_size(16)));
+}
+
+remap_table::remap_table(std::span<const remap_entry> entries) {
+    for (auto const &entry: entries) {
+        if (!std::has_single_bit(entry.source))
+            throw std::invalid_argument("Remap source must be a single bit");
+        if (entry.target >= remap_target::COUNT)
+            throw std::invalid_argument("Remap target out of range");
+
+        const auto bit = std::countr_zero(entry.source);
+        const auto target = static_cast<size_t>(entry.target);
+        const auto analog = analog_index(entry.target);
+        auto &lookup = m_lookup[bit / 8];
+        const auto mask = 1u << (bit % 8);
+        // Every value of the byte with the source bit set presses the target
+        for (auto value = 0u; value < lookup.size(); ++value) {
+            if (!(value & mask))
+                continue;
+            auto &out = lookup[value];
+            if (entry.target == remap_target::HOME)
+                out[buttons_offset + 2] = 1;
+            else if (entry.target == remap_target::TOUCH)
+                out[buttons_offset + 3] = 1;
+            else
+                out[buttons_offset + target / 8] |= u8(1u << (target % 8));
+            if (analog != no_analog)
+                out[analog] = std::max(u8(out[analog]), entry.analog);
+        }
+    }
+}
+
+void remap_table::apply(u32 inputs, msg::controller_data_report &report) const {
+    const auto max = [](byte16 a, byte16 b) -> byte16 { return a > b ? a : b; };
+    const auto lookup = [&](size_t i) { return m_lookup[i][(inputs >> (8 * i)) & 0xff]; };
+    const auto first = lookup(0), second = lookup(1), third = lookup(2), fourth = lookup(3);
+
+    // Buttons are bits, so combine with or, analog buttons with max
+    constexpr byte16 buttons_mask{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0xff, 0xff};
+    const byte16 pressed = first | second | third | fourth;
+    const byte16 analog = max(max(first, second), max(third, fourth));
+    const byte16 result = (pressed & buttons_mask) | (analog & ~buttons_mask);
+
+    // Taken out lane by lane rather than through memory, which would stall on the narrower reloads
+    const u64 analog_low = u64x2(result)[0];
+    const u32 analog_high = u32x4(result)[2];
+    const u32 buttons = u32x4(result)[3];
+    std::memcpy(&report.buttons, &buttons, sizeof(buttons));
+    std::memcpy(&report.analog_buttons, &analog_low, sizeof(analog_low));
+    std::memcpy(reinterpret_cast<u8 *>(&report.analog_buttons) + sizeof(analog_low), &analog_high,
+                sizeof(analog_high));
+}
+
+void remap_slots::set(u8 slot, std::shared_ptr<const remap_table> table) {
+    if (slot >= slot_count)
+        throw std::invalid_argument("Slot out of range");
+    const auto pointer = table.get();
+    if (table) {
+        std::scoped_lock lock(m_mutex);
+        if (std::find(m_kept.begin(), m_kept.end(), table) == m_kept.end())
+            m_kept.push_back(std::move(table));
+    }
+    m_tables[slot].store(pointer, std::memory_order_release);
+}
+
+remap_table const *remap_slots::get(u8 slot) const {
+    if (slot >= slot_count)
+        return nullptr;
+    return m_tables[slot].load(std::memory_order_acquire);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "messages.hpp"
+
+// Outputs of a controller data report a source can be mapped to. The first 16 are the bits of its buttons, in order.
+enum class remap_target : u8 {
+    SHARE,
+    L3,
+    R3,
+    OPTIONS,
+    DPAD_UP,
+    DPAD_RIGHT,
+    DPAD_DOWN,
+    DPAD_LEFT,
+    L2,
+    R2,
+    L1,
+    R1,
+    X,
+    A,
+    B,
+    Y,
+    HOME,
+    TOUCH,
+    COUNT
+};
+
+// Presses target while the source bit is set in the inputs. Targets with an analog button, the dpad, face and shoulder
+// buttons, also get it pressed as hard as analog says.
+struct remap_entry {
+    u32 source;
+    remap_target target;
+    u8 analog = 255;
+};
+
+// A remap table compiled into one lookup per byte of the inputs, so mapping takes four vector loads, ors and maxes and
+// no branches however many entries the table has. Sources that share a target press it, as hard as the hardest of them.
+class remap_table {
+public:
+    // Sources must be single bits
+    explicit remap_table(std::span<const remap_entry> entries);
+
+    // Sets the buttons and analog buttons of the report from the inputs
+    void apply(u32 inputs, msg::controller_data_report &report) const;
+
+private:
+    // The analog buttons of a report, followed by its buttons, so both are whole lanes
+    using byte16 = u8 __attribute__((vector_size(16)));
+
+    std::array<std::array<byte16, 256>, 4> m_lookup{};
+};
+
+// The table in use for each slot, swapped without locks while reports are built. Tables are published as plain
+// pointers, as std::atomic<std::shared_ptr> takes a lock, and every table ever set is kept until the slots are
+// destroyed, so a reader never sees one freed.
+class remap_slots {
+public:
+    constexpr static size_t slot_count = 4;
+
+    // Null clears the slot
+    void set(u8 slot, std::shared_ptr<const remap_table> table);
+
+    // Null if nothing was set for the slot. Valid for as long as the slots.
+    remap_table const *get(u8 slot) const;
+
+private:
+    std::array<std::atomic<remap_table const *>, slot_count> m_tables{};
+    // Guards m_kept, setting is rare and never done while building reports
+    std::mutex m_mutex;
+    std::vector<std::shared_ptr<const remap_table>> m_kept;
+};
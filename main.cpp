@@ -1,26 +1,124 @@
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "ArgumentSelectionDefects"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <csignal>
 #include <iostream>
 #include <chrono>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include "dsulib/dsu_server.hpp"
+#include "dsulib/remap.hpp"
 #include "wmote/logging.hpp"
 #include "wmote/wiimote.hpp"
 #include "wmote/reads.hpp"
+#include "wmote/resampler.hpp"
 
 constexpr float float_max = std::numeric_limits<float>::infinity();
 constexpr float float_min = -std::numeric_limits<float>::infinity();
 using namespace std::chrono_literals;
 
+namespace {
+    std::atomic_bool s_stop = false;
+
+    // When the newest report behind the controller data this thread is sending was read. The server calls the send
+    // observer on the same thread, straight after the handler, so it always sees the value for its own report.
+    thread_local std::optional<std::chrono::steady_clock::time_point> t_report_source;
+
+    // Time from a report being read until the controller data made from it was encoded, and until sendto returned
+    struct send_latency {
+        latency_histogram encoded;
+        latency_histogram sent;
+    };
+
+    // Sensor bar visibility as last sent to a slot, which numbers its touches on its own
+    struct slot_touch {
+        uint8_t id = 0;
+        bool was_visible = false;
+    };
+
+    // Nunchuk buttons follow the wiimote's own in the inputs that are remapped
+    constexpr u32 input_c = 1u << 16;
+    constexpr u32 input_z = 1u << 17;
+
+    constexpr auto wiimote_input(button_flags button) {
+        return u32(button);
+    }
+
+    constexpr std::array default_remap_entries{
+            remap_entry{wiimote_input(button_flags::DPAD_UP), remap_target::DPAD_UP},
+            remap_entry{wiimote_input(button_flags::DPAD_DOWN), remap_target::DPAD_DOWN},
+            remap_entry{wiimote_input(button_flags::DPAD_LEFT), remap_target::DPAD_LEFT},
+            remap_entry{wiimote_input(button_flags::DPAD_RIGHT), remap_target::DPAD_RIGHT},
+            remap_entry{wiimote_input(button_flags::HOME), remap_target::HOME},
+            remap_entry{wiimote_input(button_flags::A), remap_target::A},
+            remap_entry{wiimote_input(button_flags::B), remap_target::B},
+            remap_entry{wiimote_input(button_flags::ONE), remap_target::X},
+            remap_entry{wiimote_input(button_flags::TWO), remap_target::Y},
+            remap_entry{wiimote_input(button_flags::PLUS), remap_target::OPTIONS},
+            remap_entry{wiimote_input(button_flags::MINUS), remap_target::SHARE},
+            remap_entry{input_c, remap_target::L1},
+            remap_entry{input_z, remap_target::L2},
+    };
+
+    // The wiimote's buttons, and those of a nunchuk if there is one
+    u32 remap_inputs(wiimote const &mote) {
+        auto inputs = wiimote_input(mote.get_buttons());
+        const auto extension = mote.get_extension_buttons();
+        inputs |= !!(extension & extension_button_flags::C) ? input_c : 0;
+        inputs |= !!(extension & extension_button_flags::Z) ? input_z : 0;
+        return inputs;
+    }
+
+    void print_latency(std::string_view stage, latency_histogram const &histogram) {
+        using namespace std::chrono;
+        const auto summary = histogram.summary();
+        const auto us = [](nanoseconds value) { return duration<double, std::micro>(value).count(); };
+        std::cout << fmt::format("{:<16} {:>9} reports  p50 {:8.1f}us  p99 {:8.1f}us  p999 {:8.1f}us  max {:8.1f}us\n",
+                                 stage, summary.count, us(summary.p50), us(summary.p99), us(summary.p999),
+                                 us(summary.max));
+    }
+
+    void print_latency(wiimote const &mote, std::span<const send_latency> slots) {
+        print_latency("decoded", mote.latency().decoded);
+        print_latency("published", mote.latency().published);
+        for (auto i = 0u; i < slots.size(); ++i) {
+            if (slots[i].sent.count() == 0)
+                continue;
+            print_latency(fmt::format("slot {} encoded", i), slots[i].encoded);
+            print_latency(fmt::format("slot {} sent", i), slots[i].sent);
+        }
+    }
+}
+
 int main() {
     set_info_logger([](std::string const &s) { std::cout << s << '\n'; });
+    std::signal(SIGINT, [](int) { s_stop = true; });
+    std::signal(SIGTERM, [](int) { s_stop = true; });
 
+    // Outlives the server, whose threads record into it
+    std::array<send_latency, 4> slot_latency;
     wiimote mote(0x057e, 0x0306, {});
+    // Motion, gyro from the motionplus and the pointer all go out to DSU clients
+    const auto sensors = mote.subscribe(sensor_flags::ACCELEROMETER | sensor_flags::IR | sensor_flags::EXTENSION);
     dsu_server server;
+    // The handler runs on both of the server's threads
+    motion_resampler resampler(mote);
+    std::array<slot_touch, 4> slot_touches;
+    // Guards the resampler and the slots' touches
+    std::mutex resampler_mutex;
+    // Every slot starts out with the default mapping, and can be given its own while the server runs
+    remap_slots remaps;
+    const auto default_remap = std::make_shared<const remap_table>(default_remap_entries);
+    for (auto slot = 0u; slot < remap_slots::slot_count; ++slot)
+        remaps.set(slot, default_remap);
     // Server handlers
     auto wm_status_get = [&mote](uint8_t slot_no) {
-        auto connected = true;
+        auto connected = mote.connected();
         auto wm_status = mote.status();
 
         types::device_info dev;
@@ -47,8 +145,9 @@ int main() {
         });
         using namespace std::chrono;
         using namespace std::chrono_literals;
-        server.set_controller_data_handler([&mote, &wm_status_get](msg::controller_data_request const &req) {
-            const static auto start_time = system_clock::now();
+        // Motion goes out at 250Hz, interpolated from the reports rather than repeating whichever came last
+        server.set_send_interval(4ms);
+        server.set_controller_data_handler([&mote, &wm_status_get, &resampler, &resampler_mutex, &remaps, &slot_touches](msg::controller_data_request const &req) {
             std::vector<msg::controller_data_report> reports;
 
             if (req.reg_mode != types::RegistrationMode::SLOT)
@@ -56,6 +155,7 @@ int main() {
 
             msg::controller_data_report rep;
             rep.dev = wm_status_get(req.slot);
+            t_report_source.reset();
 
             if (rep.dev.slot_state != types::SlotState::CONNECTED) {
                 rep.connected = false;
@@ -63,50 +163,63 @@ int main() {
                 return reports;
             }
             rep.connected = true;
-            // Buttons
-            {
-                auto buttons = mote.get_buttons();
-                rep.buttons.dpad_down = !!(buttons & button_flags::DPAD_DOWN);
-                rep.buttons.dpad_up = !!(buttons & button_flags::DPAD_UP);
-                rep.buttons.dpad_left = !!(buttons & button_flags::DPAD_LEFT);
-                rep.buttons.dpad_right = !!(buttons & button_flags::DPAD_RIGHT);
-                rep.buttons.home = !!(buttons & button_flags::DPAD_RIGHT);
-                rep.buttons.a = !!(buttons & button_flags::A);
-                rep.buttons.b = !!(buttons & button_flags::B);
-                rep.buttons.x = !!(buttons & button_flags::ONE);
-                rep.buttons.y = !!(buttons & button_flags::TWO);
-                rep.buttons.options = !!(buttons & button_flags::PLUS);
-                rep.buttons.share = !!(buttons & button_flags::MINUS);
-                rep.buttons.touch = false;
+            // Buttons, analog ones pressed all the way
+            if (const auto table = remaps.get(req.slot)) {
+                table->apply(remap_inputs(mote), rep);
+            } else {
+                rep.buttons = {};
+                rep.analog_buttons = {};
             }
 
-            auto acc = mote.accelerometer();
-            rep.acc_timestamp_us = duration_cast<microseconds>(system_clock::now() - start_time).count();
-            rep.acc.x = acc.x;
-            rep.acc.y = acc.y;
-            rep.acc.z = acc.z;
+            resampled_motion motion;
+            {
+                std::scoped_lock lock(resampler_mutex);
+                motion = resampler.sample(steady_clock::now());
+            }
+            t_report_source = motion.source;
+            rep.acc_timestamp_us = duration_cast<microseconds>(motion.timestamp.time_since_epoch()).count();
+            // Same axes and scale as wiimote::accelerometer()
+            rep.acc.x = motion.acc.x / 8;
+            rep.acc.y = -motion.acc.z / 8;
+            rep.acc.z = -motion.acc.y / 8;
 
-            auto mpls = mote.motionplus();
+            auto const &mpls = motion.gyro;
             if (mpls) {
                 rep.dev.model = types::GyroModel::FULL;
                 rep.gyro.pitch = mpls->x;
                 rep.gyro.yaw = mpls->y;
                 rep.gyro.roll = mpls->z;
             }
-            // Analog buttons
+            // IR pointer as a touch on a DS4 sized touchpad, with a new id each time the sensor bar comes into view
             {
-                rep.analog_buttons.dpad_down = rep.buttons.dpad_down * 255;
-                rep.analog_buttons.dpad_up = rep.buttons.dpad_up * 255;
-                rep.analog_buttons.dpad_right = rep.buttons.dpad_right * 255;
-                rep.analog_buttons.a = rep.buttons.a * 255;
-                rep.analog_buttons.x = rep.buttons.x * 255;
-                rep.analog_buttons.b = rep.buttons.b * 255;
-                rep.analog_buttons.y = rep.buttons.y * 255;
+                const auto pointer = mote.pointer();
+                uint8_t touch_id = 0;
+                if (rep.dev.slot < slot_touches.size()) {
+                    std::scoped_lock lock(resampler_mutex);
+                    auto &touch = slot_touches[rep.dev.slot];
+                    if (pointer.visible && !touch.was_visible)
+                        ++touch.id;
+                    touch.was_visible = pointer.visible;
+                    touch_id = touch.id;
+                }
+
+                rep.touch_1.active = pointer.visible;
+                rep.touch_1.id = touch_id;
+                rep.touch_1.x = u16(std::clamp(pointer.position.x, 0.0f, 1.0f) * 1919);
+                rep.touch_1.y = u16(std::clamp(pointer.position.y, 0.0f, 1.0f) * 941);
+                rep.touch_2 = {};
             }
             reports.push_back(rep);
 
             return reports;
         });
+        server.set_send_observer([&slot_latency](msg::controller_data_report const &rep, steady_clock::time_point encoded,
+                                                 steady_clock::time_point sent) {
+            if (!t_report_source || rep.dev.slot >= slot_latency.size())
+                return;
+            slot_latency[rep.dev.slot].encoded.record(encoded - *t_report_source);
+            slot_latency[rep.dev.slot].sent.record(sent - *t_report_source);
+        });
     }
     //server.start({"127.0.0.1", 26760});
     size_t led_index = 0;
@@ -114,7 +227,7 @@ int main() {
     vec3<float> acc_min{float_max, float_max, float_max};
     std::this_thread::sleep_for(1s);
 
-    for (;;) {
+    while (!s_stop) {
         // Wait for button release
         if (!!(mote.get_buttons() & button_flags::A)) {
             while (!!(mote.get_buttons() & button_flags::A));
@@ -148,6 +261,11 @@ int main() {
             mote.set_leds((led_flags) mask);
             --led_index;
         }
+
+        if (!!(mote.get_buttons() & button_flags::HOME)) {
+            while (!!(mote.get_buttons() & button_flags::HOME));
+            print_latency(mote, slot_latency);
+        }
 //        auto acc = mote.motionplus();
 //        acc_min = min(acc, acc_min);
 //        acc_max = max(acc, acc_max);
@@ -159,6 +277,8 @@ int main() {
 //                                 acc_max.x, acc_max.y, acc_max.z);
     }
 
+    server.stop();
+    print_latency(mote, slot_latency);
     return 0;
 }
 
@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WMOTE_HAS_AVX2_DECODER 1
+#endif
+
+#include "batch_decoder.hpp"
+
+namespace {
+    // Bits of the button bytes that are buttons, the rest carry accelerometer bits
+    constexpr uint16_t button_mask = 0x9f1f;
+    constexpr uint16_t ir_not_visible = 0x3ff;
+
+    void prepare(report_columns &out, report_layout const &layout, bool motionplus, size_t count) {
+        const auto size_if = [count](bool present) { return present ? count : 0; };
+        out.size = count;
+        out.buttons.resize(size_if(layout.buttons));
+        for (auto &axis: out.acc)
+            axis.resize(size_if(layout.acc));
+        for (auto &axis: out.gyro)
+            axis.resize(size_if(motionplus));
+        out.gyro_valid.resize(size_if(motionplus));
+        out.gyro_slow.resize(size_if(motionplus));
+        for (auto i = 0u; i < 4; ++i) {
+            out.ir_x[i].resize(size_if(layout.ir != ir_format::NONE));
+            out.ir_y[i].resize(size_if(layout.ir != ir_format::NONE));
+            out.ir_size[i].resize(size_if(layout.ir == ir_format::EXTENDED));
+        }
+    }
+
+    void decode_one(uint8_t const *r, size_t i, report_layout const &layout, bool motionplus, report_columns &out) {
+        if (layout.buttons)
+            out.buttons[i] = (r[1] | r[2] << 8) & button_mask;
+        if (layout.acc) {
+            out.acc[0][i] = r[3] << 2 | (r[1] >> 6 & 1) << 1 | (r[1] >> 5 & 1);
+            out.acc[1][i] = r[4] << 2 | (r[2] >> 5 & 1) << 1;
+            out.acc[2][i] = r[5] << 2 | (r[2] >> 6 & 1) << 1;
+        }
+        if (layout.ir == ir_format::EXTENDED) {
+            for (auto d = 0u; d < 4; ++d) {
+                auto const *p = r + layout.ir_offset + d * 3;
+                out.ir_x[d][i] = p[0] | (p[2] >> 4 & 3) << 8;
+                out.ir_y[d][i] = p[1] | (p[2] >> 6 & 3) << 8;
+                out.ir_size[d][i] = p[2] & 0xf;
+            }
+        } else if (layout.ir == ir_format::BASIC) {
+            for (auto pair = 0u; pair < 2; ++pair) {
+                auto const *p = r + layout.ir_offset + pair * 5;
+                out.ir_x[pair * 2][i] = p[0] | (p[2] >> 4 & 3) << 8;
+                out.ir_y[pair * 2][i] = p[1] | (p[2] >> 6 & 3) << 8;
+                out.ir_x[pair * 2 + 1][i] = p[3] | (p[2] & 3) << 8;
+                out.ir_y[pair * 2 + 1][i] = p[4] | (p[2] >> 2 & 3) << 8;
+            }
+        }
+        if (motionplus) {
+            auto const *e = r + layout.extension_offset;
+            const uint16_t valid = e[5] >> 1 & 1;
+            out.gyro[0][i] = (e[0] | (e[3] >> 2) << 8) * valid;
+            out.gyro[1][i] = (e[2] | (e[5] >> 2) << 8) * valid;
+            out.gyro[2][i] = (e[1] | (e[4] >> 2) << 8) * valid;
+            out.gyro_valid[i] = valid;
+            out.gyro_slow[i] = ((e[3] >> 1 & 1) | (e[3] & 1) << 1 | (e[4] >> 1 & 1) << 2) * valid;
+        }
+    }
+
+#if defined(WMOTE_HAS_AVX2_DECODER)
+#define WMOTE_AVX2 __attribute__((target("avx2")))
+
+    // A 32 bit window of every report in a group of eight, with the bytes it covers
+    struct window {
+        __m256i words;
+        int start;
+    };
+
+    WMOTE_AVX2 inline window load_window(uint8_t const *r, __m256i offsets, int start) {
+        return {_mm256_i32gather_epi32(reinterpret_cast<int const *>(r + start), offsets, 1), start};
+    }
+
+    // Byte at offset, which must lie in the window, of each of the eight reports
+    WMOTE_AVX2 inline __m256i byte_at(window const &w, int offset) {
+        return _mm256_and_si256(_mm256_srl_epi32(w.words, _mm_cvtsi32_si128(8 * (offset - w.start))),
+                                _mm256_set1_epi32(0xff));
+    }
+
+    WMOTE_AVX2 inline __m256i bits(__m256i v, int shift, int mask) {
+        return _mm256_and_si256(_mm256_srli_epi32(v, shift), _mm256_set1_epi32(mask));
+    }
+
+    WMOTE_AVX2 inline void store_u16(uint16_t *out, __m256i v) {
+        const auto packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0b1000);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm256_castsi256_si128(packed));
+    }
+
+    WMOTE_AVX2 inline void store_u8(uint8_t *out, __m256i v) {
+        const auto words = _mm256_packus_epi32(v, v);
+        const auto bytes = _mm256_packus_epi16(words, words);
+        const auto packed = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out), _mm256_castsi256_si128(packed));
+    }
+
+    // Decodes groups of eight reports, returning how many reports it got through
+    WMOTE_AVX2 size_t decode_avx2(uint8_t const *base, size_t stride, size_t count, report_layout const &layout,
+                                  bool motionplus, report_columns &out) {
+        const auto offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                _mm256_set1_epi32(int(stride)));
+        // Windows are moved back to end at the last byte of the report, rather than read past it
+        const int last_window = layout.size - 4;
+        const auto load = [&](uint8_t const *r, int start) {
+            return load_window(r, offsets, std::min(start, last_window));
+        };
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            auto const *r = base + i * stride;
+
+            if (layout.buttons) {
+                const auto w = load(r, 1);
+                const auto b0 = byte_at(w, 1);
+                const auto b1 = byte_at(w, 2);
+                const auto buttons = _mm256_and_si256(_mm256_or_si256(b0, _mm256_slli_epi32(b1, 8)),
+                                                      _mm256_set1_epi32(button_mask));
+                store_u16(&out.buttons[i], buttons);
+
+                if (layout.acc) {
+                    const auto x = _mm256_or_si256(_mm256_slli_epi32(byte_at(w, 3), 2),
+                                                   _mm256_or_si256(_mm256_slli_epi32(bits(b0, 6, 1), 1),
+                                                                   bits(b0, 5, 1)));
+                    const auto yz = load(r, 2);
+                    const auto y = _mm256_or_si256(_mm256_slli_epi32(byte_at(yz, 4), 2),
+                                                   _mm256_slli_epi32(bits(b1, 5, 1), 1));
+                    const auto z = _mm256_or_si256(_mm256_slli_epi32(byte_at(yz, 5), 2),
+                                                   _mm256_slli_epi32(bits(b1, 6, 1), 1));
+                    store_u16(&out.acc[0][i], x);
+                    store_u16(&out.acc[1][i], y);
+                    store_u16(&out.acc[2][i], z);
+                }
+            }
+
+            if (layout.ir == ir_format::EXTENDED) {
+                for (auto d = 0; d < 4; ++d) {
+                    const int offset = layout.ir_offset + d * 3;
+                    const auto w = load(r, offset);
+                    const auto high = byte_at(w, offset + 2);
+                    store_u16(&out.ir_x[d][i], _mm256_or_si256(byte_at(w, offset), _mm256_slli_epi32(bits(high, 4, 3), 8)));
+                    store_u16(&out.ir_y[d][i], _mm256_or_si256(byte_at(w, offset + 1), _mm256_slli_epi32(bits(high, 6, 3), 8)));
+                    store_u8(&out.ir_size[d][i], bits(high, 0, 0xf));
+                }
+            } else if (layout.ir == ir_format::BASIC) {
+                for (auto pair = 0; pair < 2; ++pair) {
+                    const int offset = layout.ir_offset + pair * 5;
+                    const auto first = load(r, offset);
+                    const auto second = load(r, offset + 1);
+                    const auto high = byte_at(first, offset + 2);
+                    store_u16(&out.ir_x[pair * 2][i],
+                              _mm256_or_si256(byte_at(first, offset), _mm256_slli_epi32(bits(high, 4, 3), 8)));
+                    store_u16(&out.ir_y[pair * 2][i],
+                              _mm256_or_si256(byte_at(first, offset + 1), _mm256_slli_epi32(bits(high, 6, 3), 8)));
+                    store_u16(&out.ir_x[pair * 2 + 1][i],
+                              _mm256_or_si256(byte_at(second, offset + 3), _mm256_slli_epi32(bits(high, 0, 3), 8)));
+                    store_u16(&out.ir_y[pair * 2 + 1][i],
+                              _mm256_or_si256(byte_at(second, offset + 4), _mm256_slli_epi32(bits(high, 2, 3), 8)));
+                }
+            }
+
+            if (motionplus) {
+                const int offset = layout.extension_offset;
+                const auto low = load(r, offset);
+                const auto high = load(r, offset + 2);
+                const auto e3 = byte_at(high, offset + 3);
+                const auto e4 = byte_at(high, offset + 4);
+                const auto e5 = byte_at(high, offset + 5);
+                const auto valid = bits(e5, 1, 1);
+                // All ones where the report carries motionplus data
+                const auto keep = _mm256_sub_epi32(_mm256_setzero_si256(), valid);
+
+                const auto yaw = _mm256_or_si256(byte_at(low, offset), _mm256_slli_epi32(_mm256_srli_epi32(e3, 2), 8));
+                const auto pitch = _mm256_or_si256(byte_at(high, offset + 2), _mm256_slli_epi32(_mm256_srli_epi32(e5, 2), 8));
+                const auto roll = _mm256_or_si256(byte_at(low, offset + 1), _mm256_slli_epi32(_mm256_srli_epi32(e4, 2), 8));
+                const auto slow = _mm256_or_si256(_mm256_or_si256(bits(e3, 1, 1), _mm256_slli_epi32(bits(e3, 0, 1), 1)),
+                                                  _mm256_slli_epi32(bits(e4, 1, 1), 2));
+                store_u16(&out.gyro[0][i], _mm256_and_si256(yaw, keep));
+                store_u16(&out.gyro[1][i], _mm256_and_si256(pitch, keep));
+                store_u16(&out.gyro[2][i], _mm256_and_si256(roll, keep));
+                store_u8(&out.gyro_valid[i], valid);
+                store_u8(&out.gyro_slow[i], _mm256_and_si256(slow, keep));
+            }
+        }
+        return i;
+    }
+
+#undef WMOTE_AVX2
+#endif
+}
+
+batch_decoder::batch_decoder(uint8_t mode, bool motionplus, std::optional<isa> force)
+        : m_layout(layout_of(mode)), m_motionplus(motionplus), m_isa(force.value_or(best_isa())) {
+    if (!m_layout.valid() || m_layout.ir == ir_format::FULL)
+        throw std::invalid_argument("Reporting mode has no fixed layout");
+    if (m_motionplus && m_layout.extension_size < 6)
+        throw std::invalid_argument("Reporting mode can't carry motionplus data");
+    if (m_isa == isa::AVX2 && best_isa() != isa::AVX2)
+        throw std::invalid_argument("AVX2 isn't supported");
+}
+
+batch_decoder::isa batch_decoder::best_isa() {
+#if defined(WMOTE_HAS_AVX2_DECODER)
+    if (__builtin_cpu_supports("avx2"))
+        return isa::AVX2;
+#endif
+    return isa::SCALAR;
+}
+
+size_t batch_decoder::decode(std::span<const uint8_t> reports, size_t stride, report_columns &out) const {
+    if (stride < m_layout.size)
+        throw std::invalid_argument("Stride is shorter than a report");
+    const auto count = reports.size() < m_layout.size ? 0 : (reports.size() - m_layout.size) / stride + 1;
+    prepare(out, m_layout, m_motionplus, count);
+
+    size_t done = 0;
+#if defined(WMOTE_HAS_AVX2_DECODER)
+    // Windows are 4 bytes, so the shortest reports are left to the scalar code
+    if (m_isa == isa::AVX2 && m_layout.size >= 6)
+        done = decode_avx2(reports.data(), stride, count, m_layout, m_motionplus, out);
+#endif
+    for (auto i = done; i < count; ++i)
+        decode_one(reports.data() + i * stride, i, m_layout, m_motionplus, out);
+    return count;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "report_layout.hpp"
+
+// Fields of a batch of reports, one array per field, indexed by report.
+// Values are raw, before calibration. Fields the reporting mode doesn't carry are left empty.
+struct report_columns {
+    size_t size = 0;
+    // Button bits as in button_flags
+    std::vector<uint16_t> buttons;
+    // x, y and z, 10 bits each
+    std::array<std::vector<uint16_t>, 3> acc;
+    // Yaw, pitch and roll, 14 bits each, zero when the report carries extension data instead
+    std::array<std::vector<uint16_t>, 3> gyro;
+    std::vector<uint8_t> gyro_valid;
+    // Bit 0 set for slow yaw, bit 1 for slow pitch and bit 2 for slow roll
+    std::vector<uint8_t> gyro_slow;
+    // Per dot, 0x3ff in both x and y when the dot isn't visible
+    std::array<std::vector<uint16_t>, 4> ir_x;
+    std::array<std::vector<uint16_t>, 4> ir_y;
+    // Only in extended IR reports
+    std::array<std::vector<uint8_t>, 4> ir_size;
+};
+
+// Decodes many reports of one reporting mode at once, for offline analysis of recordings.
+// Uses AVX2 where the CPU has it, decoding eight reports per step, and gives the same results as the scalar code.
+class batch_decoder {
+public:
+    enum class isa {
+        SCALAR,
+        AVX2
+    };
+
+    // Takes any data report with a fixed layout, which leaves out the interleaved modes.
+    // With motionplus set, extension bytes are decoded as motionplus data.
+    // Throws std::invalid_argument for other modes, or if the CPU can't run the forced implementation.
+    explicit batch_decoder(uint8_t mode, bool motionplus = false, std::optional<isa> force = {});
+
+    // Decodes every whole report in reports, the first starting at its report id and each following stride bytes
+    // after the last. Report ids aren't checked. Returns the number of reports decoded.
+    size_t decode(std::span<const uint8_t> reports, size_t stride, report_columns &out) const;
+
+    isa implementation() const { return m_isa; }
+
+    // Best implementation this CPU can run
+    static isa best_isa();
+
+private:
+    report_layout m_layout;
+    bool m_motionplus;
+    isa m_isa;
+};
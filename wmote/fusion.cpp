@@ -0,0 +1,59 @@
+#include <cmath>
+
+#include "fusion.hpp"
+
+namespace {
+    using float4 = float __attribute__((vector_size(16)));
+
+    float dot(float4 a, float4 b) {
+        const auto p = a * b;
+        return p[0] + p[1] + p[2] + p[3];
+    }
+
+    // Scales to unit length. The bias keeps zero vectors at zero without a branch, and is lost in rounding otherwise.
+    float4 normalized(float4 v) {
+        return v * (1 / std::sqrt(dot(v, v) + 1e-30f));
+    }
+}
+
+madgwick_filter::madgwick_filter(float gain)
+        : m_gain(gain) {
+}
+
+void madgwick_filter::update(vec3<float> gyro, vec3<float> acc, float dt) {
+    const auto q = m_q;
+    const float w = q[0], x = q[1], y = q[2], z = q[3];
+
+    // Rate of change from the gyroscope, q * (0, gyro) / 2, as columns of the quaternion product
+    auto q_dot = 0.5f * (gyro.x * float4{-x, w, z, -y} + gyro.y * float4{-y, -z, w, x} + gyro.z * float4{-z, y, -x, w});
+
+    // Gradient of the distance between the measured and the estimated direction of gravity
+    const auto a = normalized(float4{acc.x, acc.y, acc.z, 0});
+    const float f0 = 2 * (x * z - w * y) - a[0];
+    const float f1 = 2 * (w * x + y * z) - a[1];
+    const float f2 = 2 * (0.5f - x * x - y * y) - a[2];
+    const auto step = normalized(f0 * float4{-2 * y, 2 * z, -2 * w, 2 * x} +
+                                 f1 * float4{2 * x, 2 * w, 2 * z, 2 * y} +
+                                 f2 * float4{0, -4 * x, -4 * y, 0});
+    // The squared length of a is 1, or 0 without an acceleration reading, which leaves just the gyroscope
+    q_dot -= m_gain * dot(a, a) * step;
+
+    m_q = normalized(q + q_dot * dt);
+}
+
+void madgwick_filter::reset() {
+    m_q = float4{1, 0, 0, 0};
+}
+
+void madgwick_filter::set_gain(float gain) {
+    m_gain = gain;
+}
+
+quaternion madgwick_filter::orientation() const {
+    return {m_q[0], m_q[1], m_q[2], m_q[3]};
+}
+
+vec3<float> madgwick_filter::gravity() const {
+    const float w = m_q[0], x = m_q[1], y = m_q[2], z = m_q[3];
+    return {2 * (x * z - w * y), 2 * (w * x + y * z), w * w - x * x - y * y + z * z};
+}
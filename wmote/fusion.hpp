@@ -0,0 +1,35 @@
+#pragma once
+#include "vec.hpp"
+
+struct quaternion {
+    float w = 1;
+    float x = 0;
+    float y = 0;
+    float z = 0;
+};
+
+// Madgwick's gradient descent orientation filter, for a gyroscope and an accelerometer.
+// Every update does the same work, so it takes a fixed time per sample.
+class madgwick_filter {
+public:
+    // Higher gains trust the accelerometer more, correcting drift faster at the cost of noise
+    explicit madgwick_filter(float gain = 0.1f);
+
+    // Angular rate in radians per second, acceleration in any unit, both in the wiimote's frame
+    void update(vec3<float> gyro, vec3<float> acc, float dt);
+
+    void reset();
+
+    void set_gain(float gain);
+
+    quaternion orientation() const;
+
+    // Direction of gravity in the wiimote's frame, with unit length
+    vec3<float> gravity() const;
+
+private:
+    using float4 = float __attribute__((vector_size(16)));
+
+    float4 m_q = {1, 0, 0, 0};
+    float m_gain;
+};
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "hidraw_transport.hpp"
+#include "internal_logging.hpp"
+
+hidraw_transport::hidraw_transport(std::filesystem::path const &device_path)
+        : m_fd(::open(device_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC)), m_path(device_path) {
+    if (m_fd < 0)
+        throw std::runtime_error(std::strerror(errno));
+}
+
+hidraw_transport::~hidraw_transport() {
+    ::close(m_fd);
+}
+
+int hidraw_transport::wait(int timeout_ms) {
+    using namespace std::chrono;
+    pollfd pfd{.fd = m_fd, .events = POLLIN};
+    const auto deadline = steady_clock::now() + milliseconds(timeout_ms);
+    for (;;) {
+        count_syscalls();
+        const auto ready = ::poll(&pfd, 1, timeout_ms);
+        if (ready > 0)
+            count_wakeup();
+        if (ready >= 0)
+            return ready;
+        if (errno != EINTR) {
+            log_error("Polling {} failed: {}", m_path.string(), std::strerror(errno));
+            return 0;
+        }
+        // Interrupted by a signal, wait out the rest
+        if (timeout_ms > 0)
+            timeout_ms = int(std::max<int64_t>(0, ceil<milliseconds>(deadline - steady_clock::now()).count()));
+    }
+}
+
+ssize_t hidraw_transport::read_report(std::span<uint8_t> report) {
+    for (;;) {
+        count_syscalls();
+        const auto bytes = ::read(m_fd, report.data(), report.size());
+        if (bytes > 0) {
+            count_read();
+            return bytes;
+        }
+        if (bytes == 0 || errno == EAGAIN)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        // The node stays, but answers with these once the device is gone
+        if (errno == ENODEV || errno == EIO)
+            return -1;
+        log_error("Reading {} failed: {}", m_path.string(), std::strerror(errno));
+        return 0;
+    }
+}
+
+ssize_t hidraw_transport::read(std::span<uint8_t> report, int timeout_ms) {
+    const auto bytes = read_report(report);
+    if (bytes != 0 || timeout_ms == 0)
+        return bytes;
+    if (wait(timeout_ms) == 0)
+        return 0;
+    return read_report(report);
+}
+
+ssize_t hidraw_transport::read_batch(report_batch &batch, int timeout_ms) {
+    batch.count = 0;
+    for (;;) {
+        while (batch.count < batch.capacity) {
+            const auto bytes = read_report({batch.reports[batch.count].data(), batch.report_size});
+            if (bytes > 0) {
+                batch.sizes[batch.count++] = bytes;
+                continue;
+            }
+            if (bytes < 0 && batch.count == 0)
+                return bytes;
+            break;
+        }
+        if (batch.count > 0 || timeout_ms == 0)
+            return ssize_t(batch.count);
+
+        if (wait(timeout_ms) == 0)
+            return 0;
+        // Only the first wait may block
+        timeout_ms = 0;
+    }
+}
+
+ssize_t hidraw_transport::write(std::span<const uint8_t> report) {
+    count_syscalls();
+    const auto bytes = ::write(m_fd, report.data(), report.size());
+    if (bytes > 0)
+        count_written();
+    return bytes;
+}
+
+int hidraw_transport::native_handle() const {
+    return m_fd;
+}
+
+std::string hidraw_transport::identifier() const {
+#ifdef HIDIOCGRAWUNIQ
+    // Bluetooth address of the device
+    std::array<char, 64> uniq{};
+    if (::ioctl(m_fd, HIDIOCGRAWUNIQ(uniq.size()), uniq.data()) > 0 && uniq[0])
+        return {uniq.data()};
+#endif
+    return m_path.string();
+}
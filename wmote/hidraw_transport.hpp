@@ -0,0 +1,34 @@
+#pragma once
+#include <filesystem>
+
+#include "transport.hpp"
+
+// Transport straight through a Linux hidraw node, e.g. /dev/hidraw0, opened non-blocking so it can be polled
+class hidraw_transport : public hid_transport {
+public:
+    explicit hidraw_transport(std::filesystem::path const &device_path);
+
+    hidraw_transport(hidraw_transport const &) = delete;
+
+    ~hidraw_transport() override;
+
+    ssize_t read(std::span<uint8_t> report, int timeout_ms) override;
+
+    // Reads until the node runs dry, polling only when nothing is waiting
+    ssize_t read_batch(report_batch &batch, int timeout_ms) override;
+
+    ssize_t write(std::span<const uint8_t> report) override;
+
+    int native_handle() const override;
+
+    std::string identifier() const override;
+
+private:
+    // Waits for the node to become readable, returns > 0 if it did. Signals don't cut the wait short.
+    int wait(int timeout_ms);
+    // Reads one report if one is waiting, returns -1 only once the device is gone
+    ssize_t read_report(std::span<uint8_t> report);
+
+    int m_fd;
+    std::filesystem::path m_path;
+};
@@ -0,0 +1,130 @@
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "hotplug_monitor.hpp"
+#include "internal_logging.hpp"
+
+namespace {
+    // Multicast group of the events sent by the kernel itself, rather than relayed by udev
+    constexpr uint32_t kernel_events = 1;
+
+    int open_uevent_socket() {
+        const auto fd = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        if (fd < 0)
+            return -1;
+        sockaddr_nl address{.nl_family = AF_NETLINK, .nl_pid = 0, .nl_groups = kernel_events};
+        if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+}
+
+hotplug_monitor::hotplug_monitor(listener on_change, std::chrono::milliseconds poll_interval)
+        : m_listener(std::move(on_change)), m_poll_interval(poll_interval), m_socket(open_uevent_socket()),
+          m_wake(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), m_nodes(list_nodes()) {
+    if (!m_listener)
+        throw std::invalid_argument("listener");
+    if (m_wake < 0)
+        throw std::runtime_error(std::strerror(errno));
+    if (polling())
+        log_error("Can't listen for device events, scanning for wiimotes every {}ms", m_poll_interval.count());
+
+    m_thread = std::jthread([this](std::stop_token stop) { run(stop); });
+}
+
+hotplug_monitor::~hotplug_monitor() {
+    m_thread.request_stop();
+    eventfd_write(m_wake, 1);
+    m_thread.join();
+    if (m_socket >= 0)
+        ::close(m_socket);
+    ::close(m_wake);
+}
+
+void hotplug_monitor::run(std::stop_token const &stop) {
+    std::array<pollfd, 2> fds{{{.fd = m_wake, .events = POLLIN}, {.fd = m_socket, .events = POLLIN}}};
+    const auto timeout = polling() ? int(m_poll_interval.count()) : -1;
+    while (!stop.stop_requested()) {
+        const auto ready = ::poll(fds.data(), polling() ? 1 : 2, timeout);
+        if (ready < 0 && errno != EINTR) {
+            log_error("Hotplug monitor stopped: {}", std::strerror(errno));
+            return;
+        }
+        if (stop.stop_requested())
+            return;
+        if (polling())
+            scan();
+        else if (fds[1].revents & POLLIN && !receive())
+            scan();
+    }
+}
+
+bool hotplug_monitor::receive() {
+    // An event is "action@devpath", followed by KEY=value pairs, each null terminated
+    std::array<char, 8192> buffer;
+    for (;;) {
+        sockaddr_nl sender{};
+        socklen_t sender_size = sizeof(sender);
+        const auto bytes = ::recvfrom(m_socket, buffer.data(), buffer.size(), 0,
+                                      reinterpret_cast<sockaddr *>(&sender), &sender_size);
+        if (bytes < 0)
+            return errno != ENOBUFS;
+        // Only the kernel speaks for devices
+        if (sender.nl_pid != 0)
+            continue;
+
+        std::string_view action, subsystem, name;
+        for (size_t offset = 0; offset < size_t(bytes);) {
+            const std::string_view field(buffer.data() + offset, strnlen(buffer.data() + offset, bytes - offset));
+            offset += field.size() + 1;
+            if (field.starts_with("ACTION="))
+                action = field.substr(7);
+            else if (field.starts_with("SUBSYSTEM="))
+                subsystem = field.substr(10);
+            else if (field.starts_with("DEVNAME="))
+                name = field.substr(8);
+        }
+        if (subsystem != "hidraw" || name.empty())
+            continue;
+
+        // DEVNAME is relative to /dev
+        const auto node = std::filesystem::path("/dev") / name;
+        if (action == "add" && m_nodes.insert(node).second)
+            m_listener(change::ADDED, node);
+        else if (action == "remove" && m_nodes.erase(node))
+            m_listener(change::REMOVED, node);
+    }
+}
+
+void hotplug_monitor::scan() {
+    auto nodes = list_nodes();
+    for (auto const &node: m_nodes) {
+        if (!nodes.contains(node))
+            m_listener(change::REMOVED, node);
+    }
+    for (auto const &node: nodes) {
+        if (!m_nodes.contains(node))
+            m_listener(change::ADDED, node);
+    }
+    m_nodes = std::move(nodes);
+}
+
+std::set<std::filesystem::path> hotplug_monitor::list_nodes() {
+    std::set<std::filesystem::path> nodes;
+    std::error_code error;
+    for (auto const &entry: std::filesystem::directory_iterator("/dev", error)) {
+        if (entry.path().filename().string().starts_with("hidraw"))
+            nodes.insert(entry.path());
+    }
+    return nodes;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <set>
+#include <thread>
+
+// Watches hidraw nodes come and go. Listens to the kernel's device events over netlink, and falls back to scanning
+// /dev when the socket can't be opened, e.g. in a sandbox without the netlink family.
+class hotplug_monitor {
+public:
+    enum class change : uint8_t {
+        ADDED,
+        REMOVED
+    };
+
+    // Called on the monitor's thread with the node, e.g. /dev/hidraw0. Nodes that are there when the monitor starts
+    // aren't reported.
+    using listener = std::function<void(change, std::filesystem::path const &)>;
+
+    explicit hotplug_monitor(listener on_change,
+                             std::chrono::milliseconds poll_interval = std::chrono::milliseconds(500));
+
+    hotplug_monitor(hotplug_monitor const &) = delete;
+
+    ~hotplug_monitor();
+
+    // Whether changes are only found by scanning, every poll interval
+    bool polling() const { return m_socket < 0; }
+
+private:
+    void run(std::stop_token const &stop);
+    // Takes every waiting device event, returns false if some were dropped for want of buffer space
+    bool receive();
+    // Reports the difference between the nodes in /dev and those last seen
+    void scan();
+    static std::set<std::filesystem::path> list_nodes();
+
+    listener m_listener;
+    std::chrono::milliseconds m_poll_interval;
+    int m_socket;
+    int m_wake;
+    std::set<std::filesystem::path> m_nodes;
+
+    std::jthread m_thread;
+};
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "in_memory_transport.hpp"
+
+in_memory_transport::in_memory_transport(std::string identifier)
+        : m_identifier(std::move(identifier)), m_event(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (m_event < 0)
+        throw std::runtime_error(std::strerror(errno));
+}
+
+in_memory_transport::~in_memory_transport() {
+    ::close(m_event);
+}
+
+void in_memory_transport::push(std::span<const uint8_t> report) {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_incoming.push_back({clock::now(), {report.begin(), report.end()}});
+        // Under the lock, so a reader emptying the queue can't clear the eventfd before this sets it
+        const uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(m_event, &one, sizeof(one));
+    }
+    m_arrived.notify_one();
+}
+
+std::vector<std::vector<uint8_t>> in_memory_transport::take_written() {
+    std::scoped_lock lock(m_mutex);
+    return std::exchange(m_written, {});
+}
+
+void in_memory_transport::disconnect() {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_connected = false;
+    }
+    // Readers have to notice the disconnection
+    const uint64_t one = 1;
+    [[maybe_unused]] auto _ = ::write(m_event, &one, sizeof(one));
+    m_arrived.notify_all();
+}
+
+ssize_t in_memory_transport::read(std::span<uint8_t> report, int timeout_ms) {
+    std::unique_lock lock(m_mutex);
+    if (m_incoming.empty() && m_connected && timeout_ms != 0) {
+        const auto ready = [this] { return !m_incoming.empty() || !m_connected; };
+        if (timeout_ms < 0)
+            m_arrived.wait(lock, ready);
+        else
+            m_arrived.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+        if (!m_incoming.empty())
+            count_wakeup();
+    }
+    if (m_incoming.empty())
+        return m_connected ? 0 : -1;
+
+    const auto incoming = std::move(m_incoming.front());
+    m_incoming.pop_front();
+    if (m_incoming.empty() && m_connected) {
+        // Nothing left, so stop polling readable
+        uint64_t count;
+        count_syscalls();
+        [[maybe_unused]] auto _ = ::read(m_event, &count, sizeof(count));
+    }
+    lock.unlock();
+
+    count_latency(clock::now() - incoming.pushed);
+    count_read();
+    const auto size = std::min(incoming.data.size(), report.size());
+    std::copy_n(incoming.data.begin(), size, report.begin());
+    return ssize_t(size);
+}
+
+ssize_t in_memory_transport::write(std::span<const uint8_t> report) {
+    std::scoped_lock lock(m_mutex);
+    if (!m_connected)
+        return -1;
+    m_written.emplace_back(report.begin(), report.end());
+    count_written();
+    return ssize_t(report.size());
+}
+
+int in_memory_transport::native_handle() const {
+    return m_event;
+}
+
+std::string in_memory_transport::identifier() const {
+    return m_identifier;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "transport.hpp"
+
+// Transport without a device, the other end pushes input reports and takes output reports directly.
+// Its handle is an eventfd that polls readable while reports are waiting.
+class in_memory_transport : public hid_transport {
+public:
+    explicit in_memory_transport(std::string identifier = "memory");
+
+    in_memory_transport(in_memory_transport const &) = delete;
+
+    ~in_memory_transport() override;
+
+    // Queues a report for the wiimote to read
+    void push(std::span<const uint8_t> report);
+
+    // Takes every report the wiimote has written, oldest first
+    std::vector<std::vector<uint8_t>> take_written();
+
+    // Makes reads and writes fail once the queued reports are read, as if the device was unplugged
+    void disconnect();
+
+    ssize_t read(std::span<uint8_t> report, int timeout_ms) override;
+
+    ssize_t write(std::span<const uint8_t> report) override;
+
+    int native_handle() const override;
+
+    std::string identifier() const override;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct incoming_report {
+        clock::time_point pushed;
+        std::vector<uint8_t> data;
+    };
+
+    std::string m_identifier;
+    int m_event;
+
+    std::mutex m_mutex;
+    std::condition_variable m_arrived;
+    std::deque<incoming_report> m_incoming;
+    std::vector<std::vector<uint8_t>> m_written;
+    bool m_connected = true;
+};
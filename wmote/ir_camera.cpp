@@ -0,0 +1,12 @@
+#include "ir_camera.hpp"
+
+std::vector<register_write> ir_camera_writes(ir_sensitivity level, ir_format format) {
+    const auto blocks = sensitivity_blocks(level);
+    return {
+            {addresses::ir_control, {0x08}},
+            {addresses::ir_sensitivity_1, {blocks.first.begin(), blocks.first.end()}},
+            {addresses::ir_sensitivity_2, {blocks.second.begin(), blocks.second.end()}},
+            {addresses::ir_mode, {ir_camera_mode(format)}},
+            {addresses::ir_control, {0x08}},
+    };
+}
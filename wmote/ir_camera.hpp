@@ -0,0 +1,65 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "memory.hpp"
+#include "report_layout.hpp"
+
+// Camera sensitivity, from the Wii's own levels 1 to 5 to the most sensitive setting known to work
+enum class ir_sensitivity : uint8_t {
+    LEVEL_1,
+    LEVEL_2,
+    LEVEL_3,
+    LEVEL_4,
+    LEVEL_5,
+    MAX
+};
+
+struct ir_sensitivity_blocks {
+    // Written from 0xb00000, sets the gain
+    std::array<uint8_t, 9> first;
+    // Written from 0xb0001a, sets the brightness threshold
+    std::array<uint8_t, 2> second;
+};
+
+constexpr ir_sensitivity_blocks sensitivity_blocks(ir_sensitivity level) {
+    switch (level) {
+        case ir_sensitivity::LEVEL_1:
+            return {{0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0x64, 0x00, 0xfe}, {0xfd, 0x05}};
+        case ir_sensitivity::LEVEL_2:
+            return {{0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0x96, 0x00, 0xb4}, {0xb3, 0x04}};
+        case ir_sensitivity::LEVEL_3:
+            return {{0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0xaa, 0x00, 0x64}, {0x63, 0x03}};
+        case ir_sensitivity::LEVEL_4:
+            return {{0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0xc8, 0x00, 0x36}, {0x35, 0x03}};
+        case ir_sensitivity::LEVEL_5:
+            return {{0x07, 0x00, 0x00, 0x71, 0x01, 0x00, 0x72, 0x00, 0x20}, {0x1f, 0x03}};
+        case ir_sensitivity::MAX:
+        default:
+            return {{0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x90, 0x00, 0x41}, {0x40, 0x00}};
+    }
+}
+
+// Value of the camera's mode register that produces the given IR data
+constexpr uint8_t ir_camera_mode(ir_format format) {
+    switch (format) {
+        case ir_format::BASIC:
+            return 1;
+        case ir_format::EXTENDED:
+            return 3;
+        case ir_format::FULL:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+struct register_write {
+    address_t address;
+    std::vector<uint8_t> data;
+};
+
+// Register writes that bring the camera up once its clock and logic are enabled. They don't depend on each
+// other's acknowledgement, so they can all be in flight at once.
+std::vector<register_write> ir_camera_writes(ir_sensitivity level, ir_format format);
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <numbers>
+
+#include "ir_pointer.hpp"
+
+namespace {
+    // Middle of the camera image, which is 1024 by 768
+    constexpr float center_x = 512;
+    constexpr float center_y = 384;
+
+    float smoothing(float cutoff, float dt) {
+        const auto tau = 1 / (2 * std::numbers::pi_v<float> * cutoff);
+        return 1 / (1 + tau / dt);
+    }
+
+    vec2<float> rotate(vec2<float> v, float cos_a, float sin_a) {
+        return {v.x * cos_a - v.y * sin_a, v.x * sin_a + v.y * cos_a};
+    }
+
+    float distance_sq(vec2<float> a, vec2<float> b) {
+        return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+    }
+}
+
+one_euro_filter::one_euro_filter(float min_cutoff, float beta, float derivative_cutoff)
+        : m_min_cutoff(min_cutoff), m_beta(beta), m_derivative_cutoff(derivative_cutoff) {
+}
+
+float one_euro_filter::operator()(float value, float dt) {
+    if (!m_value || dt <= 0) {
+        m_value = value;
+        m_derivative = 0;
+        return value;
+    }
+    const auto derivative = (value - *m_value) / dt;
+    m_derivative += smoothing(m_derivative_cutoff, dt) * (derivative - m_derivative);
+    const auto cutoff = m_min_cutoff + m_beta * std::abs(m_derivative);
+    *m_value += smoothing(cutoff, dt) * (value - *m_value);
+    return *m_value;
+}
+
+void one_euro_filter::reset() {
+    m_value.reset();
+    m_derivative = 0;
+}
+
+pointer_state ir_pointer::update(std::span<const vec2<float>> dots, float roll,
+                                 std::chrono::steady_clock::time_point timestamp) {
+    pointer_state state;
+    state.dots = dots.size();
+    state.timestamp = timestamp;
+
+    // Rolling the wiimote turns the image the other way, so it is levelled by turning it back by the roll
+    const auto cos_r = std::cos(roll), sin_r = -std::sin(roll);
+    std::array<vec2<float>, 4> level{};
+    const auto count = std::min<size_t>(dots.size(), level.size());
+    for (auto i = 0u; i < count; ++i)
+        level[i] = rotate({dots[i].x - center_x, dots[i].y - center_y}, cos_r, sin_r);
+
+    // The sensor bar is the pair lying flattest once level, as long as they are far enough apart
+    std::optional<std::pair<size_t, size_t>> pair;
+    auto best_slope = std::numeric_limits<float>::max();
+    for (auto a = 0u; a < count; ++a) {
+        for (auto b = a + 1; b < count; ++b) {
+            const auto dx = std::abs(level[b].x - level[a].x);
+            const auto dy = std::abs(level[b].y - level[a].y);
+            if (dx < min_separation)
+                continue;
+            if (dy / dx < best_slope) {
+                best_slope = dy / dx;
+                pair = {a, b};
+            }
+        }
+    }
+
+    vec2<float> midpoint;
+    if (pair) {
+        auto left = level[pair->first], right = level[pair->second];
+        if (left.x > right.x)
+            std::swap(left, right);
+        midpoint = {(left.x + right.x) / 2, (left.y + right.y) / 2};
+        m_half_span = {(right.x - left.x) / 2, (right.y - left.y) / 2};
+        m_has_span = true;
+    }
+    else if (count >= 1 && m_has_span && m_last_seen && timestamp - *m_last_seen < lost_timeout) {
+        // Whichever end this dot is, it puts the midpoint nearer to where it was
+        const vec2<float> as_left{level[0].x + m_half_span.x, level[0].y + m_half_span.y};
+        const vec2<float> as_right{level[0].x - m_half_span.x, level[0].y - m_half_span.y};
+        midpoint = distance_sq(as_left, m_midpoint) < distance_sq(as_right, m_midpoint) ? as_left : as_right;
+    }
+    else {
+        if (m_last_seen && timestamp - *m_last_seen >= lost_timeout) {
+            m_filter_x.reset();
+            m_filter_y.reset();
+        }
+        return state;
+    }
+
+    const auto dt = m_last_seen ? std::chrono::duration<float>(timestamp - *m_last_seen).count() : 0.0f;
+    if (m_last_seen && timestamp - *m_last_seen >= lost_timeout) {
+        m_filter_x.reset();
+        m_filter_y.reset();
+    }
+    m_last_seen = timestamp;
+    m_midpoint = midpoint;
+
+    // Pointing right or up moves the sensor bar towards larger x or y in the image
+    state.visible = true;
+    state.position = {m_filter_x(0.5f + midpoint.x / (2 * center_x), dt),
+                      m_filter_y(0.5f - midpoint.y / (2 * center_y), dt)};
+    state.separation = std::sqrt(m_half_span.x * m_half_span.x + m_half_span.y * m_half_span.y) / center_x;
+    return state;
+}
+
+void ir_pointer::reset() {
+    m_filter_x.reset();
+    m_filter_y.reset();
+    m_last_seen.reset();
+    m_has_span = false;
+}
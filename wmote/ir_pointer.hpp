@@ -0,0 +1,60 @@
+#pragma once
+#include <chrono>
+#include <optional>
+#include <span>
+
+#include "vec.hpp"
+
+// Low pass filter whose cutoff rises with speed, smoothing jitter while holding still without lagging behind
+// quick movements. From Casiez et al, "1€ Filter".
+class one_euro_filter {
+public:
+    explicit one_euro_filter(float min_cutoff = 1.0f, float beta = 0.5f, float derivative_cutoff = 1.0f);
+
+    float operator()(float value, float dt);
+
+    void reset();
+
+private:
+    float m_min_cutoff;
+    float m_beta;
+    float m_derivative_cutoff;
+    std::optional<float> m_value;
+    float m_derivative = 0;
+};
+
+struct pointer_state {
+    bool visible = false;
+    // Where on the screen the wiimote points, from (0, 0) at the top left to (1, 1) at the bottom right
+    vec2<float> position;
+    // Distance between the sensor bar's dots as a fraction of the camera's width, shrinking further away
+    float separation = 0;
+    // Number of dots the camera saw
+    uint8_t dots = 0;
+    std::chrono::steady_clock::time_point timestamp;
+};
+
+// Turns the dots seen by the IR camera into a cursor position.
+// The pair of dots most likely to be the sensor bar is picked once the camera image is rotated back by the
+// wiimote's roll, and with only one dot in sight the other is assumed to be where it last was relative to it.
+class ir_pointer {
+public:
+    // Dots closer together than this, in camera pixels, can't be both ends of the sensor bar
+    constexpr static float min_separation = 16;
+    // The filters start over after the pointer was lost for this long
+    constexpr static auto lost_timeout = std::chrono::milliseconds(100);
+
+    // Dots are in camera pixels, 1024 by 768, and roll in radians with positive when rolled to the right
+    pointer_state update(std::span<const vec2<float>> dots, float roll, std::chrono::steady_clock::time_point timestamp);
+
+    void reset();
+
+private:
+    one_euro_filter m_filter_x;
+    one_euro_filter m_filter_y;
+    std::optional<std::chrono::steady_clock::time_point> m_last_seen;
+    // Last sensor bar midpoint and half the vector between its ends, in roll compensated camera pixels
+    vec2<float> m_midpoint;
+    vec2<float> m_half_span;
+    bool m_has_span = false;
+};
@@ -0,0 +1,43 @@
+#include "latency_histogram.hpp"
+
+uint64_t latency_histogram::upper_bound_of(size_t bucket) {
+    if (bucket < sub_buckets)
+        return bucket;
+    const auto shift = bucket / sub_buckets - 1;
+    const auto step = bucket % sub_buckets;
+    return ((sub_buckets + step + 1) << shift) - 1;
+}
+
+uint64_t latency_histogram::count() const {
+    uint64_t total = 0;
+    for (auto const &bucket: m_buckets)
+        total += bucket.load(std::memory_order_relaxed);
+    return total;
+}
+
+std::chrono::nanoseconds latency_histogram::percentile(double fraction) const {
+    const auto total = count();
+    if (total == 0)
+        return {};
+
+    // Rank of the sample the percentile falls on, counting from one
+    const auto rank = std::max<uint64_t>(1, uint64_t(fraction * double(total) + 0.5));
+    uint64_t seen = 0;
+    for (auto i = 0u; i < bucket_count; ++i) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::chrono::nanoseconds(std::min(upper_bound_of(i), m_max.load(std::memory_order_relaxed)));
+    }
+    return std::chrono::nanoseconds(m_max.load(std::memory_order_relaxed));
+}
+
+latency_summary latency_histogram::summary() const {
+    return {count(), percentile(0.5), percentile(0.99), percentile(0.999),
+            std::chrono::nanoseconds(m_max.load(std::memory_order_relaxed))};
+}
+
+void latency_histogram::reset() {
+    for (auto &bucket: m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
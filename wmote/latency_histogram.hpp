@@ -0,0 +1,55 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+struct latency_summary {
+    uint64_t count = 0;
+    std::chrono::nanoseconds p50{};
+    std::chrono::nanoseconds p99{};
+    std::chrono::nanoseconds p999{};
+    std::chrono::nanoseconds max{};
+};
+
+// Counts durations in logarithmic buckets, with each power of two split into 16 linear steps, so percentiles are
+// within 1/16 of the true value at any scale.
+// Recording is an atomic increment and takes no locks, so any number of threads can record while others read.
+class latency_histogram {
+public:
+    void record(std::chrono::nanoseconds value) {
+        const auto ns = uint64_t(std::max<int64_t>(value.count(), 0));
+        m_buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        auto max = m_max.load(std::memory_order_relaxed);
+        while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+    }
+
+    uint64_t count() const;
+
+    // Upper bound of the bucket below which the given fraction of durations fall, 0.5 for the median
+    std::chrono::nanoseconds percentile(double fraction) const;
+
+    latency_summary summary() const;
+
+    void reset();
+
+private:
+    constexpr static unsigned sub_bucket_bits = 4;
+    constexpr static uint64_t sub_buckets = 1 << sub_bucket_bits;
+    constexpr static size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    static size_t bucket_of(uint64_t ns) {
+        if (ns < sub_buckets)
+            return ns;
+        // Bits below the leading one and the sub bucket bits after it are dropped
+        const unsigned shift = 63 - __builtin_clzll(ns) - sub_bucket_bits;
+        return (shift + 1) * sub_buckets + ((ns >> shift) & (sub_buckets - 1));
+    }
+
+    // Largest duration that lands in the bucket
+    static uint64_t upper_bound_of(size_t bucket);
+
+    std::array<std::atomic<uint64_t>, bucket_count> m_buckets{};
+    std::atomic<uint64_t> m_max = 0;
+};
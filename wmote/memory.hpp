@@ -1,4 +1,7 @@
+#pragma once
 #include <array>
+#include <concepts>
+#include <cstddef>
 #include <cstdint>
 
 class address_t {
@@ -27,6 +30,12 @@ public:
     constexpr bool operator==(address_t addr) const {
         return m_value == addr.m_value;
     }
+    // The address offset bytes further on, in the same address space
+    constexpr address_t operator+(uint32_t offset) const {
+        const uint32_t low = (uint32_t(m_value[1]) << 16 | uint32_t(m_value[2]) << 8 | m_value[3]) + offset;
+        return {{m_value[0], uint8_t(low >> 16), uint8_t(low >> 8), uint8_t(low)}};
+    }
+
     auto value() const -> decltype(auto) { return m_value; }
     uint32_t as_uint32() const { return *reinterpret_cast<const uint32_t*>(m_value.data()); }
 
@@ -39,10 +48,17 @@ private:
 
 namespace addresses {
     constexpr address_t motionplus_calibration_fast = {{0x04,0xA6, 0x00, 0x20}};
-    constexpr address_t motionplus_calibration_slow = {{0x04,0xA6, 0x00, 0x36}};
+    constexpr address_t motionplus_calibration_slow = {{0x04,0xA6, 0x00, 0x30}};
+    constexpr address_t extension_init_1 = {{0x04,0xA4, 0x00, 0xF0}};
+    constexpr address_t extension_init_2 = {{0x04,0xA4, 0x00, 0xFB}};
+    constexpr address_t motionplus_activate = {{0x04,0xA6, 0x00, 0xFE}};
     constexpr address_t extension_identifier = {{0x04,0xA4, 0x00, 0xFA}};
     constexpr address_t motionplus_identifier = {{0x04,0xA6, 0x00, 0xFA}};
     constexpr address_t wiimote_calibration = {{0x00,0x00, 0x00, 0x16}};
     constexpr address_t wiimote_calibration_mirror = {{0x00,0x00, 0x00, 0x20}};
+    constexpr address_t ir_control = {{0x04,0xB0, 0x00, 0x30}};
+    constexpr address_t ir_sensitivity_1 = {{0x04,0xB0, 0x00, 0x00}};
+    constexpr address_t ir_sensitivity_2 = {{0x04,0xB0, 0x00, 0x1A}};
+    constexpr address_t ir_mode = {{0x04,0xB0, 0x00, 0x33}};
 
 }
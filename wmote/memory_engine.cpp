@@ -0,0 +1,323 @@
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#include "memory_engine.hpp"
+#include "internal_logging.hpp"
+#include "byteswap.hpp"
+
+memory_engine::memory_engine(report_sink sink, std::function<void()> on_queued, size_t write_window)
+        : m_sink(std::move(sink)), m_on_queued(std::move(on_queued)), m_write_window(std::max<size_t>(write_window, 1)) {
+}
+
+namespace {
+    // Largest read a single 0x17 report asks for, kept a multiple of the 16 byte replies
+    constexpr size_t max_read_size = 0xfff0;
+    constexpr size_t max_write_size = MemWriteReport{}.data.size();
+    // Reads this close together are coalesced, as reading the gap between them costs at most one more report
+    constexpr uint32_t max_coalesce_gap = 16;
+
+    uint32_t key_of(address_t address) {
+        return bswap_on_le(address.as_uint32());
+    }
+}
+
+std::future<mem_result> memory_engine::read(address_t address, uint16_t size, mem_callback callback, mem_policy policy) {
+    if (size == 0)
+        throw std::invalid_argument("size");
+
+    transaction txn{.is_write = false, .address = address, .size = size, .policy = policy};
+    txn.data.resize(size);
+    txn.callback = std::move(callback);
+    return enqueue(std::move(txn));
+}
+
+std::future<mem_result> memory_engine::read(address_t address, std::span<uint8_t> buffer, mem_callback callback,
+                                            mem_policy policy) {
+    if (buffer.empty())
+        throw std::invalid_argument("buffer");
+
+    std::vector<transaction> parts;
+    for (size_t offset = 0; offset < buffer.size(); offset += max_read_size) {
+        const auto size = std::min(max_read_size, buffer.size() - offset);
+        parts.push_back({.is_write = false, .address = address + offset, .size = uint16_t(size),
+                         .target = buffer.subspan(offset, size), .policy = policy});
+    }
+    if (parts.size() == 1) {
+        parts.front().callback = std::move(callback);
+        return enqueue(std::move(parts.front()));
+    }
+    return enqueue(std::move(parts), {.address = address}, std::move(callback));
+}
+
+std::future<mem_result> memory_engine::write(address_t address, std::span<const uint8_t> data, mem_callback callback,
+                                             mem_policy policy) {
+    if (data.empty())
+        throw std::invalid_argument("data");
+
+    std::vector<transaction> parts;
+    for (size_t offset = 0; offset < data.size(); offset += max_write_size) {
+        const auto chunk = data.subspan(offset, std::min(max_write_size, data.size() - offset));
+        auto &txn = parts.emplace_back(transaction{.is_write = true, .address = address + offset,
+                                                   .size = uint16_t(chunk.size()), .policy = policy});
+        txn.write_report.address = txn.address;
+        txn.write_report.size = chunk.size();
+        std::copy(chunk.begin(), chunk.end(), txn.write_report.data.begin());
+        txn.data.assign(chunk.begin(), chunk.end());
+    }
+    if (parts.size() == 1) {
+        parts.front().callback = std::move(callback);
+        return enqueue(std::move(parts.front()));
+    }
+    return enqueue(std::move(parts), {.address = address, .data{data.begin(), data.end()}}, std::move(callback));
+}
+
+std::future<mem_result> memory_engine::enqueue(transaction &&txn) {
+    auto future = txn.promise.get_future();
+    {
+        std::scoped_lock lock(m_mutex);
+        txn.sequence = m_sequence++;
+        m_queued.push_back(std::move(txn));
+    }
+    if (m_on_queued)
+        m_on_queued();
+    return future;
+}
+
+std::future<mem_result> memory_engine::enqueue(std::vector<transaction> &&parts, mem_result result,
+                                               mem_callback callback) {
+    auto state = std::make_shared<block>();
+    state->remaining = parts.size();
+    state->result = std::move(result);
+    state->callback = std::move(callback);
+    auto future = state->promise.get_future();
+
+    for (auto &txn: parts) {
+        txn.callback = [state](mem_result const &part) {
+            auto none = mem_error::NONE;
+            if (!part)
+                state->error.compare_exchange_strong(none, part.error);
+            if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+            state->result.error = state->error.load();
+            if (!state->result)
+                state->result.data.clear();
+            if (state->callback)
+                state->callback(state->result);
+            state->promise.set_value(std::move(state->result));
+        };
+    }
+
+    // Queued together, so nothing else is ordered between the parts
+    {
+        std::scoped_lock lock(m_mutex);
+        for (auto &txn: parts) {
+            txn.sequence = m_sequence++;
+            m_queued.push_back(std::move(txn));
+        }
+    }
+    if (m_on_queued)
+        m_on_queued();
+    return future;
+}
+
+void memory_engine::issue(transaction &txn, clock::time_point now) {
+    ++txn.attempts;
+    txn.deadline = now + txn.policy.timeout;
+    if (txn.is_write) {
+        m_sink(span_of(txn.write_report));
+    } else {
+        MemReadReport report{};
+        report.address = txn.address + txn.received;
+        report.size_big_endian = bswap_on_le(uint16_t(txn.fetch - txn.received));
+        m_sink(span_of(report));
+    }
+}
+
+void memory_engine::pump(clock::time_point now, std::vector<transaction> &done) {
+    while (!m_queued.empty()) {
+        const bool read_in_flight = !m_in_flight.empty() && !m_in_flight.front().is_write;
+        if (m_queued.front().is_write) {
+            if (read_in_flight || m_in_flight.size() >= m_write_window)
+                break;
+        } else if (!m_in_flight.empty()) {
+            break;
+        }
+        auto txn = std::move(m_queued.front());
+        m_queued.pop_front();
+        if (answer_from_shadow(txn)) {
+            done.push_back(std::move(txn));
+            continue;
+        }
+        if (!txn.is_write)
+            coalesce(txn);
+        m_in_flight.push_back(std::move(txn));
+        issue(m_in_flight.back(), now);
+    }
+}
+
+bool memory_engine::answer_from_shadow(transaction &txn) {
+    if (!txn.policy.shadowed)
+        return false;
+    if (txn.is_write)
+        return m_shadow.redundant_write(txn.address, txn.data);
+    if (!register_shadow::shadowed(txn.address, txn.size))
+        return false;
+    const auto target = txn.target.empty() ? std::span<uint8_t>(txn.data) : txn.target;
+    if (!m_shadow.read(txn.address, target))
+        return false;
+    txn.received = txn.size;
+    return true;
+}
+
+void memory_engine::coalesce(transaction &txn) {
+    txn.fetch = txn.size;
+    // Reads into a caller's buffer have nowhere to put more
+    if (!txn.target.empty() || !txn.policy.shadowed || !register_shadow::shadowed(txn.address, txn.size))
+        return;
+
+    const auto begin = key_of(txn.address);
+    auto end = begin + txn.size;
+    for (auto const &next: m_queued) {
+        const auto start = key_of(next.address);
+        if (next.is_write || !next.policy.shadowed || start < begin || start > end + max_coalesce_gap)
+            break;
+        const auto widened = std::max<uint32_t>(end, start + next.size);
+        if (widened - begin > max_read_size || !register_shadow::shadowed(txn.address, widened - begin))
+            break;
+        end = widened;
+    }
+    txn.fetch = uint16_t(end - begin);
+    txn.data.resize(txn.fetch);
+}
+
+void memory_engine::complete(transaction &txn, mem_error error) {
+    mem_result result{error, txn.address, std::move(txn.data)};
+    if (error != mem_error::NONE)
+        result.data.clear();
+    if (txn.callback)
+        txn.callback(result);
+    txn.promise.set_value(std::move(result));
+}
+
+bool memory_engine::on_read_data(uint16_t address_low, uint8_t error, std::span<const uint8_t> data) {
+    std::unique_lock lock(m_mutex);
+    if (m_in_flight.empty() || m_in_flight.front().is_write)
+        return false;
+
+    auto &front = m_in_flight.front();
+    const uint16_t expected = key_of(front.address) + front.received;
+    if (address_low != expected) {
+        log_error("Received read from {:#x}, when expecting from {:#x}, ignoring.", address_low, expected);
+        return true;
+    }
+
+    if (!error) {
+        const auto target = front.target.empty() ? std::span<uint8_t>(front.data) : front.target;
+        const auto count = std::min<size_t>(data.size(), front.fetch - front.received);
+        std::copy_n(data.begin(), count, target.begin() + ptrdiff_t(front.received));
+        front.received += count;
+        if (front.received < front.fetch) {
+            // A long read takes hundreds of reports, so its deadline counts from the latest one
+            front.deadline = clock::now() + front.policy.timeout;
+            return true;
+        }
+        if (register_shadow::shadowed(front.address, front.fetch))
+            m_shadow.store_read(front.address, target.first(front.fetch));
+        // Drop what was only read for the reads coalesced into this one, which the shadow now answers
+        if (front.target.empty())
+            front.data.resize(front.size);
+    }
+
+    auto txn = std::move(front);
+    m_in_flight.pop_front();
+    std::vector<transaction> done;
+    pump(clock::now(), done);
+    lock.unlock();
+
+    complete(txn, static_cast<mem_error>(error));
+    for (auto &answered: done)
+        complete(answered, mem_error::NONE);
+    return true;
+}
+
+bool memory_engine::on_write_ack(uint8_t error_code) {
+    std::unique_lock lock(m_mutex);
+    if (m_in_flight.empty() || !m_in_flight.front().is_write)
+        return false;
+
+    // Acks don't say which write they answer. With another write in flight, this one may have been lost and the ack
+    // be for the next, so all that is known is that its data may have landed.
+    const bool certain = m_in_flight.size() == 1;
+    auto txn = std::move(m_in_flight.front());
+    m_in_flight.pop_front();
+    if (!error_code && certain)
+        m_shadow.store_write(txn.address, txn.data);
+    else if (!error_code)
+        m_shadow.forget_write(txn.address, txn.size);
+    std::vector<transaction> done;
+    pump(clock::now(), done);
+    lock.unlock();
+
+    if (error_code)
+        log_error("Write of {} bytes to {:#x} failed with error code {:#x}", txn.size,
+                  bswap_on_le(txn.address.as_uint32()), error_code);
+    complete(txn, error_code ? mem_error::REJECTED : mem_error::NONE);
+    for (auto &answered: done)
+        complete(answered, mem_error::NONE);
+    return true;
+}
+
+void memory_engine::poll(clock::time_point now) {
+    std::vector<transaction> expired;
+    std::vector<transaction> done;
+    {
+        std::scoped_lock lock(m_mutex);
+        for (auto it = m_in_flight.begin(); it != m_in_flight.end();) {
+            if (it->deadline > now) {
+                ++it;
+                continue;
+            }
+            if (it->attempts <= it->policy.retries) {
+                log_info("Memory transaction {} to {:#x} timed out, retrying", it->sequence,
+                         bswap_on_le(it->address.as_uint32()));
+                issue(*it, now);
+                ++it;
+                continue;
+            }
+            // Any of its attempts may have landed with only the ack lost
+            if (it->is_write)
+                m_shadow.forget_write(it->address, it->size);
+            expired.push_back(std::move(*it));
+            it = m_in_flight.erase(it);
+        }
+        pump(now, done);
+    }
+
+    for (auto &txn: expired) {
+        log_error("Memory transaction {} to {:#x} timed out after {} attempts", txn.sequence,
+                  bswap_on_le(txn.address.as_uint32()), txn.attempts);
+        complete(txn, mem_error::TIMED_OUT);
+    }
+    for (auto &answered: done)
+        complete(answered, mem_error::NONE);
+}
+
+void memory_engine::cancel_all() {
+    std::deque<transaction> in_flight;
+    std::deque<transaction> queued;
+    {
+        std::scoped_lock lock(m_mutex);
+        in_flight.swap(m_in_flight);
+        queued.swap(m_queued);
+    }
+    for (auto &txn: in_flight)
+        complete(txn, mem_error::CANCELLED);
+    for (auto &txn: queued)
+        complete(txn, mem_error::CANCELLED);
+}
+
+size_t memory_engine::pending() const {
+    std::scoped_lock lock(m_mutex);
+    return m_queued.size() + m_in_flight.size();
+}
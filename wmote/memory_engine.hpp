@@ -0,0 +1,143 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "memory.hpp"
+#include "register_shadow.hpp"
+#include "writes.hpp"
+
+enum class mem_error : uint8_t {
+    NONE = 0,
+    // Read from a write only address, or from a disconnected extension
+    WRITE_ONLY = 7,
+    // Read from a nonexistent address
+    NONEXISTENT = 8,
+    // Write acknowledged with an error code
+    REJECTED,
+    // No reply before the deadline, after every retry
+    TIMED_OUT,
+    // Dropped before completion, e.g. when the wiimote is destroyed
+    CANCELLED
+};
+
+struct mem_result {
+    mem_error error = mem_error::NONE;
+    address_t address{{0}};
+    std::vector<uint8_t> data;
+
+    explicit operator bool() const { return error == mem_error::NONE; }
+};
+
+struct mem_policy {
+    // Time allowed for a single attempt, counted from when it is issued
+    std::chrono::milliseconds timeout{200};
+    // Number of times a transaction is reissued after timing out
+    unsigned retries = 3;
+    // Whether the transaction may be answered from the register shadow, without reaching the device
+    bool shadowed = true;
+};
+
+using mem_callback = std::function<void(mem_result const &)>;
+
+// Tracks memory reads (0x17) and writes (0x16) from issue to completion.
+// Transactions are issued in order: consecutive writes are pipelined up to the write window,
+// while a read waits for everything before it, as the wiimote only streams one read at a time.
+// Issuing happens in poll(), which runs right before each output slot, so reads queued in the meantime that
+// fall close together are coalesced into one. Reads the register shadow can answer, and writes that would change
+// nothing, complete in order without reaching the device. Only writes acknowledged while alone in flight are recorded
+// in the shadow, as acks can't be told apart.
+class memory_engine {
+public:
+    using clock = std::chrono::steady_clock;
+    using report_sink = std::function<void(std::span<const uint8_t>)>;
+
+    // on_queued is called after every transaction queued, for poll() to be called soon
+    explicit memory_engine(report_sink sink, std::function<void()> on_queued = {}, size_t write_window = 4);
+
+    memory_engine(memory_engine const &) = delete;
+
+    std::future<mem_result> read(address_t address, uint16_t size, mem_callback callback = {}, mem_policy policy = {});
+
+    // Reads straight into a buffer of any size, which the caller keeps alive until the transaction completes.
+    // The result carries no data.
+    std::future<mem_result> read(address_t address, std::span<uint8_t> buffer, mem_callback callback = {},
+                                 mem_policy policy = {});
+
+    // Writes any number of bytes, split into 16 byte reports that are pipelined up to the write window.
+    // The result carries the first error of any of them.
+    std::future<mem_result> write(address_t address, std::span<const uint8_t> data, mem_callback callback = {},
+                                  mem_policy policy = {});
+
+    // Handles the payload of a 0x21 report, returns false if it matches no read in flight
+    bool on_read_data(uint16_t address_low, uint8_t error, std::span<const uint8_t> data);
+
+    // Handles a 0x22 report acknowledging a 0x16 report, returns false if no write is in flight
+    bool on_write_ack(uint8_t error_code);
+
+    // Reissues, or fails, transactions in flight past their deadline
+    void poll(clock::time_point now);
+
+    // Fails every transaction with mem_error::CANCELLED
+    void cancel_all();
+
+    size_t pending() const;
+
+    register_shadow &shadow() { return m_shadow; }
+
+private:
+    struct transaction {
+        size_t sequence;
+        bool is_write;
+        address_t address;
+        uint16_t size;
+        MemWriteReport write_report{};
+        std::vector<uint8_t> data;
+        // Where a read lands, data when empty
+        std::span<uint8_t> target;
+        // Bytes the read asks for, more than size when the reads after it were coalesced into it
+        uint16_t fetch = 0;
+        // Bytes read so far, a retry carries on from there
+        size_t received = 0;
+        mem_policy policy;
+        unsigned attempts = 0;
+        clock::time_point deadline;
+        std::promise<mem_result> promise;
+        mem_callback callback;
+    };
+
+    // Completes a transfer split over several transactions once all of them have completed
+    struct block {
+        std::atomic<size_t> remaining;
+        std::atomic<mem_error> error = mem_error::NONE;
+        mem_result result;
+        std::promise<mem_result> promise;
+        mem_callback callback;
+    };
+
+    std::future<mem_result> enqueue(transaction &&txn);
+    std::future<mem_result> enqueue(std::vector<transaction> &&parts, mem_result result, mem_callback callback);
+    void issue(transaction &txn, clock::time_point now);
+    // Issues queued transactions while ordering allows it, expects m_mutex to be held.
+    // Those answered from the shadow are moved to done, to be completed once the lock is released.
+    void pump(clock::time_point now, std::vector<transaction> &done);
+    bool answer_from_shadow(transaction &txn);
+    // Widens a read over the reads queued right after it
+    void coalesce(transaction &txn);
+    static void complete(transaction &txn, mem_error error);
+
+    report_sink m_sink;
+    std::function<void()> m_on_queued;
+    size_t m_write_window;
+
+    mutable std::mutex m_mutex;
+    size_t m_sequence = 0;
+    std::deque<transaction> m_queued;
+    std::deque<transaction> m_in_flight;
+    register_shadow m_shadow;
+};
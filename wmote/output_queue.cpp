@@ -0,0 +1,64 @@
+#include <algorithm>
+
+#include "output_queue.hpp"
+
+bool output_queue::is_idempotent(output_reports id) {
+    switch (id) {
+        case REP_OUT_RUMBLE:
+        case REP_OUT_PLAYER_LED:
+        case REP_OUT_DATA_REPORT_MODE:
+        case REP_OUT_STATUS_INFORMATION_REQUEST:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void output_queue::push(std::span<const uint8_t> report, output_priority priority) {
+    if (report.empty())
+        return;
+    std::scoped_lock lock(m_mutex);
+    auto &queue = m_queues[static_cast<size_t>(priority)];
+
+    const auto id = output_reports(report[0]);
+    if (is_idempotent(id)) {
+        // Latest wins, keeping the position of the pending report
+        auto it = std::find_if(queue.begin(), queue.end(), [id](auto const &r) { return r[0] == id; });
+        if (it != queue.end()) {
+            it->assign(report.begin(), report.end());
+            return;
+        }
+    }
+    queue.emplace_back(report.begin(), report.end());
+}
+
+std::optional<std::vector<uint8_t>> output_queue::pop(bool rumble) {
+    std::scoped_lock lock(m_mutex);
+    for (auto &queue: m_queues) {
+        if (queue.empty())
+            continue;
+
+        auto report = std::move(queue.front());
+        queue.pop_front();
+
+        if (report[0] != REP_OUT_RUMBLE) {
+            // The rumble state goes out with this report
+            auto &control = m_queues[static_cast<size_t>(output_priority::CONTROL)];
+            std::erase_if(control, [](auto const &r) { return r[0] == REP_OUT_RUMBLE; });
+        }
+        if (report.size() > 1)
+            report[1] = (report[1] & ~0x01) | uint8_t(rumble);
+        return report;
+    }
+    return {};
+}
+
+bool output_queue::empty() const {
+    std::scoped_lock lock(m_mutex);
+    return std::all_of(m_queues.begin(), m_queues.end(), [](auto const &q) { return q.empty(); });
+}
+
+void output_queue::swap(output_queue &other) {
+    std::scoped_lock lock(m_mutex, other.m_mutex);
+    m_queues.swap(other.m_queues);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <array>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+#include <cstdint>
+
+#include "enums.hpp"
+
+// Scheduling class of an output report, lower classes are always sent first
+enum class output_priority : uint8_t {
+    // Rumble, LEDs and reporting mode changes
+    CONTROL,
+    // Memory reads and writes
+    MEMORY,
+    // Status information requests
+    STATUS,
+    COUNT
+};
+
+class output_queue {
+public:
+    // Queues a report behind every pending report of the same priority.
+    // Idempotent reports (rumble, LEDs, reporting mode, status request) replace a pending report with the same id instead.
+    void push(std::span<const uint8_t> report, output_priority priority);
+
+    // Returns the next report to go out, with the rumble bit set to rumble.
+    // As every report carries the rumble bit, a pending rumble report is dropped when any other report is sent.
+    std::optional<std::vector<uint8_t>> pop(bool rumble);
+
+    bool empty() const;
+
+    void swap(output_queue &other);
+
+private:
+    static bool is_idempotent(output_reports id);
+
+    mutable std::mutex m_mutex;
+    std::array<std::deque<std::vector<uint8_t>>, static_cast<size_t>(output_priority::COUNT)> m_queues;
+};
@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "profile_cache.hpp"
+#include "internal_logging.hpp"
+
+namespace {
+    // Holds an flock on the cache file while it lives, so other processes never see a record half written
+    class file_lock {
+    public:
+        file_lock(int fd, int operation) : m_fd(fd) {
+            int res;
+            while ((res = ::flock(fd, operation)) < 0 && errno == EINTR) {}
+            if (res < 0)
+                log_error("Failed to lock profile cache: {}", std::strerror(errno));
+        }
+
+        file_lock(file_lock const &) = delete;
+
+        ~file_lock() {
+            ::flock(m_fd, LOCK_UN);
+        }
+
+    private:
+        int m_fd;
+    };
+}
+
+profile_cache::profile_cache(std::filesystem::path const &path) {
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::runtime_error(std::strerror(errno));
+
+    if (::ftruncate(m_fd, file_size) < 0) {
+        ::close(m_fd);
+        throw std::runtime_error(std::strerror(errno));
+    }
+
+    m_mapping = ::mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (m_mapping == MAP_FAILED) {
+        ::close(m_fd);
+        throw std::runtime_error(std::strerror(errno));
+    }
+
+    file_lock file(m_fd, LOCK_EX);
+    auto &head = get_header();
+    if (head.magic != magic || head.version != version || head.capacity != capacity) {
+        // New file, or written by an incompatible version
+        std::memset(m_mapping, 0, file_size);
+        head.magic = magic;
+        head.version = version;
+        head.capacity = capacity;
+    }
+}
+
+profile_cache::~profile_cache() {
+    ::munmap(m_mapping, file_size);
+    ::close(m_fd);
+}
+
+profile_cache *profile_cache::shared() {
+    static std::unique_ptr<profile_cache> cache = []() -> std::unique_ptr<profile_cache> {
+        std::filesystem::path dir;
+        if (auto xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+            dir = xdg;
+        else if (auto home = std::getenv("HOME"); home && *home)
+            dir = std::filesystem::path(home) / ".cache";
+        else
+            return nullptr;
+
+        try {
+            return std::make_unique<profile_cache>(dir / "wmote" / "profiles.bin");
+        } catch (std::exception const &e) {
+            log_error("Failed to open profile cache: {}", e.what());
+            return nullptr;
+        }
+    }();
+    return cache.get();
+}
+
+uint64_t profile_cache::device_key(std::string_view identifier) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const auto c: identifier) {
+        hash ^= uint8_t(c);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+profile_cache::header &profile_cache::get_header() const {
+    return *static_cast<header *>(m_mapping);
+}
+
+std::span<profile_cache::record> profile_cache::records() const {
+    return {reinterpret_cast<record *>(static_cast<uint8_t *>(m_mapping) + sizeof(header)), capacity};
+}
+
+bool profile_cache::usable(record const &rec) {
+    return rec.valid == 1 && rec.size <= max_block_size;
+}
+
+std::optional<std::vector<uint8_t>> profile_cache::load(uint64_t device, uint64_t extension, address_t address) const {
+    std::scoped_lock lock(m_mutex);
+    file_lock file(m_fd, LOCK_SH);
+    for (auto const &rec: records()) {
+        if (usable(rec) && rec.device == device && rec.extension == extension && address == rec.address)
+            return std::vector<uint8_t>(rec.data.begin(), rec.data.begin() + rec.size);
+    }
+    return {};
+}
+
+bool profile_cache::store(uint64_t device, uint64_t extension, address_t address, std::span<const uint8_t> data) {
+    if (data.size() > max_block_size)
+        throw std::invalid_argument("data");
+
+    std::scoped_lock lock(m_mutex);
+    file_lock file(m_fd, LOCK_EX);
+    auto recs = records();
+    auto it = std::find_if(recs.begin(), recs.end(), [&](record const &rec) {
+        return usable(rec) && rec.device == device && rec.extension == extension && address == rec.address;
+    });
+    if (it != recs.end() && it->size == data.size() && std::equal(data.begin(), data.end(), it->data.begin()))
+        return false;
+
+    if (it == recs.end())
+        it = std::find_if(recs.begin(), recs.end(), [](record const &rec) { return !usable(rec); });
+    if (it == recs.end()) {
+        auto &head = get_header();
+        it = recs.begin() + head.next_victim % capacity;
+        head.next_victim = (head.next_victim + 1) % capacity;
+    }
+
+    it->valid = 0;
+    it->device = device;
+    it->extension = extension;
+    it->address = address;
+    it->size = data.size();
+    std::copy(data.begin(), data.end(), it->data.begin());
+    it->valid = 1;
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "memory.hpp"
+
+// Persistent cache of calibration blocks read from device memory,
+// keyed by device, extension id (0 for the wiimote itself) and address.
+// Stored as a fixed size table of records in a memory mapped file, which other processes may share: it is locked
+// with flock while in use, and whatever it holds is checked before being trusted.
+class profile_cache {
+public:
+    constexpr static size_t max_block_size = 16;
+    constexpr static size_t capacity = 256;
+
+    explicit profile_cache(std::filesystem::path const &path);
+
+    profile_cache(profile_cache const &) = delete;
+
+    ~profile_cache();
+
+    // Cache shared by every wiimote, stored in $XDG_CACHE_HOME/wmote, or null if it couldn't be opened
+    static profile_cache *shared();
+
+    // Hashes a device identifier, like a serial number or device path, into a key
+    static uint64_t device_key(std::string_view identifier);
+
+    std::optional<std::vector<uint8_t>> load(uint64_t device, uint64_t extension, address_t address) const;
+
+    // Returns false if the stored block was already identical
+    bool store(uint64_t device, uint64_t extension, address_t address, std::span<const uint8_t> data);
+
+private:
+    struct header {
+        std::array<char, 4> magic;
+        uint32_t version;
+        uint32_t capacity;
+        uint32_t next_victim;
+    };
+    static_assert(sizeof(header) == 16);
+
+    struct record {
+        uint64_t device;
+        uint64_t extension;
+        std::array<uint8_t, 4> address;
+        uint8_t size;
+        // 1 once written, anything else means unused
+        uint8_t valid;
+        uint8_t _unused[2];
+        std::array<uint8_t, max_block_size> data;
+    };
+    static_assert(sizeof(record) == 40);
+
+    constexpr static std::array<char, 4> magic = {'W', 'M', 'P', 'C'};
+    constexpr static uint32_t version = 1;
+    constexpr static size_t file_size = sizeof(header) + capacity * sizeof(record);
+
+    header &get_header() const;
+    std::span<record> records() const;
+    static bool usable(record const &rec);
+
+    mutable std::mutex m_mutex;
+    int m_fd = -1;
+    void *m_mapping = nullptr;
+};
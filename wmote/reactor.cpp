@@ -0,0 +1,391 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "reactor.hpp"
+#include "wiimote.hpp"
+#include "internal_logging.hpp"
+
+namespace {
+    // Hashed timer wheel with one slot per tick, entries further out than a full turn wait for their round
+    class timer_wheel {
+    public:
+        constexpr static size_t slot_count = 32;
+
+        // Returns the tick the entry ends up at, entries in the past are due on the next advance
+        uint64_t schedule(size_t id, uint64_t tick) {
+            tick = std::max(tick, m_current);
+            m_slots[tick % slot_count].push_back({id, tick});
+            return tick;
+        }
+
+        // Calls f(id, tick) for every entry due at or before now
+        template<typename F>
+        void advance(uint64_t now, F &&f) {
+            if (now >= m_current + slot_count) {
+                // Slept through a whole turn, every slot is due for a check
+                for (auto &slot: m_slots)
+                    fire(slot, now, f);
+                m_current = now + 1;
+                return;
+            }
+            for (; m_current <= now; ++m_current)
+                fire(m_slots[m_current % slot_count], now, f);
+        }
+
+        // Earliest tick with a scheduled entry
+        std::optional<uint64_t> next() const {
+            for (auto i = 0u; i < slot_count; ++i) {
+                if (!m_slots[(m_current + i) % slot_count].empty())
+                    return m_current + i;
+            }
+            return {};
+        }
+
+    private:
+        struct entry {
+            size_t id;
+            uint64_t tick;
+        };
+
+        template<typename F>
+        void fire(std::vector<entry> &slot, uint64_t now, F &&f) {
+            if (slot.empty())
+                return;
+            m_expired.clear();
+            m_expired.swap(slot);
+            for (auto const &e: m_expired) {
+                if (e.tick > now)
+                    slot.push_back(e);
+                else
+                    f(e.id, e.tick);
+            }
+        }
+
+        std::array<std::vector<entry>, slot_count> m_slots;
+        std::vector<entry> m_expired;
+        uint64_t m_current = 0;
+    };
+}
+
+class reactor::event_loop {
+public:
+    event_loop(size_t index, bool pin);
+
+    event_loop(event_loop const &) = delete;
+
+    ~event_loop();
+
+    void add(wiimote &device);
+
+    // Returns false if the device isn't serviced by this loop
+    bool remove(wiimote &device);
+
+    // Schedules the device's output, which goes unserviced while it has nothing to send
+    void wake(wiimote &device);
+
+    size_t load() const { return m_load; }
+
+private:
+    using clock = std::chrono::steady_clock;
+    constexpr static uint64_t wake_id = UINT64_MAX;
+    // Due tick of a device that isn't scheduled
+    constexpr static uint64_t idle = UINT64_MAX;
+
+    struct device {
+        wiimote *mote;
+        int fd;
+        uint64_t due;
+    };
+
+    enum class command_type : uint8_t {
+        ADD,
+        REMOVE,
+        WAKE
+    };
+
+    struct command {
+        wiimote *mote;
+        command_type type;
+        std::promise<bool> done;
+    };
+
+    void run(std::stop_token const &stop);
+    void apply_commands();
+    void apply(std::vector<command> &commands);
+    // Takes the device off the loop, returns false if it wasn't on it
+    bool remove_device(wiimote *mote);
+    // Whether the device is still at the index
+    bool serves(size_t index, wiimote *mote) const;
+    void drain(size_t index);
+    void service(size_t index, uint64_t tick, clock::time_point now);
+    void signal();
+
+    uint64_t tick_of(clock::time_point time) const {
+        return std::chrono::floor<std::chrono::milliseconds>(time - m_start).count();
+    }
+
+    uint64_t tick_ceil(clock::time_point time) const {
+        return std::chrono::ceil<std::chrono::milliseconds>(time - m_start).count();
+    }
+
+    int m_epoll;
+    int m_wake;
+    clock::time_point m_start = clock::now();
+
+    std::mutex m_command_mutex;
+    std::vector<command> m_commands;
+    // Set once the loop has stopped, after which devices are removed by the caller
+    bool m_stopped = false;
+
+    // Indexed by the epoll event data
+    std::vector<std::optional<device>> m_devices;
+    timer_wheel m_timers;
+    std::atomic<size_t> m_load = 0;
+
+    std::jthread m_thread;
+};
+
+reactor::event_loop::event_loop(size_t index, bool pin)
+        : m_epoll(epoll_create1(EPOLL_CLOEXEC)), m_wake(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (m_epoll < 0 || m_wake < 0)
+        throw std::runtime_error(std::strerror(errno));
+
+    epoll_event event{.events = EPOLLIN, .data = {.u64 = wake_id}};
+    epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &event);
+
+    m_thread = std::jthread([this](std::stop_token stop) { run(stop); });
+    if (pin) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &set);
+        if (pthread_setaffinity_np(m_thread.native_handle(), sizeof(set), &set) != 0)
+            log_error("Failed to pin event loop {}", index);
+    }
+}
+
+reactor::event_loop::~event_loop() {
+    m_thread.request_stop();
+    signal();
+    m_thread.join();
+    ::close(m_wake);
+    ::close(m_epoll);
+}
+
+void reactor::event_loop::signal() {
+    eventfd_write(m_wake, 1);
+}
+
+void reactor::event_loop::add(wiimote &device) {
+    ++m_load;
+    std::scoped_lock lock(m_command_mutex);
+    m_commands.push_back({&device, command_type::ADD, {}});
+    signal();
+}
+
+bool reactor::event_loop::remove(wiimote &device) {
+    bool removed = false;
+    if (std::this_thread::get_id() == m_thread.get_id()) {
+        // Nothing would answer a command from the loop's own thread, as when a callback lets go of a device.
+        // Commands already queued go first, in case one adds the device.
+        apply_commands();
+        removed = remove_device(&device);
+    } else {
+        std::future<bool> done;
+        {
+            std::scoped_lock lock(m_command_mutex);
+            if (m_stopped) {
+                removed = remove_device(&device);
+            } else {
+                m_commands.push_back({&device, command_type::REMOVE, {}});
+                done = m_commands.back().done.get_future();
+                signal();
+            }
+        }
+        if (done.valid())
+            removed = done.get();
+    }
+    if (removed)
+        --m_load;
+    return removed;
+}
+
+void reactor::event_loop::wake(wiimote &device) {
+    std::scoped_lock lock(m_command_mutex);
+    m_commands.push_back({&device, command_type::WAKE, {}});
+    signal();
+}
+
+bool reactor::event_loop::remove_device(wiimote *mote) {
+    auto it = std::find_if(m_devices.begin(), m_devices.end(), [mote](auto const &d) { return d && d->mote == mote; });
+    if (it == m_devices.end())
+        return false;
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, (*it)->fd, nullptr);
+    it->reset();
+    return true;
+}
+
+void reactor::event_loop::apply_commands() {
+    std::vector<command> commands;
+    {
+        std::scoped_lock lock(m_command_mutex);
+        commands.swap(m_commands);
+    }
+    apply(commands);
+}
+
+void reactor::event_loop::apply(std::vector<command> &commands) {
+    for (auto &cmd: commands) {
+        if (cmd.type == command_type::ADD) {
+            auto it = std::find_if(m_devices.begin(), m_devices.end(), [](auto const &d) { return !d; });
+            if (it == m_devices.end())
+                it = m_devices.insert(it, std::nullopt);
+            const size_t index = it - m_devices.begin();
+
+            const auto fd = cmd.mote->m_transport->native_handle();
+            epoll_event event{.events = EPOLLIN, .data = {.u64 = index}};
+            if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+                log_error("Failed to poll device: {}", std::strerror(errno));
+
+            *it = device{cmd.mote, fd, 0};
+            (*it)->due = m_timers.schedule(index, tick_of(clock::now()));
+            cmd.done.set_value(true);
+        } else if (cmd.type == command_type::REMOVE) {
+            cmd.done.set_value(remove_device(cmd.mote));
+        } else {
+            auto it = std::find_if(m_devices.begin(), m_devices.end(),
+                                   [&cmd](auto const &d) { return d && d->mote == cmd.mote; });
+            if (it != m_devices.end())
+                (*it)->due = m_timers.schedule(it - m_devices.begin(), tick_of(clock::now()));
+        }
+    }
+}
+
+bool reactor::event_loop::serves(size_t index, wiimote *mote) const {
+    return index < m_devices.size() && m_devices[index] && m_devices[index]->mote == mote;
+}
+
+void reactor::event_loop::drain(size_t index) {
+    if (index >= m_devices.size() || !m_devices[index])
+        return;
+    // Looked up again after every report, as a callback may detach the device and commands can move the others
+    const auto mote = m_devices[index]->mote;
+
+    report_batch batch;
+    for (;;) {
+        const auto count = mote->m_transport->read_batch(batch, 0);
+        const auto received = clock::now();
+        for (auto i = 0u; i < batch.count; ++i) {
+            mote->process_report(batch[i], received);
+            if (!serves(index, mote))
+                return;
+        }
+        if (count == ssize_t(batch.capacity))
+            continue;
+        if (count < 0) {
+            // Stop polling, otherwise a disconnected device keeps the loop spinning
+            log_error("Failed to read from device, no longer polling it");
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, m_devices[index]->fd, nullptr);
+            mote->lost_connection();
+        }
+        return;
+    }
+}
+
+void reactor::event_loop::service(size_t index, uint64_t tick, clock::time_point now) {
+    if (!m_devices[index] || m_devices[index]->due != tick)
+        return;
+
+    const auto mote = m_devices[index]->mote;
+    const auto next = mote->service_output(now);
+    if (!serves(index, mote))
+        return;
+    // An idle device is scheduled again once it queues output
+    auto &dev = m_devices[index];
+    if (next == clock::time_point::max())
+        dev->due = idle;
+    else
+        dev->due = m_timers.schedule(index, std::max(tick_ceil(next), tick + 1));
+}
+
+void reactor::event_loop::run(std::stop_token const &stop) {
+    std::array<epoll_event, 64> events{};
+    while (!stop.stop_requested()) {
+        int timeout = -1;
+        if (auto next = m_timers.next()) {
+            const auto now = tick_of(clock::now());
+            timeout = *next > now ? int(*next - now) : 0;
+        }
+
+        const auto count = epoll_wait(m_epoll, events.data(), events.size(), timeout);
+        if (count < 0 && errno != EINTR) {
+            log_error("Event loop stopped: {}", std::strerror(errno));
+            break;
+        }
+        for (auto i = 0; i < count; ++i) {
+            if (events[i].data.u64 == wake_id) {
+                eventfd_t value;
+                eventfd_read(m_wake, &value);
+                apply_commands();
+            } else {
+                drain(events[i].data.u64);
+            }
+        }
+
+        const auto now = clock::now();
+        m_timers.advance(tick_of(now), [&](size_t index, uint64_t tick) { service(index, tick, now); });
+    }
+    // Release anyone waiting on a detach, later ones are handled by the caller
+    std::scoped_lock lock(m_command_mutex);
+    m_stopped = true;
+    apply(m_commands);
+    m_commands.clear();
+}
+
+reactor::reactor(size_t threads, bool pin_threads) {
+    for (auto i = 0u; i < std::max<size_t>(threads, 1); ++i)
+        m_loops.push_back(std::make_unique<event_loop>(i, pin_threads));
+}
+
+reactor::~reactor() = default;
+
+void reactor::attach(wiimote &device) {
+    if (device.m_transport->native_handle() < 0)
+        throw std::invalid_argument("Transport can't be polled");
+
+    auto loop = std::min_element(m_loops.begin(), m_loops.end(), [](auto const &a, auto const &b) {
+        return a->load() < b->load();
+    });
+    device.m_reactor_loop = loop - m_loops.begin();
+    (*loop)->add(device);
+}
+
+void reactor::detach(wiimote &device) {
+    for (auto &loop: m_loops) {
+        if (loop->remove(device))
+            return;
+    }
+}
+
+void reactor::wake(wiimote &device) {
+    m_loops[device.m_reactor_loop % m_loops.size()]->wake(device);
+}
+
+size_t reactor::size() const {
+    size_t total = 0;
+    for (auto const &loop: m_loops)
+        total += loop->load();
+    return total;
+}
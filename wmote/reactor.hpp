@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class wiimote;
+
+// Services many wiimotes from a few event loop threads, instead of a read and a write thread per wiimote.
+// Each loop polls the file descriptors of its devices, decodes reports inline,
+// and paces their output from a shared timer wheel.
+class reactor {
+public:
+    // Spreads devices over threads event loops, optionally pinning each loop to its own core
+    explicit reactor(size_t threads = 1, bool pin_threads = false);
+
+    reactor(reactor const &) = delete;
+
+    // Every device must be detached first
+    ~reactor();
+
+    // Services the device from the least loaded event loop until it is detached.
+    // The device's transport must have a native handle.
+    void attach(wiimote &device);
+
+    // Returns once no event loop touches the device anymore. May be called from a callback on an event loop.
+    void detach(wiimote &device);
+
+    // Services the output of a device that had nothing to send, as soon as possible
+    void wake(wiimote &device);
+
+    size_t size() const;
+
+private:
+    class event_loop;
+
+    std::vector<std::unique_ptr<event_loop>> m_loops;
+};
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "recording.hpp"
+#include "internal_logging.hpp"
+
+using namespace recording_format;
+
+report_recorder::report_recorder(std::filesystem::path const &path)
+        : m_file(std::fopen(path.c_str(), "wb")) {
+    if (!m_file)
+        throw std::runtime_error(std::strerror(errno));
+
+    const header head{magic, version, sizeof(record), 0};
+    if (std::fwrite(&head, sizeof(head), 1, m_file) != 1) {
+        const auto error = errno;
+        std::fclose(m_file);
+        throw std::runtime_error(std::strerror(error));
+    }
+}
+
+report_recorder::~report_recorder() {
+    if (std::fclose(m_file) != 0 && !m_failed)
+        log_error("Failed to close recording after {} reports: {}", m_count, std::strerror(errno));
+}
+
+void report_recorder::fail(char const *operation) {
+    m_failed = true;
+    log_error("Failed to {} recording, stopping after {} reports: {}", operation, m_count, std::strerror(errno));
+}
+
+bool report_recorder::append(std::chrono::steady_clock::time_point time, std::span<const uint8_t> report) {
+    record rec{};
+    rec.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    rec.size = std::min(report.size(), max_report_size);
+    std::copy_n(report.begin(), rec.size, rec.data.begin());
+
+    std::scoped_lock lock(m_mutex);
+    if (m_failed)
+        return false;
+    // A record cut short by a failure is left out when the recording is read
+    if (std::fwrite(&rec, sizeof(rec), 1, m_file) != 1) {
+        fail("write");
+        return false;
+    }
+    ++m_count;
+    return true;
+}
+
+bool report_recorder::flush() {
+    std::scoped_lock lock(m_mutex);
+    if (m_failed)
+        return false;
+    if (std::fflush(m_file) != 0) {
+        fail("flush");
+        return false;
+    }
+    return true;
+}
+
+size_t report_recorder::size() const {
+    std::scoped_lock lock(m_mutex);
+    return m_count;
+}
+
+report_recording::report_recording(std::filesystem::path const &path) {
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error(std::strerror(errno));
+
+    struct stat st{};
+    if (::fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(header)) {
+        ::close(fd);
+        throw std::runtime_error("Not a recording");
+    }
+
+    m_mapping_size = st.st_size;
+    m_mapping = ::mmap(nullptr, m_mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (m_mapping == MAP_FAILED)
+        throw std::runtime_error(std::strerror(errno));
+
+    auto const &head = *static_cast<header const *>(m_mapping);
+    if (head.magic != magic || head.version != version || head.record_size != sizeof(record)) {
+        ::munmap(m_mapping, m_mapping_size);
+        throw std::runtime_error("Not a recording, or recorded by an incompatible version");
+    }
+
+    const auto count = (m_mapping_size - sizeof(header)) / sizeof(record);
+    m_records = {reinterpret_cast<record const *>(static_cast<uint8_t const *>(m_mapping) + sizeof(header)), count};
+}
+
+report_recording::~report_recording() {
+    ::munmap(m_mapping, m_mapping_size);
+}
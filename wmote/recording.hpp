@@ -0,0 +1,81 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <span>
+
+// Recordings are a 16 byte header followed by fixed size records, so they can be memory mapped and indexed directly
+namespace recording_format {
+    constexpr std::array<char, 4> magic = {'W', 'M', 'R', 'C'};
+    constexpr uint32_t version = 1;
+    constexpr size_t max_report_size = 23;
+
+    struct header {
+        std::array<char, 4> magic;
+        uint32_t version;
+        uint32_t record_size;
+        uint32_t _unused;
+    };
+    static_assert(sizeof(header) == 16);
+
+    struct record {
+        // Monotonic time the report was read at
+        uint64_t timestamp_ns;
+        uint8_t size;
+        std::array<uint8_t, max_report_size> data;
+
+        std::span<const uint8_t> report() const { return {data.data(), size}; }
+    };
+    static_assert(sizeof(record) == 32);
+}
+
+// Appends input reports to a recording
+class report_recorder {
+public:
+    explicit report_recorder(std::filesystem::path const &path);
+
+    report_recorder(report_recorder const &) = delete;
+
+    ~report_recorder();
+
+    // Returns false once writing has failed, e.g. on a full disk, after which nothing more is recorded
+    bool append(std::chrono::steady_clock::time_point time, std::span<const uint8_t> report);
+
+    bool flush();
+
+    // Number of reports appended, the latest of which may still be buffered
+    size_t size() const;
+
+private:
+    // Expects m_mutex to be held
+    void fail(char const *operation);
+
+    mutable std::mutex m_mutex;
+    std::FILE *m_file;
+    size_t m_count = 0;
+    bool m_failed = false;
+};
+
+// Read only, memory mapped view of a recording
+class report_recording {
+public:
+    explicit report_recording(std::filesystem::path const &path);
+
+    report_recording(report_recording const &) = delete;
+
+    ~report_recording();
+
+    std::span<const recording_format::record> records() const { return m_records; }
+
+    size_t size() const { return m_records.size(); }
+
+    recording_format::record const &operator[](size_t index) const { return m_records[index]; }
+
+private:
+    void *m_mapping = nullptr;
+    size_t m_mapping_size = 0;
+    std::span<const recording_format::record> m_records;
+};
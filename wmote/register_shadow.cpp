@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <bit>
+#include <iterator>
+
+#include "register_shadow.hpp"
+#include "byteswap.hpp"
+#include "enums.hpp"
+
+namespace {
+    uint32_t key_of(address_t address) {
+        return bswap_on_le(address.as_uint32());
+    }
+
+    // Register blocks whose contents only change through writes and hot plugging
+    bool tracked_block(address_t address) {
+        const auto bytes = address.value();
+        return bytes[0] == MEM_REGISTER && (bytes[1] == 0xA4 || bytes[1] == 0xA6);
+    }
+
+    uint32_t block_of(uint32_t key) {
+        return key & 0xffff0000;
+    }
+    constexpr uint32_t block_size = 0x10000;
+    constexpr uint32_t eeprom_size = 0x1700;
+}
+
+bool register_shadow::shadowed(address_t address, size_t size) {
+    if (address.value()[0] == MEM_EEPROM)
+        return key_of(address) + size <= eeprom_size;
+    // Below 0x20 the extension registers hold its inputs
+    const auto offset = key_of(address) & 0xffff;
+    return tracked_block(address) && offset >= 0x20 && offset + size <= 0x100;
+}
+
+bool register_shadow::read(address_t address, std::span<uint8_t> out) const {
+    const auto begin = key_of(address);
+    std::scoped_lock lock(m_mutex);
+    auto it = m_contents.upper_bound(begin);
+    if (it == m_contents.begin())
+        return false;
+    --it;
+    // Runs are merged when they meet, so a known range lies in a single run
+    if (begin + out.size() > it->first + it->second.size())
+        return false;
+    std::copy_n(it->second.begin() + (begin - it->first), out.size(), out.begin());
+    return true;
+}
+
+void register_shadow::store_read(address_t address, std::span<const uint8_t> data) {
+    std::scoped_lock lock(m_mutex);
+    insert(key_of(address), data);
+}
+
+bool register_shadow::redundant_write(address_t address, std::span<const uint8_t> data) const {
+    if (address.value()[0] == MEM_EEPROM) {
+        std::vector<uint8_t> known(data.size());
+        return read(address, known) && std::equal(known.begin(), known.end(), data.begin());
+    }
+    if (!tracked_block(address))
+        return false;
+    std::scoped_lock lock(m_mutex);
+    const auto it = m_written.find(key_of(address));
+    return it != m_written.end() && std::equal(it->second.begin(), it->second.end(), data.begin(), data.end());
+}
+
+void register_shadow::store_write(address_t address, std::span<const uint8_t> data) {
+    const auto begin = key_of(address);
+    std::scoped_lock lock(m_mutex);
+    // The EEPROM reads back what was written
+    if (address.value()[0] == MEM_EEPROM)
+        return insert(begin, data);
+    if (!tracked_block(address))
+        return;
+
+    forget_registers(begin, begin + uint32_t(data.size()));
+    m_written.emplace(begin, std::vector(data.begin(), data.end()));
+}
+
+void register_shadow::forget_write(address_t address, size_t size) {
+    const auto begin = key_of(address);
+    std::scoped_lock lock(m_mutex);
+    if (address.value()[0] == MEM_EEPROM)
+        erase(begin, begin + uint32_t(size));
+    else if (tracked_block(address))
+        forget_registers(begin, begin + uint32_t(size));
+}
+
+void register_shadow::invalidate_block(address_t address) {
+    const auto block = block_of(key_of(address));
+    std::scoped_lock lock(m_mutex);
+    erase(block, block + block_size);
+    std::erase_if(m_written, [&](auto const &entry) { return block_of(entry.first) == block; });
+}
+
+void register_shadow::clear() {
+    std::scoped_lock lock(m_mutex);
+    m_contents.clear();
+    m_written.clear();
+}
+
+void register_shadow::erase(uint32_t begin, uint32_t end) {
+    auto it = m_contents.upper_bound(begin);
+    if (it != m_contents.begin() && std::prev(it)->first + std::prev(it)->second.size() > begin)
+        --it;
+    while (it != m_contents.end() && it->first < end) {
+        const auto start = it->first;
+        auto bytes = std::move(it->second);
+        it = m_contents.erase(it);
+        // Keep whatever sticks out on either side
+        if (start < begin)
+            m_contents.emplace(start, std::vector(bytes.begin(), bytes.begin() + (begin - start)));
+        if (start + bytes.size() > end) {
+            m_contents.emplace(end, std::vector(bytes.begin() + (end - start), bytes.end()));
+            break;
+        }
+    }
+}
+
+void register_shadow::forget_registers(uint32_t begin, uint32_t end) {
+    erase(begin, end);
+    // Registers from 0xf0 initialise the extension, or swap it with the motionplus, which changes both blocks. Control
+    // writes to either then have to be sent again, e.g. switching the motionplus off after it was switched on.
+    if ((begin & 0xffff) + (end - begin) > 0xf0) {
+        for (const uint32_t block: {0x04a40000u, 0x04a60000u})
+            erase(block, block + block_size);
+        // Only the two blocks are ever written down
+        m_written.clear();
+    }
+    std::erase_if(m_written, [&](auto const &entry) {
+        return entry.first < end && entry.first + entry.second.size() > begin;
+    });
+}
+
+void register_shadow::insert(uint32_t begin, std::span<const uint8_t> data) {
+    const auto end = begin + uint32_t(data.size());
+    erase(begin, end);
+
+    std::vector<uint8_t> run(data.begin(), data.end());
+    auto start = begin;
+    auto next = m_contents.lower_bound(begin);
+    if (next != m_contents.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second.size() == begin) {
+            start = previous->first;
+            run.insert(run.begin(), previous->second.begin(), previous->second.end());
+            m_contents.erase(previous);
+        }
+    }
+    if (next != m_contents.end() && next->first == end) {
+        run.insert(run.end(), next->second.begin(), next->second.end());
+        m_contents.erase(next);
+    }
+    m_contents.emplace(start, std::move(run));
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "memory.hpp"
+
+// What device memory and registers were last seen to hold, so reads can be answered and repeated writes skipped
+// without a round trip. Only memory that changes through writes and hot plugging is shadowed: the EEPROM, and the
+// extension and motionplus registers from their calibration up.
+class register_shadow {
+public:
+    static bool shadowed(address_t address, size_t size);
+
+    // Fills out if every byte of it is known
+    bool read(address_t address, std::span<uint8_t> out) const;
+
+    // Records what a read returned
+    void store_read(address_t address, std::span<const uint8_t> data);
+
+    // Whether writing data would leave the device as it is
+    bool redundant_write(address_t address, std::span<const uint8_t> data) const;
+
+    // Records an acknowledged write, forgetting whatever it could have changed
+    void store_write(address_t address, std::span<const uint8_t> data);
+
+    // Forgets whatever a write may have changed, when it isn't known whether it reached the device
+    void forget_write(address_t address, size_t size);
+
+    // Forgets the register block holding the address, e.g. when an extension is plugged in or out
+    void invalidate_block(address_t address);
+
+    void clear();
+
+private:
+    // Expects m_mutex to be held
+    void erase(uint32_t begin, uint32_t end);
+    void insert(uint32_t begin, std::span<const uint8_t> data);
+    // Forgets the registers and register writes a write to [begin, end) could have changed
+    void forget_registers(uint32_t begin, uint32_t end);
+
+    mutable std::mutex m_mutex;
+    // Known bytes as disjoint runs, keyed by their first address
+    std::map<uint32_t, std::vector<uint8_t>> m_contents;
+    // Register writes since the block was last invalidated, keyed by address
+    std::map<uint32_t, std::vector<uint8_t>> m_written;
+};
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "replay_transport.hpp"
+
+replay_transport::replay_transport(std::filesystem::path const &path, pacing mode, bool loop)
+        : replay_transport(std::make_shared<report_recording>(path), mode, loop) {
+}
+
+replay_transport::replay_transport(std::shared_ptr<report_recording const> recording, pacing mode, bool loop)
+        : m_recording(std::move(recording)), m_pacing(mode), m_loop(loop && m_recording && m_recording->size()),
+          m_start(clock::now()), m_timer(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) {
+    if (!m_recording)
+        throw std::invalid_argument("No recording to replay");
+    if (m_timer < 0)
+        throw std::runtime_error(std::strerror(errno));
+    arm_timer();
+}
+
+replay_transport::~replay_transport() {
+    ::close(m_timer);
+}
+
+replay_transport::clock::time_point replay_transport::due_time() const {
+    if (m_pacing == pacing::AS_FAST_AS_POSSIBLE)
+        return m_start;
+    auto const &records = m_recording->records();
+    const auto first = std::chrono::nanoseconds(records.front().timestamp_ns);
+    const auto current = std::chrono::nanoseconds(records[m_index].timestamp_ns);
+    return m_start + m_offset + (current - first);
+}
+
+void replay_transport::arm_timer() {
+    itimerspec spec{};
+    if (!finished()) {
+        // steady_clock is CLOCK_MONOTONIC, a zero value would disarm the timer so the earliest is 1ns
+        const auto ns = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                due_time().time_since_epoch()).count());
+        spec.it_value.tv_sec = ns / 1'000'000'000;
+        spec.it_value.tv_nsec = ns % 1'000'000'000;
+    }
+    // Rearming also clears any expirations, so the fd stops polling readable
+    count_syscalls();
+    ::timerfd_settime(m_timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+ssize_t replay_transport::read(std::span<uint8_t> report, int timeout_ms) {
+    if (finished()) {
+        // Behave like an idle device, without blocking forever
+        const auto wait = timeout_ms < 0 ? 100 : std::min(timeout_ms, 100);
+        std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+        return 0;
+    }
+
+    const auto due = due_time();
+    if (due > clock::now()) {
+        if (timeout_ms == 0)
+            return 0;
+        if (timeout_ms > 0 && due > clock::now() + std::chrono::milliseconds(timeout_ms)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+            return 0;
+        }
+        std::this_thread::sleep_until(due);
+        count_wakeup();
+    }
+    if (m_pacing == pacing::REAL_TIME)
+        count_latency(clock::now() - due);
+    count_read();
+
+    auto const &records = m_recording->records();
+    const auto data = records[m_index].report();
+    const auto size = std::min(data.size(), report.size());
+    std::copy_n(data.begin(), size, report.begin());
+
+    if (++m_index == records.size() && m_loop) {
+        // Next pass starts one average report interval after the last report
+        const auto length = std::chrono::nanoseconds(records.back().timestamp_ns - records.front().timestamp_ns);
+        m_offset += length + length / std::max<size_t>(1, records.size() - 1);
+        m_index = 0;
+    }
+    arm_timer();
+    return ssize_t(size);
+}
+
+ssize_t replay_transport::write(std::span<const uint8_t> report) {
+    count_written();
+    return ssize_t(report.size());
+}
+
+int replay_transport::native_handle() const {
+    return m_timer;
+}
+
+std::string replay_transport::identifier() const {
+    return "replay";
+}
+
+bool replay_transport::finished() const {
+    return m_index >= m_recording->size();
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <chrono>
+#include <filesystem>
+#include <memory>
+
+#include "transport.hpp"
+#include "recording.hpp"
+
+// Feeds a wiimote the reports of a recording, as if they came from a device. Output reports are discarded.
+class replay_transport : public hid_transport {
+public:
+    enum class pacing {
+        // Reports arrive as far apart as they were recorded
+        REAL_TIME,
+        // Every report is available immediately
+        AS_FAST_AS_POSSIBLE
+    };
+
+    explicit replay_transport(std::filesystem::path const &path, pacing mode = pacing::REAL_TIME, bool loop = false);
+
+    replay_transport(std::shared_ptr<report_recording const> recording, pacing mode = pacing::REAL_TIME, bool loop = false);
+
+    replay_transport(replay_transport const &) = delete;
+
+    ~replay_transport() override;
+
+    ssize_t read(std::span<uint8_t> report, int timeout_ms) override;
+
+    ssize_t write(std::span<const uint8_t> report) override;
+
+    // Timer that polls readable once the next report is due
+    int native_handle() const override;
+
+    std::string identifier() const override;
+
+    // True once every report has been read, never for a looping replay
+    bool finished() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    clock::time_point due_time() const;
+    void arm_timer();
+
+    std::shared_ptr<report_recording const> m_recording;
+    pacing m_pacing;
+    bool m_loop;
+    size_t m_index = 0;
+    clock::time_point m_start;
+    // Offset of recording time to replay time, grows by the length of the recording every loop
+    clock::duration m_offset{};
+    int m_timer;
+};
@@ -0,0 +1,97 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "reports.hpp"
+
+enum class ir_format : uint8_t {
+    NONE,
+    // 10 bytes, positions of two pairs of dots
+    BASIC,
+    // 12 bytes, position and size of each dot
+    EXTENDED,
+    // 18 bytes per report, two dots with their bounding box and intensity, split over 0x3e and 0x3f
+    FULL
+};
+
+// Where each kind of data sits in a data report. Offsets count from the report id.
+struct report_layout {
+    // Total report size, including the id
+    uint8_t size = 0;
+    bool buttons = false;
+    bool acc = false;
+    ir_format ir = ir_format::NONE;
+    uint8_t ir_offset = 0;
+    uint8_t extension_offset = 0;
+    uint8_t extension_size = 0;
+    // For the interleaved modes, which report carries the second half of the data
+    bool second_half = false;
+
+    constexpr bool valid() const { return size != 0; }
+};
+
+// Layout of every data report, indexed by report id. Decoders are generated from this at compile time.
+constexpr report_layout layout_of(uint8_t id) {
+    switch (id) {
+        case REP_IN_BUTTONS:
+            return {.size = 3, .buttons = true};
+        case REP_IN_BUTTONS_ACC:
+            return {.size = 6, .buttons = true, .acc = true};
+        case REP_IN_BUTTONS_EXT_8B:
+            return {.size = 11, .buttons = true, .extension_offset = 3, .extension_size = 8};
+        case REP_IN_BUTTONS_ACC_IR_12B:
+            return {.size = 18, .buttons = true, .acc = true, .ir = ir_format::EXTENDED, .ir_offset = 6};
+        case REP_IN_BUTTONS_EXT_19B:
+            return {.size = 22, .buttons = true, .extension_offset = 3, .extension_size = 19};
+        case REP_IN_BUTTONS_ACC_EXT_16B:
+            return {.size = 22, .buttons = true, .acc = true, .extension_offset = 6, .extension_size = 16};
+        case REP_IN_BUTTONS_IR_10B_EXTENSION_9B:
+            return {.size = 22, .buttons = true, .ir = ir_format::BASIC, .ir_offset = 3,
+                    .extension_offset = 13, .extension_size = 9};
+        case REP_IN_BUTTONS_ACC_IR_10B_EXTENSION_6B:
+            return {.size = 22, .buttons = true, .acc = true, .ir = ir_format::BASIC, .ir_offset = 6,
+                    .extension_offset = 16, .extension_size = 6};
+        case REP_IN_EXT_21B:
+            return {.size = 22, .extension_offset = 1, .extension_size = 21};
+        case REP_IN_BUTTONS_ACC_IR_36B:
+            return {.size = 22, .buttons = true, .acc = true, .ir = ir_format::FULL, .ir_offset = 4};
+        case REP_IN_BUTTONS_ACC_IR_36B_ALT:
+            return {.size = 22, .buttons = true, .acc = true, .ir = ir_format::FULL, .ir_offset = 4,
+                    .second_half = true};
+        default:
+            return {};
+    }
+}
+
+// Data reports are 0x30 to 0x3f
+constexpr uint8_t first_data_report = 0x30;
+constexpr size_t data_report_count = 0x10;
+
+// Smallest data report with buttons and the requested data, extension data being at least the 6 bytes every
+// extension needs. Between reports of the same size the lowest id wins.
+constexpr uint8_t smallest_report_with(bool acc, bool ir, bool extension) {
+    uint8_t best = REP_IN_BUTTONS;
+    for (auto id = first_data_report; id < first_data_report + data_report_count; ++id) {
+        const auto layout = layout_of(id);
+        // The interleaved modes need both halves and a camera mode of their own
+        if (!layout.valid() || !layout.buttons || layout.ir == ir_format::FULL)
+            continue;
+        if ((acc && !layout.acc) || (ir && layout.ir == ir_format::NONE) || (extension && layout.extension_size < 6))
+            continue;
+        const auto best_layout = layout_of(best);
+        const bool best_covers = (!acc || best_layout.acc) && (!ir || best_layout.ir != ir_format::NONE) &&
+                                 (!extension || best_layout.extension_size >= 6);
+        if (!best_covers || layout.size < best_layout.size)
+            best = id;
+    }
+    return best;
+}
+
+static_assert(smallest_report_with(false, false, false) == REP_IN_BUTTONS);
+static_assert(smallest_report_with(true, false, false) == REP_IN_BUTTONS_ACC);
+static_assert(smallest_report_with(false, false, true) == REP_IN_BUTTONS_EXT_8B);
+static_assert(smallest_report_with(false, true, false) == REP_IN_BUTTONS_ACC_IR_12B);
+static_assert(smallest_report_with(true, false, true) == REP_IN_BUTTONS_ACC_EXT_16B);
+static_assert(smallest_report_with(false, true, true) == REP_IN_BUTTONS_IR_10B_EXTENSION_9B);
+static_assert(smallest_report_with(true, true, true) == REP_IN_BUTTONS_ACC_IR_10B_EXTENSION_6B);
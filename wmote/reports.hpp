@@ -27,6 +27,7 @@ enum input_reports : uint8_t {
     REP_IN_BUTTONS_ACC_EXT_16B = 0x35,
     REP_IN_BUTTONS_IR_10B_EXTENSION_9B = 0x36,
     REP_IN_BUTTONS_ACC_IR_10B_EXTENSION_6B = 0x37,
+    REP_IN_EXT_21B = 0x3D,
 
     // Interleaved
     REP_IN_BUTTONS_ACC_IR_36B = 0x3E,
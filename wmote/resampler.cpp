@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cmath>
+
+#include "resampler.hpp"
+#include "wiimote.hpp"
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    struct interpolated {
+        vec3<float> value;
+        // Newest report the value depends on
+        clock::time_point newest;
+        bool held = false;
+    };
+
+    vec3<float> lerp(vec3<float> a, vec3<float> b, float t) {
+        return {a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t};
+    }
+
+    // Interpolates between the samples carrying flag either side of target. Only calibrates the samples it uses.
+    template<typename Value>
+    std::optional<interpolated> interpolate(motion_window const &window, uint8_t flag, clock::time_point target,
+                                            Value &&value) {
+        std::optional<size_t> before;
+        std::optional<size_t> after;
+        for (auto i = window.size(); i-- > 0;) {
+            if (!(window.raw()[i].flags & flag))
+                continue;
+            if (window.timestamp(i) <= target) {
+                before = i;
+                break;
+            }
+            after = i;
+        }
+
+        if (before && after) {
+            const auto t0 = window.timestamp(*before);
+            const auto t1 = window.timestamp(*after);
+            const auto t = std::chrono::duration<float>(target - t0) / std::chrono::duration<float>(t1 - t0);
+            return interpolated{lerp(value(*before), value(*after), t), t1};
+        }
+        // The point is older than the history, so take the oldest there is
+        if (after)
+            return interpolated{value(*after), window.timestamp(*after)};
+        // Nothing has arrived past the point yet
+        if (before)
+            return interpolated{value(*before), window.timestamp(*before), true};
+        return {};
+    }
+}
+
+void motion_resampler::running_stats::add(double value) {
+    ++count;
+    const auto delta = value - mean;
+    mean += delta / double(count);
+    m2 += delta * (value - mean);
+    max = std::max(max, value);
+}
+
+double motion_resampler::running_stats::stddev() const {
+    return count > 1 ? std::sqrt(m2 / double(count - 1)) : 0;
+}
+
+motion_resampler::motion_resampler(wiimote const &mote, std::chrono::microseconds delay)
+        : m_mote(&mote), m_delay(delay) {
+}
+
+resampled_motion motion_resampler::sample(clock::time_point tick) {
+    using namespace std::chrono;
+    constexpr auto attempts = 4;
+    const auto target = tick - m_delay;
+
+    for (auto attempt = 1;; ++attempt) {
+        const auto window = m_mote->history(m_window);
+        const auto acc = interpolate(window, SAMPLE_ACC, target, [&](size_t i) { return window.acc(i); });
+        const auto gyro = interpolate(window, SAMPLE_GYRO, target, [&](size_t i) {
+            return window.gyro(i).value_or(vec3<float>{});
+        });
+        // Take the values again if the wiimote wrote over them while they were read, unless it keeps doing so
+        if (!window.intact() && attempt < attempts)
+            continue;
+
+        resampled_motion out{.timestamp = target, .held = true};
+        std::optional<clock::time_point> newest;
+        if (acc) {
+            out.acc = acc->value;
+            out.held = acc->held;
+            newest = acc->newest;
+        }
+        if (gyro) {
+            out.gyro = gyro->value;
+            out.held = out.held && gyro->held;
+            newest = std::max(newest.value_or(gyro->newest), gyro->newest);
+        }
+
+        // Intervals between the reports that arrived since the last output
+        for (auto i = 0u; i < window.size(); ++i) {
+            const auto index = window.first_index() + i;
+            if (m_last_raw && index <= *m_last_raw)
+                continue;
+            if (m_last_raw && index == *m_last_raw + 1)
+                m_raw_intervals.add(double(nanoseconds(window.timestamp(i) - m_last_raw_time).count()));
+            m_last_raw = index;
+            m_last_raw_time = window.timestamp(i);
+        }
+
+        out.source = newest;
+        ++m_outputs;
+        m_held += out.held;
+        if (newest)
+            m_delay_stats.add(double(nanoseconds(tick - *newest).count()));
+        if (m_last_output)
+            m_output_intervals.add(double(nanoseconds(tick - *m_last_output).count()));
+        m_last_output = tick;
+        return out;
+    }
+}
+
+resampler_stats motion_resampler::stats() const {
+    using namespace std::chrono;
+    const auto ns = [](double value) { return nanoseconds(int64_t(value)); };
+    return {
+            .outputs = m_outputs,
+            .held = m_held,
+            .delay_mean = ns(m_delay_stats.mean),
+            .delay_max = ns(m_delay_stats.max),
+            .raw_jitter = ns(m_raw_intervals.stddev()),
+            .output_jitter = ns(m_output_intervals.stddev()),
+    };
+}
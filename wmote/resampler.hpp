@@ -0,0 +1,79 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+#include "sample_history.hpp"
+#include "vec.hpp"
+
+class wiimote;
+
+// Motion at one tick of an output clock
+struct resampled_motion {
+    // Time the values are for, which trails the tick by the resampler's delay
+    std::chrono::steady_clock::time_point timestamp;
+    // In g, per axis of the wiimote
+    vec3<float> acc;
+    // Yaw, pitch and roll in degrees per second, empty without motionplus
+    std::optional<vec3<float>> gyro;
+    // Set when no report had arrived past the timestamp yet, so the latest values were repeated
+    bool held = false;
+    // When the newest report the values came from was read, empty before any has arrived
+    std::optional<std::chrono::steady_clock::time_point> source;
+};
+
+struct resampler_stats {
+    uint64_t outputs = 0;
+    uint64_t held = 0;
+    // Time from the arrival of the newest report an output used, to the output
+    std::chrono::nanoseconds delay_mean{};
+    std::chrono::nanoseconds delay_max{};
+    // Standard deviation of the interval between reports, and between outputs
+    std::chrono::nanoseconds raw_jitter{};
+    std::chrono::nanoseconds output_jitter{};
+};
+
+// Turns the reports of a wiimote, which arrive at its own pace and in passthrough modes alternate between motionplus
+// and extension data, into motion at a steady output rate.
+// Each output interpolates between the reports either side of a point a fixed delay behind the tick, so the added
+// latency is bounded by that delay. Meant to be used from a single thread.
+// The wiimote only reports what has been subscribed to, so hold a subscription to the accelerometer, and to extension
+// data for motionplus.
+class motion_resampler {
+public:
+    // Reports normally arrive every 10ms, so a delay of a little more leaves a report past the point to interpolate to
+    explicit motion_resampler(wiimote const &mote, std::chrono::microseconds delay = std::chrono::microseconds(12'000));
+
+    // Motion for an output at the given time, which should be when it is sent
+    resampled_motion sample(std::chrono::steady_clock::time_point tick);
+
+    resampler_stats stats() const;
+
+private:
+    // Mean and variance, updated one value at a time
+    struct running_stats {
+        uint64_t count = 0;
+        double mean = 0;
+        double m2 = 0;
+        double max = 0;
+
+        void add(double value);
+        double stddev() const;
+    };
+
+    wiimote const *m_mote;
+    std::chrono::microseconds m_delay;
+    // Samples copied out of the history for each output, enough to reach well past the delay at the usual report rate
+    std::array<raw_motion_sample, 32> m_window;
+
+    uint64_t m_outputs = 0;
+    uint64_t m_held = 0;
+    running_stats m_delay_stats;
+    running_stats m_raw_intervals;
+    running_stats m_output_intervals;
+    std::optional<std::chrono::steady_clock::time_point> m_last_output;
+    // Index in the history of the newest report that has been counted in the raw intervals
+    std::optional<uint64_t> m_last_raw;
+    std::chrono::steady_clock::time_point m_last_raw_time;
+};
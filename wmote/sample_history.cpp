@@ -0,0 +1,46 @@
+#include "sample_history.hpp"
+
+namespace {
+    vec3<float> calibrate(vec3<uint16_t> raw, Calibration const &calib) {
+        const vec3<float> zero = calib.zero;
+        return {(raw.x - zero.x) / (calib.gravity.x - zero.x),
+                (raw.y - zero.y) / (calib.gravity.y - zero.y),
+                (raw.z - zero.z) / (calib.gravity.z - zero.z)};
+    }
+}
+
+motion_window::motion_window(motion_history::window window, motion_calibration calibration)
+        : m_window(window), m_calibration(calibration) {
+}
+
+std::chrono::steady_clock::time_point motion_window::timestamp(size_t index) const {
+    return m_window.values[index].timestamp;
+}
+
+vec3<float> motion_window::acc(size_t index) const {
+    return calibrate(m_window.values[index].acc, m_calibration.acc);
+}
+
+std::optional<vec3<float>> motion_window::gyro(size_t index) const {
+    auto const &sample = m_window.values[index];
+    if (!(sample.flags & SAMPLE_GYRO) || !m_calibration.gyro_fast || !m_calibration.gyro_slow)
+        return {};
+
+    auto const &fast = *m_calibration.gyro_fast;
+    auto const &slow = *m_calibration.gyro_slow;
+    auto const &calib_x = sample.flags & SAMPLE_SLOW_YAW ? slow : fast;
+    auto const &calib_y = sample.flags & SAMPLE_SLOW_PITCH ? slow : fast;
+    auto const &calib_z = sample.flags & SAMPLE_SLOW_ROLL ? slow : fast;
+    const vec3<float> zero{float(calib_x.zero.x), float(calib_y.zero.y), float(calib_z.zero.z)};
+    const vec3<float> grav{float(calib_x.gravity.x), float(calib_y.gravity.y), float(calib_z.gravity.z)};
+    const vec3<float> multiplier{float(calib_x.degrees_div_6 * 6), float(calib_y.degrees_div_6 * 6),
+                                 float(calib_z.degrees_div_6 * 6)};
+
+    return vec3<float>{(sample.gyro.x - zero.x) * multiplier.x / (grav.x - zero.x),
+                       (sample.gyro.y - zero.y) * multiplier.y / (grav.y - zero.y),
+                       (sample.gyro.z - zero.z) * multiplier.z / (grav.z - zero.z)};
+}
+
+vec3<float> motion_window::extension_acc(size_t index) const {
+    return calibrate(m_window.values[index].extension_acc, m_calibration.extension_acc);
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <type_traits>
+
+#include "vec.hpp"
+#include "extensions.hpp"
+
+// Fixed capacity history written by a single producer and read by any number of consumers, without locks.
+// Values are kept as atomic words, like in a seqlock, and copied out by readers into storage of their own, so reading
+// neither locks nor allocates. The producer never waits, so readers check that what they copied wasn't overwritten
+// meanwhile.
+template<typename T, size_t Capacity> requires std::is_trivially_copyable_v<T>
+class history_ring {
+public:
+    constexpr static size_t capacity = Capacity;
+
+    // Latest values copied out, oldest first, and the index of the first of them
+    struct window {
+        std::span<const T> values;
+        uint64_t first = 0;
+        // False if the producer wrote over some of the values while they were being copied
+        bool intact = true;
+    };
+
+    // Producer only
+    void push(T const &value) {
+        std::array<uint64_t, word_count> words{};
+        std::memcpy(words.data(), &value, sizeof(T));
+
+        const auto index = m_written.load(std::memory_order_relaxed);
+        // Readers compare against this to tell whether the slot they read is being overwritten
+        m_writing.store(index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        auto &slot = m_slots[index % Capacity];
+        for (auto i = 0u; i < word_count; ++i)
+            slot[i].store(words[i], std::memory_order_relaxed);
+        m_written.store(index + 1, std::memory_order_release);
+    }
+
+    // Copies up to out.size() of the latest values to the front of out
+    window latest(std::span<T> out) const {
+        const auto written = m_written.load(std::memory_order_acquire);
+        // Leave a slot free for the producer to write into, so the window isn't overwritten right away
+        const auto count = std::min<uint64_t>({out.size(), written, Capacity - 1});
+        window w;
+        w.first = written - count;
+        w.values = out.first(count);
+        for (auto index = w.first; index < written; ++index) {
+            std::array<uint64_t, word_count> words;
+            auto const &slot = m_slots[index % Capacity];
+            for (auto i = 0u; i < word_count; ++i)
+                words[i] = slot[i].load(std::memory_order_relaxed);
+            std::array<std::byte, sizeof(T)> bytes;
+            std::memcpy(bytes.data(), words.data(), sizeof(T));
+            out[index - w.first] = std::bit_cast<T>(bytes);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        w.intact = m_writing.load(std::memory_order_relaxed) <= w.first + Capacity;
+        return w;
+    }
+
+    // Number of values pushed so far
+    uint64_t size() const {
+        return m_written.load(std::memory_order_acquire);
+    }
+
+private:
+    constexpr static size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::array<std::array<std::atomic<uint64_t>, word_count>, Capacity> m_slots{};
+    std::atomic<uint64_t> m_written = 0;
+    std::atomic<uint64_t> m_writing = 0;
+};
+
+enum sample_flags : uint8_t {
+    SAMPLE_ACC = 0x01,
+    SAMPLE_GYRO = 0x02,
+    SAMPLE_EXTENSION = 0x04,
+    SAMPLE_SLOW_YAW = 0x08,
+    SAMPLE_SLOW_PITCH = 0x10,
+    SAMPLE_SLOW_ROLL = 0x20,
+    SAMPLE_BUTTON_C = 0x40,
+    SAMPLE_BUTTON_Z = 0x80
+};
+
+// Motion data from one report, as it was read. Flags tell which parts the report carried, the rest repeat the
+// previous values.
+struct raw_motion_sample {
+    std::chrono::steady_clock::time_point timestamp;
+    vec3<uint16_t> acc;
+    // Yaw, pitch and roll
+    vec3<uint16_t> gyro;
+    // Nunchuk accelerometer and stick
+    vec3<uint16_t> extension_acc;
+    vec2<uint8_t> extension_stick;
+    uint8_t flags = 0;
+};
+
+// Calibration in effect when a window of samples was taken
+struct motion_calibration {
+    Calibration acc;
+    std::optional<MotionPlusCalibration> gyro_fast;
+    std::optional<MotionPlusCalibration> gyro_slow;
+    Calibration extension_acc;
+};
+
+using motion_history = history_ring<raw_motion_sample, 256>;
+
+// Latest motion samples of a wiimote, oldest first. Calibration is only applied to the samples that are asked for.
+class motion_window {
+public:
+    motion_window(motion_history::window window, motion_calibration calibration);
+
+    size_t size() const { return m_window.values.size(); }
+
+    std::span<const raw_motion_sample> raw() const { return m_window.values; }
+
+    // Position of the first sample among every sample the wiimote has recorded
+    uint64_t first_index() const { return m_window.first; }
+
+    std::chrono::steady_clock::time_point timestamp(size_t index) const;
+
+    // In g, per axis of the wiimote
+    vec3<float> acc(size_t index) const;
+
+    // Yaw, pitch and roll in degrees per second, as from wiimote::motionplus(). Empty without motionplus data.
+    std::optional<vec3<float>> gyro(size_t index) const;
+
+    // In g, per axis of the nunchuk
+    vec3<float> extension_acc(size_t index) const;
+
+    // False if the wiimote wrote over these samples while they were being copied, in which case take a new window
+    bool intact() const { return m_window.intact; }
+
+private:
+    motion_history::window m_window;
+    motion_calibration m_calibration;
+};
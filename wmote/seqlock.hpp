@@ -0,0 +1,55 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Publishes a value from a single writer to any number of readers.
+// The writer never waits, readers retry if a write happened while they were copying.
+template<typename T> requires std::is_trivially_copyable_v<T>
+class seqlock {
+public:
+    void store(T const &value) {
+        std::array<uint64_t, word_count> words{};
+        std::memcpy(words.data(), &value, sizeof(T));
+
+        const auto sequence = m_sequence.load(std::memory_order_relaxed);
+        m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (auto i = 0u; i < word_count; ++i)
+            m_words[i].store(words[i], std::memory_order_relaxed);
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    T load() const {
+        std::array<uint64_t, word_count> words{};
+        for (;;) {
+            const auto before = m_sequence.load(std::memory_order_acquire);
+            if (before & 1)
+                continue;
+            for (auto i = 0u; i < word_count; ++i)
+                words[i] = m_words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_sequence.load(std::memory_order_relaxed) == before)
+                break;
+        }
+        // T may have default member initialisers, so it is built from the bytes rather than copied over
+        std::array<std::byte, sizeof(T)> bytes;
+        std::memcpy(bytes.data(), words.data(), sizeof(T));
+        return std::bit_cast<T>(bytes);
+    }
+
+    // Number of values stored so far
+    uint64_t version() const {
+        return m_sequence.load(std::memory_order_acquire) / 2;
+    }
+
+private:
+    constexpr static size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint64_t> m_sequence = 0;
+    std::array<std::atomic<uint64_t>, word_count> m_words{};
+};
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "speaker.hpp"
+#include "reports.hpp"
+
+namespace {
+    // Step size multipliers and reconstruction steps, indexed by code
+    constexpr std::array<int32_t, 16> step_scale{230, 230, 230, 230, 307, 409, 512, 614,
+                                                 230, 230, 230, 230, 307, 409, 512, 614};
+    constexpr std::array<int32_t, 16> difference{1, 3, 5, 7, 9, 11, 13, 15,
+                                                 -1, -3, -5, -7, -9, -11, -13, -15};
+}
+
+std::array<uint8_t, 7> speaker_registers(speaker_config const &config) {
+    // The rate is set as a divider of a 6MHz clock for ADPCM, and a 12MHz one for PCM
+    const uint32_t clock = config.format == speaker_format::ADPCM ? 6'000'000 : 12'000'000;
+    const auto divider = uint16_t(clock / std::max<uint16_t>(config.sample_rate, 1));
+    return {0x00, uint8_t(config.format), uint8_t(divider & 0xff), uint8_t(divider >> 8), config.volume, 0x00, 0x00};
+}
+
+uint8_t adpcm_encoder::encode(int16_t sample) {
+    const auto delta = int32_t(sample) - m_predictor;
+    const auto code = uint8_t(std::min(7, std::abs(delta) * 4 / m_step) + (delta < 0) * 8);
+    // Track the decoder, so errors don't accumulate
+    m_predictor = std::clamp(m_predictor + m_step * difference[code] / 8, -32768, 32767);
+    m_step = std::clamp((m_step * step_scale[code]) >> 8, 127, 24576);
+    return code;
+}
+
+void adpcm_encoder::encode(std::span<const int16_t> samples, std::span<uint8_t> out) {
+    for (auto i = 0u; i + 1 < samples.size() && i / 2 < out.size(); i += 2) {
+        const auto high = encode(samples[i]);
+        out[i / 2] = uint8_t(high << 4 | encode(samples[i + 1]));
+    }
+}
+
+void adpcm_encoder::reset() {
+    m_predictor = 0;
+    m_step = 127;
+}
+
+void speaker_engine::start(speaker_config const &config, clock::time_point now) {
+    std::scoped_lock lock(m_mutex);
+    m_config = config;
+    m_playing = true;
+    m_encoder.reset();
+    m_period = std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(double(samples_per_frame()) / std::max<uint16_t>(config.sample_rate, 1)));
+    m_deadline = now;
+    m_last_frame.reset();
+}
+
+void speaker_engine::stop() {
+    std::scoped_lock lock(m_mutex);
+    m_playing = false;
+}
+
+void speaker_engine::clear() {
+    std::scoped_lock lock(m_mutex);
+    m_samples.clear();
+}
+
+bool speaker_engine::playing() const {
+    std::scoped_lock lock(m_mutex);
+    return m_playing;
+}
+
+void speaker_engine::push(std::span<const int16_t> samples) {
+    std::scoped_lock lock(m_mutex);
+    m_samples.insert(m_samples.end(), samples.begin(), samples.end());
+}
+
+size_t speaker_engine::queued() const {
+    std::scoped_lock lock(m_mutex);
+    return m_samples.size();
+}
+
+std::optional<speaker_engine::clock::time_point> speaker_engine::next_deadline() const {
+    std::scoped_lock lock(m_mutex);
+    if (!m_playing)
+        return {};
+    return m_deadline;
+}
+
+std::optional<speaker_engine::report> speaker_engine::pop_frame(clock::time_point now, clock::time_point send_by) {
+    std::scoped_lock lock(m_mutex);
+    if (!m_playing || m_deadline > send_by)
+        return {};
+
+    if (now > m_deadline) {
+        ++m_stats.late;
+        m_stats.max_lateness = std::max(m_stats.max_lateness,
+                                        std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_deadline));
+    }
+
+    std::array<int16_t, frame_bytes * 2> samples{};
+    const auto wanted = samples_per_frame();
+    const auto available = std::min(wanted, m_samples.size());
+    std::copy_n(m_samples.begin(), available, samples.begin());
+    m_samples.erase(m_samples.begin(), m_samples.begin() + ptrdiff_t(available));
+    m_stats.underruns += available < wanted;
+
+    report out{REP_OUT_SPEAKER_DATA, uint8_t(frame_bytes << 3)};
+    const std::span data(out.begin() + 2, frame_bytes);
+    if (m_config.format == speaker_format::ADPCM)
+        m_encoder.encode(samples, data);
+    else
+        std::transform(samples.begin(), samples.begin() + frame_bytes, data.begin(),
+                       [](int16_t sample) { return uint8_t(sample >> 8); });
+
+    ++m_stats.frames;
+    if (m_last_frame) {
+        const auto interval = double(std::chrono::nanoseconds(now - *m_last_frame).count());
+        const auto count = double(m_stats.frames - 1);
+        const auto delta = interval - m_interval_mean;
+        m_interval_mean += delta / count;
+        m_interval_m2 += delta * (interval - m_interval_mean);
+    }
+    m_last_frame = now;
+
+    m_deadline += m_period;
+    // After falling well behind, start the clock again rather than sending a burst
+    if (now - m_deadline > 4 * m_period)
+        m_deadline = now;
+    return out;
+}
+
+speaker_stats speaker_engine::stats() const {
+    std::scoped_lock lock(m_mutex);
+    auto stats = m_stats;
+    if (stats.frames > 2)
+        stats.jitter = std::chrono::nanoseconds(int64_t(std::sqrt(m_interval_m2 / double(stats.frames - 2))));
+    return stats;
+}
+
+size_t speaker_engine::samples_per_frame() const {
+    return m_config.format == speaker_format::ADPCM ? frame_bytes * 2 : frame_bytes;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <span>
+
+enum class speaker_format : uint8_t {
+    // 4 bit Yamaha ADPCM, 40 samples per frame
+    ADPCM = 0x00,
+    // 8 bit signed PCM, 20 samples per frame
+    PCM8 = 0x40,
+};
+
+struct speaker_config {
+    speaker_format format = speaker_format::ADPCM;
+    // Samples per second. At 3000, ADPCM needs a frame every 13.3ms, leaving most output slots to other reports.
+    uint16_t sample_rate = 3000;
+    uint8_t volume = 0x40;
+};
+
+// Contents of the speaker registers from 0xa20001, which set the format, rate and volume
+std::array<uint8_t, 7> speaker_registers(speaker_config const &config);
+
+struct speaker_stats {
+    uint64_t frames = 0;
+    // Frames that were due without a full frame of samples queued, and were padded with silence
+    uint64_t underruns = 0;
+    // Frames sent after they were due
+    uint64_t late = 0;
+    std::chrono::nanoseconds max_lateness{};
+    // Standard deviation of the time between frames
+    std::chrono::nanoseconds jitter{};
+};
+
+// Yamaha ADPCM as the wiimote speaker decodes it
+class adpcm_encoder {
+public:
+    // Returns the 4 bit code for the sample
+    uint8_t encode(int16_t sample);
+
+    // Packs two samples per byte, the first in the high nibble. Takes an even number of samples.
+    void encode(std::span<const int16_t> samples, std::span<uint8_t> out);
+
+    void reset();
+
+private:
+    int32_t m_predictor = 0;
+    int32_t m_step = 127;
+};
+
+// Queues samples and turns them into speaker data reports (0x18), each due at a fixed time so the speaker's buffer
+// is refilled at the rate it plays. Samples can be pushed from any thread.
+class speaker_engine {
+public:
+    using clock = std::chrono::steady_clock;
+    constexpr static size_t frame_bytes = 20;
+    using report = std::array<uint8_t, frame_bytes + 2>;
+
+    // Starts the frame clock, with the first frame due straight away
+    void start(speaker_config const &config, clock::time_point now);
+
+    // Stops the frame clock, keeping queued samples for when it starts again
+    void stop();
+
+    bool playing() const;
+
+    void clear();
+
+    // Queues 16 bit samples at the configured rate
+    void push(std::span<const int16_t> samples);
+
+    size_t queued() const;
+
+    // When the next frame is due, empty while stopped
+    std::optional<clock::time_point> next_deadline() const;
+
+    // The next frame if it is due before send_by, padded with silence if the samples ran out
+    std::optional<report> pop_frame(clock::time_point now, clock::time_point send_by);
+
+    speaker_stats stats() const;
+
+private:
+    size_t samples_per_frame() const;
+
+    mutable std::mutex m_mutex;
+    speaker_config m_config;
+    bool m_playing = false;
+    adpcm_encoder m_encoder;
+    std::deque<int16_t> m_samples;
+    clock::duration m_period{};
+    clock::time_point m_deadline;
+
+    speaker_stats m_stats;
+    std::optional<clock::time_point> m_last_frame;
+    // Running mean and squared deviations of the time between frames, in nanoseconds
+    double m_interval_mean = 0;
+    double m_interval_m2 = 0;
+};
@@ -0,0 +1,98 @@
+#include <array>
+#include <climits>
+#include <cuchar>
+#include <stdexcept>
+#include <fmt/format.h>
+
+#include "transport.hpp"
+
+std::string to_string(std::wstring_view wstr){
+    char mb[MB_LEN_MAX];
+    std::string out;
+    std::mbstate_t state{};
+    for (auto const c : wstr){
+        auto size = std::c16rtomb(mb, c, &state);
+        out.append(mb, size);
+    }
+    return out;
+}
+
+ssize_t hid_transport::read_batch(report_batch &batch, int timeout_ms) {
+    batch.count = 0;
+    auto bytes = read(batch.reports[0], timeout_ms);
+    if (bytes <= 0)
+        return bytes;
+    batch.sizes[0] = bytes;
+    batch.count = 1;
+    while (batch.count < batch.capacity) {
+        // An error here is left for the next call to report
+        bytes = read(batch.reports[batch.count], 0);
+        if (bytes <= 0)
+            break;
+        batch.sizes[batch.count++] = bytes;
+    }
+    return ssize_t(batch.count);
+}
+
+transport_stats hid_transport::stats() const {
+    return {
+        .syscalls = m_syscalls.load(std::memory_order_relaxed),
+        .reports_read = m_reports_read.load(std::memory_order_relaxed),
+        .reports_written = m_reports_written.load(std::memory_order_relaxed),
+        .wakeups = m_wakeups.load(std::memory_order_relaxed),
+        .latency_samples = m_latency_samples.load(std::memory_order_relaxed),
+        .latency_total = std::chrono::nanoseconds(m_latency_total.load(std::memory_order_relaxed)),
+        .latency_max = std::chrono::nanoseconds(m_latency_max.load(std::memory_order_relaxed)),
+    };
+}
+
+void hid_transport::count_latency(std::chrono::nanoseconds latency) {
+    m_latency_samples.fetch_add(1, std::memory_order_relaxed);
+    m_latency_total.fetch_add(latency.count(), std::memory_order_relaxed);
+    auto max = m_latency_max.load(std::memory_order_relaxed);
+    while (latency.count() > max && !m_latency_max.compare_exchange_weak(max, latency.count(), std::memory_order_relaxed));
+}
+
+hidapi_transport::hidapi_transport(std::filesystem::path const &device_path)
+        : m_device(hid_open_path(device_path.string().c_str())), m_fallback_identifier(device_path.string()) {
+    if (!m_device)
+        throw std::runtime_error(to_string(hid_error(nullptr)));
+}
+
+hidapi_transport::hidapi_transport(uint16_t vendor_id, uint16_t product_id, std::wstring_view serial)
+        : m_device(hid_open(vendor_id, product_id, serial.data())),
+          m_fallback_identifier(fmt::format("{:04x}:{:04x}:{}", vendor_id, product_id, to_string(serial))) {
+    if (!m_device)
+        throw std::runtime_error(to_string(hid_error(nullptr)));
+}
+
+hidapi_transport::~hidapi_transport() {
+    hid_close(m_device);
+}
+
+ssize_t hidapi_transport::read(std::span<uint8_t> report, int timeout_ms) {
+    count_syscalls();
+    const auto bytes = hid_read_timeout(m_device, report.data(), report.size(), timeout_ms);
+    if (bytes > 0) {
+        count_read();
+        if (timeout_ms != 0)
+            count_wakeup();
+    }
+    return bytes;
+}
+
+ssize_t hidapi_transport::write(std::span<const uint8_t> report) {
+    count_syscalls();
+    const auto bytes = hid_write(m_device, report.data(), report.size());
+    if (bytes > 0)
+        count_written();
+    return bytes;
+}
+
+std::string hidapi_transport::identifier() const {
+    // The serial number of a wiimote is its bluetooth address
+    std::array<wchar_t, 64> serial{};
+    if (hid_get_serial_number_string(m_device, serial.data(), serial.size()) == 0 && serial[0])
+        return to_string(serial.data());
+    return m_fallback_identifier;
+}
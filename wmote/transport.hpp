@@ -0,0 +1,102 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <hidapi.h>
+
+// Counters kept by every transport, to compare the cost of each backend
+struct transport_stats {
+    uint64_t syscalls = 0;
+    uint64_t reports_read = 0;
+    uint64_t reports_written = 0;
+    // Times a read had to wait, and was woken by a report
+    uint64_t wakeups = 0;
+    // Time from a report becoming available to it being read, only known to transports that see reports arrive
+    uint64_t latency_samples = 0;
+    std::chrono::nanoseconds latency_total{};
+    std::chrono::nanoseconds latency_max{};
+};
+
+// Reports gathered by a single read_batch call
+struct report_batch {
+    constexpr static size_t capacity = 16;
+    constexpr static size_t report_size = 32;
+
+    std::array<std::array<uint8_t, report_size>, capacity> reports;
+    std::array<uint8_t, capacity> sizes;
+    size_t count = 0;
+
+    std::span<const uint8_t> operator[](size_t index) const { return {reports[index].data(), sizes[index]}; }
+};
+
+// Moves raw HID reports, starting with the report id, between a wiimote and its device
+class hid_transport {
+public:
+    virtual ~hid_transport() = default;
+
+    // Reads one report, waiting up to timeout_ms, or indefinitely if negative.
+    // Returns the size of the report, 0 if none arrived in time, or negative once the device is gone.
+    virtual ssize_t read(std::span<uint8_t> report, int timeout_ms) = 0;
+
+    // Waits up to timeout_ms for a report, then takes every report already waiting without waiting again.
+    // Returns the number of reports, 0 if none arrived in time, or negative on error.
+    virtual ssize_t read_batch(report_batch &batch, int timeout_ms);
+
+    // Returns the number of bytes written, or negative on error
+    virtual ssize_t write(std::span<const uint8_t> report) = 0;
+
+    // File descriptor that polls readable when reports are waiting, or -1 if the transport can't be polled
+    virtual int native_handle() const { return -1; }
+
+    // Identifies the device across sessions, preferably by serial number
+    virtual std::string identifier() const = 0;
+
+    transport_stats stats() const;
+
+protected:
+    void count_syscalls(uint64_t count = 1) { m_syscalls.fetch_add(count, std::memory_order_relaxed); }
+    void count_read() { m_reports_read.fetch_add(1, std::memory_order_relaxed); }
+    void count_written() { m_reports_written.fetch_add(1, std::memory_order_relaxed); }
+    void count_wakeup() { m_wakeups.fetch_add(1, std::memory_order_relaxed); }
+    void count_latency(std::chrono::nanoseconds latency);
+
+private:
+    std::atomic<uint64_t> m_syscalls = 0;
+    std::atomic<uint64_t> m_reports_read = 0;
+    std::atomic<uint64_t> m_reports_written = 0;
+    std::atomic<uint64_t> m_wakeups = 0;
+    std::atomic<uint64_t> m_latency_samples = 0;
+    std::atomic<int64_t> m_latency_total = 0;
+    std::atomic<int64_t> m_latency_max = 0;
+};
+
+// Transport through hidapi, on any platform it supports.
+// hidapi hides its syscalls, so each call into it is counted as one.
+class hidapi_transport : public hid_transport {
+public:
+    explicit hidapi_transport(std::filesystem::path const &device_path);
+
+    hidapi_transport(uint16_t vendor_id, uint16_t product_id, std::wstring_view serial);
+
+    hidapi_transport(hidapi_transport const &) = delete;
+
+    ~hidapi_transport() override;
+
+    ssize_t read(std::span<uint8_t> report, int timeout_ms) override;
+
+    ssize_t write(std::span<const uint8_t> report) override;
+
+    std::string identifier() const override;
+
+private:
+    hid_device *m_device;
+    std::string m_fallback_identifier;
+};
+
+std::string to_string(std::wstring_view wstr);
@@ -0,0 +1,635 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+#include <numeric>
+#include <stdexcept>
+#include <tuple>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "virtual_wiimote_transport.hpp"
+#include "reports.hpp"
+#include "enums.hpp"
+
+namespace {
+    using namespace std::chrono;
+
+    constexpr uint16_t button_a = 0x0800;
+    constexpr uint16_t button_b = 0x0400;
+
+    constexpr uint8_t error_disconnected = 7;
+    constexpr uint8_t error_nonexistent = 8;
+
+    // A real wiimote's accelerometer reads around 0x200 at rest, 0x9a << 2 at 1g
+    constexpr uint16_t acc_zero = 0x200;
+    constexpr uint16_t acc_one_g = 0x268;
+    // 14 bit gyro reading at rest
+    constexpr uint16_t gyro_zero = 0x1f7f;
+
+    struct ir_point {
+        uint16_t x = 0x3ff;
+        uint16_t y = 0x3ff;
+        uint8_t size = 0xf;
+
+        bool visible() const { return x != 0x3ff || y != 0x3ff; }
+    };
+
+    // Everything a wiimote senses at one point in time
+    struct motion {
+        std::array<uint16_t, 3> acc;
+        std::array<ir_point, 4> dots;
+        std::array<uint16_t, 3> gyro;
+        std::array<uint8_t, 2> stick;
+        std::array<uint16_t, 3> extension_acc;
+        bool c;
+        bool z;
+    };
+
+    double wave(double seconds, double hz, double phase = 0) {
+        return std::sin(2 * std::numbers::pi * (hz * seconds + phase));
+    }
+
+    uint16_t clamp10(double value) {
+        return uint16_t(std::clamp(value, 0.0, 1023.0));
+    }
+
+    // The wiimote swings and tilts slowly, while pointing around a sensor bar
+    motion simulate(double t, uint32_t seed) {
+        const auto phase = (seed % 97) / 97.0;
+        const auto tilt = 0.6 * wave(t, 0.5, phase);
+        motion m{};
+        m.acc = {clamp10(acc_zero + (acc_one_g - acc_zero) * std::sin(tilt)),
+                 clamp10(acc_zero + 10 * wave(t, 1.3, phase)),
+                 clamp10(acc_zero + (acc_one_g - acc_zero) * std::cos(tilt))};
+
+        const auto cx = 512 + 200 * wave(t, 0.25, phase + 0.25);
+        const auto cy = 384 + 150 * wave(t, 0.25, phase);
+        const auto dx = 90 * std::cos(tilt), dy = 90 * std::sin(tilt);
+        m.dots[0] = {uint16_t(std::clamp(cx - dx, 0.0, 1022.0)), uint16_t(std::clamp(cy - dy, 0.0, 767.0)), 3};
+        m.dots[1] = {uint16_t(std::clamp(cx + dx, 0.0, 1022.0)), uint16_t(std::clamp(cy + dy, 0.0, 767.0)), 3};
+
+        m.gyro = {uint16_t(gyro_zero + 500 * wave(t, 0.7, phase)),
+                  uint16_t(gyro_zero + 300 * wave(t, 0.5, phase + 0.25)),
+                  uint16_t(gyro_zero + 200 * wave(t, 0.3, phase))};
+
+        m.stick = {uint8_t(128 + 90 * wave(t, 0.4, phase + 0.25)), uint8_t(128 + 90 * wave(t, 0.4, phase))};
+        m.extension_acc = {clamp10(acc_zero + 60 * wave(t, 0.9, phase)), acc_zero, acc_one_g};
+        m.c = wave(t, 0.5, phase) > 0.8;
+        m.z = wave(t, 0.5, phase) < -0.8;
+        return m;
+    }
+
+    void put_buttons(uint8_t *out, uint16_t buttons) {
+        out[1] = buttons & 0xff;
+        out[2] = buttons >> 8;
+    }
+
+    // Low bits of x and y go into the unused bits of the button bytes
+    void put_acc(uint8_t *out, std::array<uint16_t, 3> const &acc) {
+        out[1] |= (acc[0] & 1) << 5 | ((acc[0] >> 1) & 1) << 6;
+        out[2] |= ((acc[1] >> 1) & 1) << 5 | ((acc[2] >> 1) & 1) << 6;
+        out[3] = acc[0] >> 2;
+        out[4] = acc[1] >> 2;
+        out[5] = acc[2] >> 2;
+    }
+
+    void put_ir_basic(uint8_t *out, std::array<ir_point, 4> const &dots) {
+        for (auto pair = 0; pair < 2; ++pair) {
+            auto const &a = dots[pair * 2];
+            auto const &b = dots[pair * 2 + 1];
+            auto *p = out + pair * 5;
+            p[0] = a.x & 0xff;
+            p[1] = a.y & 0xff;
+            p[2] = (a.y >> 8) << 6 | (a.x >> 8) << 4 | (b.y >> 8) << 2 | (b.x >> 8);
+            p[3] = b.x & 0xff;
+            p[4] = b.y & 0xff;
+        }
+    }
+
+    void put_ir_extended(uint8_t *out, ir_point const &dot) {
+        out[0] = dot.x & 0xff;
+        out[1] = dot.y & 0xff;
+        out[2] = (dot.y >> 8) << 6 | (dot.x >> 8) << 4 | (dot.size & 0xf);
+    }
+
+    void put_ir_full(uint8_t *out, ir_point const &dot) {
+        if (!dot.visible()) {
+            std::fill_n(out, 9, 0xff);
+            return;
+        }
+        put_ir_extended(out, dot);
+        out[3] = (dot.x - dot.size) / 8;
+        out[4] = (dot.y - dot.size) / 8;
+        out[5] = (dot.x + dot.size) / 8;
+        out[6] = (dot.y + dot.size) / 8;
+        out[7] = 0;
+        out[8] = 0x40;
+    }
+
+    void put_nunchuk(uint8_t *out, motion const &m) {
+        auto const &acc = m.extension_acc;
+        out[0] = m.stick[0];
+        out[1] = m.stick[1];
+        out[2] = acc[0] >> 2;
+        out[3] = acc[1] >> 2;
+        out[4] = acc[2] >> 2;
+        // Buttons are active low
+        out[5] = (!m.z) | (!m.c) << 1 | (acc[0] & 3) << 2 | (acc[1] & 3) << 4 | (acc[2] & 3) << 6;
+    }
+
+    // Interleaved with motionplus data, the nunchuk loses a bit of precision
+    void put_nunchuk_passthrough(uint8_t *out, motion const &m) {
+        auto const &acc = m.extension_acc;
+        out[0] = m.stick[0];
+        out[1] = m.stick[1];
+        out[2] = acc[0] >> 2;
+        out[3] = acc[1] >> 2;
+        out[4] = (acc[2] >> 3) << 1 | 1;
+        out[5] = (!m.z) << 2 | (!m.c) << 3 | ((acc[0] >> 1) & 1) << 4 | ((acc[1] >> 1) & 1) << 5 | ((acc[2] >> 1) & 3) << 6;
+    }
+
+    void put_classic(uint8_t *out, motion const &m) {
+        const uint8_t lx = m.stick[0] >> 2, ly = m.stick[1] >> 2, rx = 16, ry = 16, lt = 0, rt = 0;
+        out[0] = ((rx >> 3) & 3) << 6 | (lx & 0x3f);
+        out[1] = ((rx >> 1) & 3) << 6 | (ly & 0x3f);
+        out[2] = (rx & 1) << 7 | ((lt >> 3) & 3) << 5 | (ry & 0x1f);
+        out[3] = (lt & 7) << 5 | (rt & 0x1f);
+        out[4] = 0xff;
+        out[5] = 0xff;
+    }
+
+    void put_motionplus(uint8_t *out, motion const &m, bool extension_connected) {
+        const auto [yaw, roll, pitch] = m.gyro;
+        out[0] = yaw & 0xff;
+        out[1] = roll & 0xff;
+        out[2] = pitch & 0xff;
+        // Always in slow mode
+        out[3] = (yaw >> 8) << 2 | 1 << 1 | 1;
+        out[4] = (roll >> 8) << 2 | 1 << 1 | extension_connected;
+        out[5] = (pitch >> 8) << 2 | 1 << 1;
+    }
+
+    void put_be16(uint8_t *out, uint16_t value) {
+        out[0] = value >> 8;
+        out[1] = value & 0xff;
+    }
+
+    void put_motionplus_calibration(uint8_t *block) {
+        // Fast mode at 0x20, slow mode at 0x30, as 16 bit big endian yaw, roll and pitch zeroes then scales
+        for (auto [offset, scale, degrees]: {std::tuple{0x20, 0x2000, 0x5a}, std::tuple{0x30, 0x3c00, 0x2d}}) {
+            auto *p = block + offset;
+            for (auto axis = 0; axis < 3; ++axis) {
+                put_be16(p + axis * 2, gyro_zero << 2);
+                put_be16(p + 6 + axis * 2, scale);
+            }
+            p[12] = degrees;
+            p[13] = 0;
+        }
+    }
+
+    void put_extension_id(uint8_t *block, std::array<uint8_t, 6> id) {
+        std::copy(id.begin(), id.end(), block + 0xfa);
+    }
+}
+
+virtual_wiimote_transport::virtual_wiimote_transport(virtual_wiimote_config config)
+        : m_config(std::move(config)), m_timer(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+          m_extension(m_config.extension) {
+    if (m_timer < 0)
+        throw std::runtime_error(std::strerror(errno));
+    if (m_config.report_interval <= decltype(m_config.report_interval)::zero())
+        throw std::invalid_argument("Report interval must be positive");
+
+    // Accelerometer calibration, and its mirror
+    std::array<uint8_t, 10> calibration{acc_zero >> 2, acc_zero >> 2, acc_zero >> 2, 0,
+                                        acc_one_g >> 2, acc_one_g >> 2, acc_one_g >> 2, 0, 0x40, 0};
+    calibration[9] = std::accumulate(calibration.begin(), calibration.end() - 1, 0x55);
+    std::copy(calibration.begin(), calibration.end(), m_eeprom.begin() + 0x16);
+    std::copy(calibration.begin(), calibration.end(), m_eeprom.begin() + 0x20);
+
+    if (m_config.motionplus) {
+        put_extension_id(m_motionplus_registers.data(), {0x00, 0x00, 0xA6, 0x20, 0x00, 0x05});
+        put_motionplus_calibration(m_motionplus_registers.data());
+    }
+    reset_extension_registers();
+}
+
+virtual_wiimote_transport::~virtual_wiimote_transport() {
+    ::close(m_timer);
+}
+
+void virtual_wiimote_transport::plug(virtual_extension extension) {
+    std::scoped_lock lock(m_mutex);
+    if (extension == m_extension)
+        return;
+    m_extension = extension;
+    if (!m_motionplus_mode)
+        reset_extension_registers();
+    queue_status();
+    m_suspended = true;
+    arm_timer(clock::now());
+    m_replied.notify_all();
+}
+
+ssize_t virtual_wiimote_transport::read(std::span<uint8_t> out, int timeout_ms) {
+    std::unique_lock lock(m_mutex);
+    auto now = clock::now();
+    const auto give_up = now + milliseconds(timeout_ms);
+    bool waited = false;
+    for (;;) {
+        if (!m_replies.empty()) {
+            const auto reply = m_replies.front();
+            m_replies.pop_front();
+            arm_timer(now);
+            count_read();
+            if (waited)
+                count_wakeup();
+            const auto size = std::min<size_t>(reply.size, out.size());
+            std::copy_n(reply.data.begin(), size, out.begin());
+            return ssize_t(size);
+        }
+
+        const auto due = next_event();
+        if (due && *due <= now) {
+            report data{};
+            const auto size = std::min<size_t>(generate(data, *due), out.size());
+            count_latency(now - *due);
+            count_read();
+            if (waited)
+                count_wakeup();
+            if (m_continuous) {
+                // Like hidraw, keep a limited backlog when nobody reads
+                m_next_report = std::max(*due + m_config.report_interval, now - 64 * m_config.report_interval);
+            }
+            arm_timer(now);
+            std::copy_n(data.begin(), size, out.begin());
+            return ssize_t(size);
+        }
+
+        if (timeout_ms == 0 || (timeout_ms > 0 && now >= give_up))
+            return 0;
+        const auto wake = timeout_ms < 0 ? due : std::optional(due ? std::min(*due, give_up) : give_up);
+        // Writes wake us too, as setting the reporting mode can make a report due without queueing a reply
+        if (wake)
+            m_replied.wait_until(lock, *wake);
+        else
+            m_replied.wait(lock);
+        waited = true;
+        now = clock::now();
+    }
+}
+
+ssize_t virtual_wiimote_transport::write(std::span<const uint8_t> request) {
+    if (request.size() < 2)
+        return -1;
+    std::scoped_lock lock(m_mutex);
+    const auto id = request[0];
+    const auto flags = request[1];
+    const bool wants_ack = flags & 0x02;
+    const bool enable = flags & 0x04;
+    m_rumble = flags & 0x01;
+
+    switch (id) {
+        case REP_OUT_PLAYER_LED:
+            m_leds = flags >> 4;
+            break;
+        case REP_OUT_DATA_REPORT_MODE:
+            if (request.size() < 3)
+                return -1;
+            m_continuous = enable;
+            m_mode = request[2];
+            m_suspended = false;
+            m_second_half = false;
+            m_next_report = clock::now();
+            m_last_buttons = buttons_at(m_next_report);
+            break;
+        case REP_OUT_IR_PIXEL_CLOCK_ENABLE:
+            m_ir_clock = enable;
+            break;
+        case REP_OUT_IR_LOGIC_ENABLE:
+            m_ir_logic = enable;
+            break;
+        case REP_OUT_SPEAKER_ENABLE:
+            m_speaker = enable;
+            break;
+        case REP_OUT_STATUS_INFORMATION_REQUEST:
+            queue_status();
+            break;
+        case REP_OUT_WRITE_TO_MEMORY:
+            handle_write(request);
+            break;
+        case REP_OUT_READ_FROM_MEMORY:
+            handle_read(request);
+            break;
+        default:
+            break;
+    }
+    if (wants_ack && id != REP_OUT_WRITE_TO_MEMORY && id != REP_OUT_READ_FROM_MEMORY)
+        queue_ack(id, 0);
+
+    count_written();
+    arm_timer(clock::now());
+    m_replied.notify_all();
+    return ssize_t(request.size());
+}
+
+int virtual_wiimote_transport::native_handle() const {
+    return m_timer;
+}
+
+std::string virtual_wiimote_transport::identifier() const {
+    return m_config.identifier;
+}
+
+uint8_t virtual_wiimote_transport::reporting_mode() const {
+    std::scoped_lock lock(m_mutex);
+    return m_mode;
+}
+
+std::optional<virtual_wiimote_transport::clock::time_point>
+virtual_wiimote_transport::next_event() const {
+    if (m_suspended)
+        return std::nullopt;
+    if (m_continuous)
+        return m_next_report;
+
+    // Otherwise only when the buttons change, which happens on 100ms boundaries
+    const auto elapsed = duration_cast<milliseconds>(m_next_report - m_start).count();
+    const auto first = elapsed + (100 - (elapsed + m_config.seed * 137) % 100) % 100;
+    for (auto t = first; t < first + 1000; t += 100) {
+        const auto time = m_start + milliseconds(t);
+        if (buttons_at(time) != m_last_buttons)
+            return time;
+    }
+    return std::nullopt;
+}
+
+void virtual_wiimote_transport::arm_timer(clock::time_point now) {
+    std::optional<clock::time_point> wake;
+    if (!m_replies.empty())
+        wake = now;
+    else
+        wake = next_event();
+
+    itimerspec spec{};
+    if (wake) {
+        // A zero value would disarm the timer
+        const auto ns = std::max<int64_t>(1, duration_cast<nanoseconds>(wake->time_since_epoch()).count());
+        spec.it_value.tv_sec = ns / 1'000'000'000;
+        spec.it_value.tv_nsec = ns % 1'000'000'000;
+    }
+    count_syscalls();
+    ::timerfd_settime(m_timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+uint16_t virtual_wiimote_transport::buttons_at(clock::time_point time) const {
+    const auto ms = (duration_cast<milliseconds>(time - m_start).count() + m_config.seed * 137) % 1000;
+    uint16_t buttons = 0;
+    if (ms < 100)
+        buttons |= button_a;
+    if (ms >= 500 && ms < 600)
+        buttons |= button_b;
+    return buttons;
+}
+
+bool virtual_wiimote_transport::extension_connected() const {
+    return m_motionplus_mode || m_extension != virtual_extension::NONE;
+}
+
+uint8_t virtual_wiimote_transport::generate(report &out, clock::time_point time) {
+    const auto m = simulate(duration<double>(time - m_start).count(), m_config.seed);
+    const auto buttons = buttons_at(time);
+    m_last_buttons = buttons;
+    if (!m_continuous)
+        m_next_report = time + 1ms;
+
+    const bool camera = m_ir_clock && m_ir_logic;
+    std::array<ir_point, 4> dots{};
+    if (camera)
+        dots = m.dots;
+
+    const auto put_extension = [&](uint8_t *p, size_t size) {
+        std::fill_n(p, size, 0);
+        if (m_motionplus_mode) {
+            // In passthrough modes, motionplus and extension data take turns
+            const bool passthrough = m_motionplus_mode != 0x04 && m_extension == virtual_extension::NUNCHUK;
+            if (passthrough && m_second_half)
+                put_nunchuk_passthrough(p, m);
+            else
+                put_motionplus(p, m, m_extension != virtual_extension::NONE);
+            m_second_half = passthrough && !m_second_half;
+        }
+        else if (m_extension == virtual_extension::NUNCHUK)
+            put_nunchuk(p, m);
+        else if (m_extension == virtual_extension::CLASSIC)
+            put_classic(p, m);
+    };
+
+    out[0] = m_mode;
+    put_buttons(out.data(), buttons);
+    switch (m_mode) {
+        case REP_IN_BUTTONS:
+            return 3;
+        case REP_IN_BUTTONS_ACC:
+            put_acc(out.data(), m.acc);
+            return 6;
+        case REP_IN_BUTTONS_EXT_8B:
+            put_extension(&out[3], 8);
+            return 11;
+        case REP_IN_BUTTONS_ACC_IR_12B:
+            put_acc(out.data(), m.acc);
+            for (auto i = 0; i < 4; ++i) {
+                if (dots[i].visible())
+                    put_ir_extended(&out[6 + i * 3], dots[i]);
+                else
+                    std::fill_n(&out[6 + i * 3], 3, 0xff);
+            }
+            return 18;
+        case REP_IN_BUTTONS_EXT_19B:
+            put_extension(&out[3], 19);
+            return 22;
+        case REP_IN_BUTTONS_ACC_EXT_16B:
+            put_acc(out.data(), m.acc);
+            put_extension(&out[6], 16);
+            return 22;
+        case REP_IN_BUTTONS_IR_10B_EXTENSION_9B:
+            put_ir_basic(&out[3], dots);
+            put_extension(&out[13], 9);
+            return 22;
+        case REP_IN_BUTTONS_ACC_IR_10B_EXTENSION_6B:
+            put_acc(out.data(), m.acc);
+            put_ir_basic(&out[6], dots);
+            put_extension(&out[16], 6);
+            return 22;
+        case 0x3d:
+            put_extension(&out[1], 21);
+            return 22;
+        case REP_IN_BUTTONS_ACC_IR_36B:
+        case REP_IN_BUTTONS_ACC_IR_36B_ALT: {
+            // Each half carries one axis, half of the z axis in the button bytes, and two of the dots
+            const bool second = m_second_half;
+            out[0] = second ? REP_IN_BUTTONS_ACC_IR_36B_ALT : REP_IN_BUTTONS_ACC_IR_36B;
+            const auto z = m.acc[2] >> 2;
+            const auto z_bits = second ? z & 0xf : z >> 4;
+            out[1] |= (z_bits & 3) << 5;
+            out[2] |= ((z_bits >> 2) & 3) << 5;
+            out[3] = m.acc[second ? 1 : 0] >> 2;
+            put_ir_full(&out[4], dots[second ? 2 : 0]);
+            put_ir_full(&out[13], dots[second ? 3 : 1]);
+            m_second_half = !second;
+            return 22;
+        }
+        default:
+            return 3;
+    }
+}
+
+void virtual_wiimote_transport::queue_status() {
+    queued_report status{{REP_IN_STATUS_INFORMATION}, 7};
+    put_buttons(status.data.data(), buttons_at(clock::now()));
+    status.data[3] = extension_connected() << 1 | m_speaker << 2 | (m_ir_clock && m_ir_logic) << 3 | m_leds << 4;
+    // Battery about three quarters full
+    status.data[6] = 0x9c;
+    m_replies.push_back(status);
+}
+
+void virtual_wiimote_transport::queue_ack(uint8_t output_report, uint8_t error) {
+    queued_report ack{{REP_IN_ACK_OUTPUT_REPORT}, 5};
+    put_buttons(ack.data.data(), buttons_at(clock::now()));
+    ack.data[3] = output_report;
+    ack.data[4] = error;
+    m_replies.push_back(ack);
+}
+
+uint8_t *virtual_wiimote_transport::register_block(uint8_t block) {
+    switch (block) {
+        case 0xA2:
+            return m_speaker_registers.data();
+        case 0xA4:
+            return extension_connected() ? m_extension_registers.data() : nullptr;
+        case 0xA6:
+            // Once activated, the motionplus answers at 0xA4 instead
+            return m_config.motionplus && !m_motionplus_mode ? m_motionplus_registers.data() : nullptr;
+        case 0xB0:
+            return m_ir_registers.data();
+        default:
+            return nullptr;
+    }
+}
+
+void virtual_wiimote_transport::reset_extension_registers() {
+    auto *block = m_extension_registers.data();
+    m_extension_registers.fill(0);
+    if (m_motionplus_mode) {
+        put_extension_id(block, {0x00, 0x00, 0xA4, 0x20, m_motionplus_mode, 0x05});
+        put_motionplus_calibration(block);
+        return;
+    }
+    switch (m_extension) {
+        case virtual_extension::NUNCHUK: {
+            put_extension_id(block, {0x00, 0x00, 0xA4, 0x20, 0x00, 0x00});
+            constexpr std::array<uint8_t, 14> calibration{0x80, 0x80, 0x80, 0x00, 0xB3, 0xB3, 0xB3, 0x00,
+                                                          0xE0, 0x20, 0x80, 0xE0, 0x20, 0x80};
+            std::copy(calibration.begin(), calibration.end(), block + 0x20);
+            break;
+        }
+        case virtual_extension::CLASSIC: {
+            put_extension_id(block, {0x00, 0x00, 0xA4, 0x20, 0x01, 0x01});
+            constexpr std::array<uint8_t, 12> calibration{0xFC, 0x04, 0x80, 0xFC, 0x04, 0x80,
+                                                          0xFC, 0x04, 0x80, 0xFC, 0x04, 0x80};
+            std::copy(calibration.begin(), calibration.end(), block + 0x20);
+            break;
+        }
+        case virtual_extension::NONE:
+            break;
+    }
+}
+
+void virtual_wiimote_transport::handle_read(std::span<const uint8_t> request) {
+    if (request.size() < 7)
+        return;
+    const bool is_register = request[1] & MEM_REGISTER;
+    const uint16_t offset = request[3] << 8 | request[4];
+    const uint16_t size = request[5] << 8 | request[6];
+    const auto buttons = buttons_at(clock::now());
+
+    const auto reply = [&](uint16_t address, uint8_t error, std::span<const uint8_t> data) {
+        queued_report rep{{REP_IN_MEMORY_READ}, 22};
+        put_buttons(rep.data.data(), buttons);
+        rep.data[3] = (data.empty() ? 0 : data.size() - 1) << 4 | error;
+        put_be16(&rep.data[4], address);
+        std::copy(data.begin(), data.end(), rep.data.begin() + 6);
+        m_replies.push_back(rep);
+    };
+
+    uint8_t const *memory = nullptr;
+    size_t memory_size = 0;
+    if (is_register) {
+        memory = register_block(request[2]);
+        memory_size = 0x100;
+        if (!memory)
+            return reply(offset, error_disconnected, {});
+    }
+    else {
+        if (request[2] != 0 || offset + size > m_eeprom.size())
+            return reply(offset, error_nonexistent, {});
+        memory = m_eeprom.data();
+        memory_size = m_eeprom.size();
+    }
+
+    for (uint32_t done = 0; done < size; done += 16) {
+        std::array<uint8_t, 16> chunk{};
+        const auto chunk_size = std::min<uint32_t>(16, size - done);
+        for (auto i = 0u; i < chunk_size; ++i) {
+            const auto address = offset + done + i;
+            chunk[i] = address < memory_size ? memory[address] : 0;
+        }
+        reply(offset + done, 0, {chunk.data(), chunk_size});
+    }
+}
+
+void virtual_wiimote_transport::handle_write(std::span<const uint8_t> request) {
+    if (request.size() < 6)
+        return;
+    const bool is_register = request[1] & MEM_REGISTER;
+    const uint16_t offset = request[3] << 8 | request[4];
+    const auto size = std::min<size_t>({request[5], 16, request.size() - 6});
+    const auto data = request.subspan(6, size);
+
+    if (!is_register) {
+        if (request[2] != 0 || offset + size > m_eeprom.size())
+            return queue_ack(REP_OUT_WRITE_TO_MEMORY, error_nonexistent);
+        std::copy(data.begin(), data.end(), m_eeprom.begin() + offset);
+        return queue_ack(REP_OUT_WRITE_TO_MEMORY, 0);
+    }
+
+    const auto block_id = request[2];
+    auto *block = register_block(block_id);
+    if (!block)
+        return queue_ack(REP_OUT_WRITE_TO_MEMORY, error_disconnected);
+    if (offset + size > 0x100)
+        return queue_ack(REP_OUT_WRITE_TO_MEMORY, error_nonexistent);
+    std::copy(data.begin(), data.end(), block + offset);
+    queue_ack(REP_OUT_WRITE_TO_MEMORY, 0);
+
+    const auto wrote = [&](uint8_t reg) { return offset <= reg && reg < offset + size; };
+    if (block_id == 0xA6 && wrote(0xFE)) {
+        // Activates the motionplus, which then takes the place of the extension
+        const auto mode = block[0xFE];
+        if (mode == 0x04 || mode == 0x05 || mode == 0x07) {
+            m_motionplus_mode = mode;
+            reset_extension_registers();
+            queue_status();
+            m_suspended = true;
+        }
+    }
+    else if (block_id == 0xA4 && wrote(0xF0) && block[0xF0] == 0x55 && m_motionplus_mode) {
+        // Deactivates the motionplus, bringing back the extension behind it
+        m_motionplus_mode = 0;
+        reset_extension_registers();
+        queue_status();
+        m_suspended = true;
+    }
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "transport.hpp"
+
+enum class virtual_extension : uint8_t {
+    NONE,
+    NUNCHUK,
+    CLASSIC
+};
+
+struct virtual_wiimote_config {
+    // Interval between reports in continuous reporting mode, real wiimotes manage about 100 per second
+    std::chrono::microseconds report_interval{10'000};
+    virtual_extension extension = virtual_extension::NONE;
+    bool motionplus = false;
+    // Offsets the simulated motion, so that devices don't move in lockstep
+    uint32_t seed = 0;
+    std::string identifier = "virtual";
+};
+
+// Software wiimote, for running many devices without hardware.
+// Generates input reports in every reporting mode from simulated motion, and answers output reports the way a
+// wiimote does, with plausible calibration data and extension ids in its memory.
+// Its handle is a timerfd that polls readable whenever a report is due.
+class virtual_wiimote_transport : public hid_transport {
+public:
+    explicit virtual_wiimote_transport(virtual_wiimote_config config = {});
+
+    virtual_wiimote_transport(virtual_wiimote_transport const &) = delete;
+
+    ~virtual_wiimote_transport() override;
+
+    // Connects an extension, or disconnects it with NONE. Like a real wiimote, this sends a status report and stops
+    // reporting until a reporting mode is set again.
+    void plug(virtual_extension extension);
+
+    ssize_t read(std::span<uint8_t> report, int timeout_ms) override;
+
+    ssize_t write(std::span<const uint8_t> report) override;
+
+    int native_handle() const override;
+
+    std::string identifier() const override;
+
+    uint8_t reporting_mode() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+    using report = std::array<uint8_t, 22>;
+
+    struct queued_report {
+        report data;
+        uint8_t size;
+    };
+
+    // Expects m_mutex to be held by all of these
+    std::optional<clock::time_point> next_event() const;
+    void arm_timer(clock::time_point now);
+    uint16_t buttons_at(clock::time_point time) const;
+    uint8_t generate(report &out, clock::time_point time);
+    void queue_status();
+    void queue_ack(uint8_t output_report, uint8_t error);
+    void handle_read(std::span<const uint8_t> request);
+    void handle_write(std::span<const uint8_t> request);
+    // Returns the 256 bytes of a register block, or null if nothing answers at this address
+    uint8_t *register_block(uint8_t block);
+    bool extension_connected() const;
+    void reset_extension_registers();
+
+    virtual_wiimote_config m_config;
+    clock::time_point m_start = clock::now();
+    int m_timer;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_replied;
+    std::deque<queued_report> m_replies;
+
+    uint8_t m_mode = 0x30;
+    bool m_continuous = false;
+    // Set after a status report nobody asked for, until the reporting mode is set again
+    bool m_suspended = false;
+    clock::time_point m_next_report = m_start;
+    uint16_t m_last_buttons = 0;
+    // Alternates between 0x3e and 0x3f, and between motionplus and extension data in passthrough modes
+    bool m_second_half = false;
+
+    uint8_t m_leds = 0;
+    bool m_rumble = false;
+    bool m_speaker = false;
+    bool m_ir_clock = false;
+    bool m_ir_logic = false;
+
+    virtual_extension m_extension;
+    // Byte 4 of the motionplus id while it is active, 0 while it is not
+    uint8_t m_motionplus_mode = 0;
+
+    std::array<uint8_t, 0x1700> m_eeprom{};
+    std::array<uint8_t, 0x100> m_extension_registers{};
+    std::array<uint8_t, 0x100> m_motionplus_registers{};
+    std::array<uint8_t, 0x100> m_ir_registers{};
+    std::array<uint8_t, 0x100> m_speaker_registers{};
+};
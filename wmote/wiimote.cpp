@@ -3,18 +3,9 @@
 #include "internal_logging.hpp"
 #include "writes.hpp"
 #include "byteswap.hpp"
-#include <cuchar>
 #include <future>
-std::string to_string(std::wstring_view wstr){
-    char mb[MB_LEN_MAX];
-    std::string out;
-    std::mbstate_t state{};
-    for (auto const c : wstr){
-        auto size = std::c16rtomb(mb, c, &state);
-        out.append(mb, size);
-    }
-    return out;
-}
+#include <cmath>
+#include <numbers>
 
 #if defined(WIIMOTELIBPP_DEBUG)
 #define assert(x, msg) if (!(x)) { throw std::runtime_error(msg); };
@@ -25,112 +16,226 @@ std::string to_string(std::wstring_view wstr){
 constexpr static unsigned int MAX_MESSAGE_LENGTH = 22;
 
 wiimote::wiimote(const std::filesystem::path &device_path)
-        : m_device(hid_open_path(device_path.string().c_str())), m_extension(std::monostate{}) {
-    if (!m_device)
-        throw std::runtime_error(to_string(hid_error(nullptr)));
-
-    init();
-
+        : wiimote(std::make_unique<hidapi_transport>(device_path), nullptr, profile_cache::shared()) {
 }
 
 wiimote::wiimote(uint16_t vendor_id, uint16_t product_id, std::wstring_view serial)
-: m_device(hid_open(vendor_id, product_id, serial.data())), m_extension(std::monostate{}) {
-    if (!m_device)
-        throw std::runtime_error(to_string(hid_error(nullptr)));
+        : wiimote(std::make_unique<hidapi_transport>(vendor_id, product_id, serial), nullptr, profile_cache::shared()) {
+}
 
-    init();
+wiimote::wiimote(std::unique_ptr<hid_transport> transport, reactor *event_loop, profile_cache *cache)
+        : m_cache(cache), m_extension(std::monostate{}), m_transport(std::move(transport)), m_reactor(event_loop) {
+    if (!m_transport)
+        throw std::invalid_argument("transport");
+    m_device_key = profile_cache::device_key(m_transport->identifier());
 
+    init();
 }
 
 wiimote::wiimote(wiimote && other) noexcept {
     // Close other thread
-    other.m_running = false;
-    other.m_read_thread.join();
-    other.m_write_thread.join();
-    other.mem_req_queue.thread.join();
+    other.stop();
+    other.m_memory.cancel_all();
 
     // Copy state and device
     m_state = other.m_state;
-    m_device = other.m_device;
+    m_cache = other.m_cache;
+    m_device_key = other.m_device_key;
+    m_recorder.store(other.m_recorder.exchange(nullptr));
 
-    m_write_queue = std::move(other.m_write_queue);
+    m_output.swap(other.m_output);
+    // Subscriptions follow the device, and the old instance gets demand of its own to detach from
+    m_demand = std::exchange(other.m_demand, std::make_shared<sensor_demand>());
 
     // Prevent old instance from closing the device that this instance is now using
-    other.m_device = nullptr;
+    m_transport = std::move(other.m_transport);
+    m_reactor = std::exchange(other.m_reactor, nullptr);
     init();
 }
 
 wiimote::~wiimote() {
-    m_write_thread.join();
-    m_read_thread.join();
-    log_info("Read thread joined");
-    hid_close(m_device);
+    m_demand->set_listener({});
+    stop();
+    m_memory.cancel_all();
+}
+
+void wiimote::stop() {
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+    if (m_reactor)
+        m_reactor->detach(*this);
+    // Both threads are asked first, so that they wind down side by side
+    m_write_thread.request_stop();
+    m_read_thread.request_stop();
+    if (m_write_thread.joinable())
+        m_write_thread.join();
+    if (m_read_thread.joinable()){
+        m_read_thread.join();
+        log_info("Threads stopped after {}us", duration_cast<microseconds>(steady_clock::now() - start).count());
+    }
+}
+
+void wiimote::lost_connection() {
+    if (m_connected.exchange(false))
+        log_error("Lost connection to the wiimote");
+}
+
+void wiimote::reconnect(std::unique_ptr<hid_transport> transport) {
+    if (!transport)
+        throw std::invalid_argument("transport");
+    if (connected())
+        throw std::runtime_error("Wiimote is still connected");
+    stop();
+
+    // Replies to anything asked of the old connection won't come, and must not be taken for replies on the new one.
+    // The extension is identified again, as it may have changed while the device was away.
+    {
+        std::scoped_lock ext_lock(m_extension_mutex);
+        m_swap = {.generation = m_swap.generation + 1};
+        m_extension = {};
+        m_motionplus = {};
+        m_extension_reportable = false;
+        m_extension_buttons = extension_button_flags::NONE;
+    }
+    m_memory.cancel_all();
+    m_memory.shadow().clear();
+    output_queue stale;
+    m_output.swap(stale);
+    m_speaker.stop();
+    m_speaker.clear();
+
+    // The device starts over, with no reporting mode, camera or LEDs
+    {
+        std::scoped_lock lock(m_reporting_mode_mutex);
+        m_reporting_mode.reset();
+        m_ir_camera = ir_format::NONE;
+    }
+    led_flags leds;
+    {
+        std::scoped_lock status_lock(m_status_mutex);
+        m_status_received = false;
+        leds = m_state.leds;
+    }
+
+    m_transport = std::move(transport);
+    init();
+    // Rumble goes out with every report, starting with this one
+    set_leds(leds);
 }
 
 void wiimote::init() {
-    m_running = true;
-    m_write_thread = std::thread(&wiimote::write_loop, this);
-    m_read_thread = std::thread(&wiimote::read_loop, this);
-    mem_req_queue.thread = std::thread(&wiimote::mem_req_loop, this);
+    m_opened_at = std::chrono::steady_clock::now();
+    m_connected = true;
+    load_cached_calibration();
+
+    m_demand->set_listener([this](sensor_flags sensors) {
+        m_subscribed = sensors;
+        update_reporting_mode();
+    });
+    {
+        std::scoped_lock ext_lock(m_extension_mutex);
+        bind_extension_decoder();
+    }
+
+    if (m_reactor){
+        m_reactor->attach(*this);
+    }
+    else {
+        m_write_thread = std::jthread([this](std::stop_token stop) { write_loop(stop); });
+        m_read_thread = std::jthread([this](std::stop_token stop) { read_loop(stop); });
+    }
 
     request_status();
-    request_extension();
-    detect_motionplus();
+    {
+        std::scoped_lock ext_lock(m_extension_mutex);
+        start_extension_swap();
+    }
 
-    set_reporting_mode(true, REP_IN_BUTTONS_ACC_IR_12B);
     request_wiimote_calibration(true);
 }
 
-void wiimote::write(std::vector<uint8_t>&& data) {
-    data[1] |= get_rumble();
-    std::scoped_lock lock(m_writer_mutex);
-    m_write_queue.push(std::move(data));
-}
-
-void wiimote::write(std::span<uint8_t> data) {
-    data[1] |= get_rumble();
-    std::scoped_lock writer_lock(m_writer_mutex);
-    m_write_queue.emplace(data.begin(), data.end());
+void wiimote::write(std::span<const uint8_t> data, output_priority priority) {
+    // The rumble bit is applied when the report is sent
+    m_output.push(data, priority);
+    wake_output();
 }
 
-ssize_t wiimote::read(std::span<uint8_t> data) {
-    return hid_read(m_device, data.data(), data.size());
+ssize_t wiimote::read(report_batch &batch) {
+    // Bounded, so that a stop request is seen while the device has nothing to say, e.g. reporting only on change
+    constexpr int read_timeout_ms = 20;
+    return m_transport->read_batch(batch, read_timeout_ms);
 }
 
 void wiimote::request_status(){
     RequestStatusReport rep{};
-    auto rep_span = span_of(rep);
-    write(rep_span);
+    write(span_of(rep), output_priority::STATUS);
 }
 
 void wiimote::mem_request_write(std::array<uint8_t, 4> address, std::vector<uint8_t>&& data) {
-    MemWriteReport report;
-    report.address = address;
-    report.size = data.size();
-
-    std::move(data.begin(), data.end(), report.data.begin());
-    write_mem_write_report(report);
+    m_memory.write(address, data);
 }
 
 void wiimote::mem_request_read(std::array<uint8_t, 4> address, size_t size) {
     assert(size < std::numeric_limits<uint16_t>::max(), "Read too large");
 
-    MemReadReport report;
-    report.address = address;
-    report.size_big_endian = bswap_on_le<std::uint16_t>(size);
-    {
-        std::scoped_lock lock(m_mem_read_update_mutex);
-        m_state.read_requests.emplace(m_state.read_req_counter, report.address, size);
-        log_info("Pushed request: (ID: {}, Address: {:x}, Size: {})", m_state.read_req_counter++, bswap_on_le(*(uint32_t*)&address), size);
-    }
-    write_mem_read_report(report);
+    m_memory.read(address, size, [this](mem_result const &res) { on_mem_read(res); });
+    log_info("Pushed request: (Address: {:x}, Size: {})", bswap_on_le(*(uint32_t*)&address), size);
+}
+
+std::future<mem_result> wiimote::read_memory(address_t address, uint16_t size, mem_policy policy) {
+    return m_memory.read(address, size, {}, policy);
+}
+
+std::future<mem_result> wiimote::read_memory(address_t address, std::span<uint8_t> buffer, mem_policy policy) {
+    return m_memory.read(address, buffer, {}, policy);
+}
+
+std::future<mem_result> wiimote::write_memory(address_t address, std::span<const uint8_t> data, mem_policy policy) {
+    return m_memory.write(address, data, {}, policy);
+}
+
+void wiimote::record_reports(std::shared_ptr<report_recorder> recorder) {
+    m_recorder.store(std::move(recorder), std::memory_order_release);
+}
+
+void wiimote::enable_speaker(speaker_config config) {
+    m_speaker.stop();
+    write(std::array<uint8_t, 2>{REP_OUT_SPEAKER_ENABLE, 0x04}, output_priority::CONTROL);
+    write(std::array<uint8_t, 2>{REP_OUT_SPEAKER_MUTE, 0x04}, output_priority::CONTROL);
+    mem_request_write({MEM_REGISTER, 0xA2, 0x00, 0x09}, {0x01});
+    mem_request_write({MEM_REGISTER, 0xA2, 0x00, 0x01}, {0x08});
+    const auto registers = speaker_registers(config);
+    mem_request_write({MEM_REGISTER, 0xA2, 0x00, 0x01}, {registers.begin(), registers.end()});
+    const std::array<uint8_t, 1> play{0x01};
+    m_memory.write({{MEM_REGISTER, 0xA2, 0x00, 0x08}}, play, [this, config](mem_result const &res) {
+        if (!res) {
+            if (res.error != mem_error::CANCELLED)
+                log_error("Failed to set up the speaker");
+            return;
+        }
+        write(std::array<uint8_t, 2>{REP_OUT_SPEAKER_MUTE, 0x00}, output_priority::CONTROL);
+        // The first frame waits a couple of slots, so the unmute goes out ahead of it
+        m_speaker.start(config, std::chrono::steady_clock::now() + std::chrono::milliseconds(10));
+        wake_output();
+        log_info("Speaker playing at {}Hz", config.sample_rate);
+    });
+}
+
+void wiimote::disable_speaker() {
+    m_speaker.stop();
+    m_speaker.clear();
+    write(std::array<uint8_t, 2>{REP_OUT_SPEAKER_MUTE, 0x04}, output_priority::CONTROL);
+    write(std::array<uint8_t, 2>{REP_OUT_SPEAKER_ENABLE, 0x00}, output_priority::CONTROL);
+}
+
+void wiimote::play_samples(std::span<const int16_t> samples) {
+    m_speaker.push(samples);
 }
 
-void wiimote::request_extension() {
-    mem_request_write({MEM_REGISTER, 0xA4, 0x00, 0xf0}, {0x55});
-    mem_request_write({MEM_REGISTER, 0xA4, 0x00, 0xfb}, {0x00});
-    mem_request_read(addresses::extension_identifier, 6);
+speaker_stats wiimote::speaker_statistics() const {
+    return m_speaker.stats();
 }
+
 void wiimote::request_wiimote_calibration(bool allow_second_attempt) {
     if (allow_second_attempt)
         mem_request_read(addresses::wiimote_calibration, 10);
@@ -138,189 +243,373 @@ void wiimote::request_wiimote_calibration(bool allow_second_attempt) {
         mem_request_read(addresses::wiimote_calibration_mirror, 10);
 }
 
-void wiimote::detect_motionplus() {
-    mem_request_read(addresses::motionplus_identifier, 6);
+void wiimote::load_cached_calibration() {
+    if (!m_cache)
+        return;
+    auto block = m_cache->load(m_device_key, 0, addresses::wiimote_calibration);
+    if (block && handle_wiimote_calibration_data(*block)){
+        using namespace std::chrono;
+        const auto elapsed = duration_cast<microseconds>(steady_clock::now() - m_opened_at);
+        {
+            std::scoped_lock acc_lock(m_acc_mutex);
+            m_state.startup.cached_calibration = elapsed;
+        }
+        log_info("Applied cached calibration after {}us", elapsed.count());
+    }
 }
 
-void wiimote::activate_motionplus(MotionPlusMode mode) {
-    switch (mode) {
-        case MotionPlusMode::MOTIONPLUS_ONLY:
-            mem_request_write({MemType::MEM_REGISTER, 0xA6, 0x00, 0xFE}, {0x04});
-            break;
-        case MotionPlusMode::EXTENSION_ONLY:
-            mem_request_write({MemType::MEM_REGISTER, 0xA4, 0x00, 0xF0}, {0x55});
-            break;
-        case MotionPlusMode::NUNCHUK_PASSTHROUGH:
-            mem_request_write({MemType::MEM_REGISTER, 0xA6, 0x00, 0xFE}, {0x05});
-            break;
-        case MotionPlusMode::CLASSIC_PASSTHROUGH:
-            mem_request_write({MemType::MEM_REGISTER, 0xA6, 0x00, 0xFE}, {0x07});
-            break;
-        default:
-            return;
-    }
+void wiimote::store_cached_calibration(uint64_t extension, address_t address, std::span<const uint8_t> data) {
+    if (m_cache && m_cache->store(m_device_key, extension, address, data))
+        log_info("Updated cached calibration for {:#x}", bswap_on_le(address.as_uint32()));
 }
 
-void wiimote::init_motionplus() {
-    mem_request_write({MemType::MEM_REGISTER, 0xA6, 0x00, 0xf0}, {0x55});
+void wiimote::set_reporting_mode(bool continuous, input_reports report) {
+    const std::array<uint8_t, 3> data{REP_OUT_DATA_REPORT_MODE, uint8_t(0x04 * continuous), report};
+    write(data, output_priority::CONTROL);
 }
 
-void wiimote::update_motionplus() {
-    if (m_motionplus){
+void wiimote::update_reporting_mode(bool force) {
+    // Chosen under the lock, so that concurrent updates can't send an older choice last
+    std::scoped_lock lock(m_reporting_mode_mutex);
+    const auto sensors = m_subscribed.load();
+    const bool acc = !!(sensors & sensor_flags::ACCELEROMETER);
+    const bool ir = !!(sensors & sensor_flags::IR);
+    const bool extension = !!(sensors & sensor_flags::EXTENSION) && m_extension_reportable;
+    const std::pair mode{acc || ir || extension, input_reports(smallest_report_with(acc, ir, extension))};
+    if (!force && m_reporting_mode == mode)
         return;
+    if (m_reporting_mode != mode)
+        log_info("Reporting {:#x}{}", uint8_t(mode.second), mode.first ? " continuously" : " on change");
+    m_reporting_mode = mode;
+    set_reporting_mode(mode.first, mode.second);
+
+    const auto camera = ir ? layout_of(mode.second).ir : ir_format::NONE;
+    if (camera != m_ir_camera)
+        update_ir_camera(camera);
+}
+
+void wiimote::update_ir_camera(ir_format format) {
+    if (format == ir_format::NONE) {
+        write(std::array<uint8_t, 2>{REP_OUT_IR_PIXEL_CLOCK_ENABLE, 0x00}, output_priority::CONTROL);
+        write(std::array<uint8_t, 2>{REP_OUT_IR_LOGIC_ENABLE, 0x00}, output_priority::CONTROL);
+    }
+    else if (m_ir_camera == ir_format::NONE) {
+        // Every write is queued at once, so the memory engine keeps as many in flight as it allows
+        write(std::array<uint8_t, 2>{REP_OUT_IR_PIXEL_CLOCK_ENABLE, 0x04}, output_priority::CONTROL);
+        write(std::array<uint8_t, 2>{REP_OUT_IR_LOGIC_ENABLE, 0x04}, output_priority::CONTROL);
+        auto writes = ir_camera_writes(m_ir_sensitivity, format);
+        const auto started = std::chrono::steady_clock::now();
+        for (auto i = 0u; i < writes.size(); ++i) {
+            mem_callback done;
+            if (i + 1 == writes.size())
+                done = [started](mem_result const &res) {
+                    using namespace std::chrono;
+                    if (res)
+                        log_info("IR camera up after {}us",
+                                 duration_cast<microseconds>(steady_clock::now() - started).count());
+                    else if (res.error != mem_error::CANCELLED)
+                        log_error("Failed to set up the IR camera");
+                };
+            m_memory.write(writes[i].address, writes[i].data, std::move(done));
+        }
+    }
+    else {
+        const std::array<uint8_t, 1> mode{ir_camera_mode(format)};
+        m_memory.write(addresses::ir_mode, mode);
     }
-    request_motion_plus_calibration();
-    m_motionplus = MotionPlusRaw{};
+    m_ir_camera = format;
 }
 
-void wiimote::request_motion_plus_calibration() {
-    mem_request_read(addresses::motionplus_calibration_fast, 16);
-    mem_request_read(addresses::motionplus_calibration_slow, 16);
+void wiimote::set_ir_sensitivity(ir_sensitivity level) {
+    std::scoped_lock lock(m_reporting_mode_mutex);
+    m_ir_sensitivity = level;
+    if (m_ir_camera == ir_format::NONE)
+        return;
+    const auto blocks = sensitivity_blocks(level);
+    m_memory.write(addresses::ir_sensitivity_1, blocks.first);
+    m_memory.write(addresses::ir_sensitivity_2, blocks.second);
 }
 
+sensor_subscription wiimote::subscribe(sensor_flags sensors) {
+    return {m_demand, sensors};
+}
 
-void wiimote::set_reporting_mode(bool continuous, input_reports report) {
-    write({REP_OUT_DATA_REPORT_MODE, uint8_t(0x04 * continuous), report});
+void sensor_demand::add(sensor_flags sensors) {
+    std::scoped_lock lock(m_mutex);
+    const auto before = active_locked();
+    for (auto i = 0u; i < m_counts.size(); ++i)
+        m_counts[i] += !!(sensors & sensor_flags(1 << i));
+    if (m_listener && active_locked() != before)
+        m_listener(active_locked());
 }
 
-void wiimote::read_loop() {
-    std::array<uint8_t, MAX_MESSAGE_LENGTH> buffer{0};
-    while (m_running.load(std::memory_order_relaxed)) {
-        const auto bytes = read(buffer);
-        if (bytes == 0)
-            continue;
-        else if (bytes < 0) {
-            log_error("Failed");
+void sensor_demand::remove(sensor_flags sensors) {
+    std::scoped_lock lock(m_mutex);
+    const auto before = active_locked();
+    for (auto i = 0u; i < m_counts.size(); ++i)
+        m_counts[i] -= !!(sensors & sensor_flags(1 << i));
+    if (m_listener && active_locked() != before)
+        m_listener(active_locked());
+}
+
+sensor_flags sensor_demand::active() const {
+    std::scoped_lock lock(m_mutex);
+    return active_locked();
+}
+
+sensor_flags sensor_demand::active_locked() const {
+    auto sensors = sensor_flags::NONE;
+    for (auto i = 0u; i < m_counts.size(); ++i)
+        if (m_counts[i])
+            sensors |= sensor_flags(1 << i);
+    return sensors;
+}
+
+void sensor_demand::set_listener(std::function<void(sensor_flags)> listener) {
+    std::scoped_lock lock(m_mutex);
+    m_listener = std::move(listener);
+    if (m_listener)
+        m_listener(active_locked());
+}
+
+sensor_subscription::sensor_subscription(std::shared_ptr<sensor_demand> demand, sensor_flags sensors)
+        : m_demand(std::move(demand)), m_sensors(sensors) {
+    if (!m_demand)
+        throw std::invalid_argument("demand");
+    m_demand->add(m_sensors);
+}
+
+sensor_subscription::sensor_subscription(sensor_subscription &&other) noexcept
+        : m_demand(std::move(other.m_demand)), m_sensors(std::exchange(other.m_sensors, sensor_flags::NONE)) {
+}
+
+sensor_subscription &sensor_subscription::operator=(sensor_subscription &&other) noexcept {
+    if (this != &other) {
+        reset();
+        m_demand = std::move(other.m_demand);
+        m_sensors = std::exchange(other.m_sensors, sensor_flags::NONE);
+    }
+    return *this;
+}
+
+sensor_subscription::~sensor_subscription() {
+    reset();
+}
+
+void sensor_subscription::reset() {
+    if (m_demand)
+        m_demand->remove(m_sensors);
+    m_demand.reset();
+    m_sensors = sensor_flags::NONE;
+}
+
+void wiimote::read_loop(std::stop_token const &stop) {
+    report_batch batch;
+    while (!stop.stop_requested()) {
+        const auto count = read(batch);
+        if (count == 0)
             continue;
+        else if (count < 0) {
+            // Retrying would only spin, the device is back once it is reconnected
+            lost_connection();
+            return;
         }
-        const auto id = input_reports(buffer[0]);
-        auto data = buffer.data();
-        auto offset = 1;
-
-        switch (id) {
-            case REP_IN_STATUS_INFORMATION:
-            {
-                assert(bytes == 7, "Expected 7 bytes");
-                offset += handle_buttons_only(data + offset);
-                offset += handle_status(data + offset);
-                break;
+        const auto received = std::chrono::steady_clock::now();
+        for (auto i = 0u; i < batch.count; ++i)
+            process_report(batch[i], received);
+    }
+}
+
+void wiimote::process_report(std::span<const uint8_t> report, std::chrono::steady_clock::time_point received) {
+    // A recorder that failed to write is dropped, unless another has been set meanwhile
+    if (auto recorder = m_recorder.load(std::memory_order_acquire); recorder && !recorder->append(received, report))
+        m_recorder.compare_exchange_strong(recorder, nullptr);
+
+    // Reports shorter than expected are zero filled, rather than read past
+    std::array<uint8_t, MAX_MESSAGE_LENGTH> buffer{0};
+    const auto bytes = std::min<size_t>(report.size(), buffer.size());
+    std::copy_n(report.begin(), bytes, buffer.begin());
+    const auto id = input_reports(buffer[0]);
+    auto data = buffer.data();
+    auto offset = 1;
+
+    switch (id) {
+        case REP_IN_STATUS_INFORMATION:
+        {
+            assert(bytes == 7, "Expected 7 bytes");
+            offset += handle_buttons_only(data + offset);
+            offset += handle_status(data + offset);
+            break;
+        }
+        case REP_IN_MEMORY_READ:
+            offset += handle_buttons_only(data + offset);
+            offset += handle_mem_read(data + offset);
+            break;
+        case REP_IN_ACK_OUTPUT_REPORT:
+            offset += handle_buttons_only(data + offset);
+            offset += handle_acknowledgement(data + offset);
+            break;
+        default:
+            if (id >= first_data_report && id < first_data_report + data_report_count) {
+                assert(bytes == layout_of(id).size, "Unexpected data report size");
+                handle_data_report(data);
             }
-            case REP_IN_MEMORY_READ:
-                offset += handle_buttons_only(data + offset);
-                offset += handle_mem_read(data + offset);
-                break;
-            case REP_IN_ACK_OUTPUT_REPORT:
-                offset += handle_buttons_only(data + offset);
-                offset += handle_acknowledgement(data + offset);
-                break;
-            case REP_IN_BUTTONS:
-            assert(bytes == 3, "Expected 3 bytes.");
-                offset += handle_buttons_only(data + offset);
-                break;
-            case REP_IN_BUTTONS_ACC:
-            assert(bytes == 6, "Expected 6 bytes");
-                offset += handle_buttons_acc(data + offset);
-                break;
-            case REP_IN_BUTTONS_EXT_8B:
-            assert(bytes == 11, "Expected 11 bytes");
-                offset += handle_buttons_only(data + offset);
-                offset += handle_extension_data({buffer.begin() + offset, 8});
-                break;
-            case REP_IN_BUTTONS_ACC_IR_12B:
-            assert(bytes == 18, "Expected 18 bytes");
-                offset += handle_buttons_acc(data + offset);
-                offset += handle_ir_data_extended(data + offset);
-                break;
-            case REP_IN_BUTTONS_EXT_19B:
-            assert(bytes == 22, "Expected 22 bytes");
-                offset += handle_buttons_only(data + offset);
-                offset += handle_extension_data({buffer.begin() + offset, 19});
-                break;
-            case REP_IN_BUTTONS_ACC_EXT_16B:
-            assert(bytes == 22, "Expected 22 bytes");
-                offset += handle_buttons_acc(data + offset);
-                offset += handle_extension_data({buffer.begin() + offset, 16});
-                break;
-            case REP_IN_BUTTONS_IR_10B_EXTENSION_9B:
-            assert(bytes == 22, "Expected 22 bytes")
-                offset += handle_buttons_only(data + offset);
-                offset += handle_ir_data_extended(data + offset);
-                offset += handle_extension_data({buffer.begin() + offset, 9});
-                break;
-            case REP_IN_BUTTONS_ACC_IR_10B_EXTENSION_6B:
-            assert(bytes == 22, "Expected 22 bytes")
-
-                offset += handle_buttons_acc(data + offset);
-                offset += handle_ir_data_basic(data + offset);
-                offset += handle_extension_data({buffer.begin() + offset, 6});
-                break;
-            case REP_IN_BUTTONS_ACC_IR_36B:
-            assert(bytes == 18, "Expected 18 bytes")
-                offset += handle_interleaved_a(data + offset);
-                break;
-            case REP_IN_BUTTONS_ACC_IR_36B_ALT:
-            assert(bytes == 18, "Expected 18 bytes")
-                offset += handle_interleaved_b(data + offset);
-                break;
-            default:
+            else
                 log_error("Received unhandled report {:#x}", uint8_t(id));
-                break;
-        }
+            break;
     }
+    m_latency.decoded.record(std::chrono::steady_clock::now() - received);
+
+    const bool publish = m_acc_updated || m_gyro_updated || m_extension_updated || m_ir_updated;
+    if (m_acc_updated || m_gyro_updated || m_extension_updated)
+        update_history(received);
+    if (std::exchange(m_gyro_updated, false))
+        update_orientation(received);
+    if (std::exchange(m_ir_updated, false))
+        update_pointer(received);
+    if (publish)
+        m_latency.published.record(std::chrono::steady_clock::now() - received);
 }
 
-void wiimote::write_loop(){
-    using namespace std::chrono;
-    using namespace std::chrono_literals;
-    auto last_time = high_resolution_clock::now();
-    while (m_running.load(std::memory_order_relaxed)){
-        m_writer_mutex.lock();
-        if (!m_write_queue.empty()){
-            std::vector<uint8_t> res = std::move(m_write_queue.front());
-            m_write_queue.pop();
-            hid_write(m_device, res.data(), res.size());
-        }
-        m_writer_mutex.unlock();
+void wiimote::decode(std::span<const uint8_t> report) {
+    process_report(report, std::chrono::steady_clock::now());
+}
 
-        while ((high_resolution_clock::now() - last_time) < 5ms){
-            std::this_thread::yield();
+void wiimote::update_history(std::chrono::steady_clock::time_point timestamp) {
+    // Only this thread writes the accelerometer state, so it can be read without its lock. The extension is also
+    // changed by memory completions on the writing thread, or the reactor's. Calibration is left to readers.
+    raw_motion_sample sample{.timestamp = timestamp, .acc = m_state.acc};
+    sample.flags |= std::exchange(m_acc_updated, false) ? SAMPLE_ACC : 0;
+
+    std::shared_lock ext_lock(m_extension_mutex);
+    if (m_motionplus) {
+        sample.gyro = m_motionplus->gyro_raw;
+        sample.flags |= m_gyro_updated ? SAMPLE_GYRO : 0;
+        sample.flags |= m_motionplus->is_slow_mode.x ? SAMPLE_SLOW_YAW : 0;
+        sample.flags |= m_motionplus->is_slow_mode.y ? SAMPLE_SLOW_PITCH : 0;
+        sample.flags |= m_motionplus->is_slow_mode.z ? SAMPLE_SLOW_ROLL : 0;
+    }
+    if (auto nunchuk = std::get_if<NunchukRaw>(&m_extension)) {
+        sample.extension_acc = nunchuk->acc_raw;
+        sample.extension_stick = nunchuk->stick_raw;
+        sample.flags |= std::exchange(m_extension_updated, false) ? SAMPLE_EXTENSION : 0;
+        sample.flags |= nunchuk->button_c ? SAMPLE_BUTTON_C : 0;
+        sample.flags |= nunchuk->button_z ? SAMPLE_BUTTON_Z : 0;
+    }
+    ext_lock.unlock();
+    m_extension_updated = false;
+    m_history.push(sample);
+}
+
+void wiimote::update_pointer(std::chrono::steady_clock::time_point timestamp) {
+    std::array<vec2<float>, 4> dots;
+    size_t count = 0;
+    {
+        std::shared_lock ir_lock(m_ir_mutex);
+        for (auto const &dot: m_state.ir_dots) {
+            if (!dot.disabled)
+                dots[count++] = dot.position;
         }
-        last_time = high_resolution_clock::now();
     }
+
+    float roll;
+    {
+        std::shared_lock acc_lock(m_acc_mutex);
+        auto const &calib = m_state.acc_calib;
+        const auto x = float(m_state.acc.x - calib.zero.x) / float(calib.gravity.x - calib.zero.x);
+        const auto z = float(m_state.acc.z - calib.zero.z) / float(calib.gravity.z - calib.zero.z);
+        // Rolling right tips the top of the wiimote, which the accelerometer feels as up, towards -x
+        roll = std::atan2(-x, z);
+    }
+
+    m_pointer_state.store(m_pointer.update({dots.data(), count}, roll, timestamp));
 }
 
+void wiimote::update_orientation(std::chrono::steady_clock::time_point timestamp) {
+    using namespace std::chrono;
+    const auto rate = motionplus();
+    if (!rate)
+        return;
+
+    vec3<float> acc;
+    {
+        std::shared_lock acc_lock(m_acc_mutex);
+        auto const &calib = m_state.acc_calib;
+        acc.x = float(m_state.acc.x - calib.zero.x) / float(calib.gravity.x - calib.zero.x);
+        acc.y = float(m_state.acc.y - calib.zero.y) / float(calib.gravity.y - calib.zero.y);
+        acc.z = float(m_state.acc.z - calib.zero.z) / float(calib.gravity.z - calib.zero.z);
+    }
+    // motionplus() gives yaw, pitch and roll in degrees, which turn around the z, x and y axes
+    constexpr auto radians = std::numbers::pi_v<float> / 180;
+    const vec3<float> gyro{rate->y * radians, rate->z * radians, rate->x * radians};
+
+    // Samples further apart than this are treated as a gap, rather than integrated across
+    constexpr auto max_step = 50ms;
+    auto dt = duration<float>(10ms).count();
+    if (m_last_sample && timestamp - *m_last_sample < max_step)
+        dt = duration<float>(timestamp - *m_last_sample).count();
+    m_last_sample = timestamp;
+
+    m_fusion.update(gyro, acc, dt);
+    m_motion.store({m_fusion.orientation(), m_fusion.gravity(), acc, gyro, timestamp, m_motion.version() + 1});
+}
 
-void wiimote::write_mem_read_report(MemReadReport report){
-    std::scoped_lock ul(mem_req_queue.element_mutex);
-    mem_req_queue.queue.emplace(report);
+void wiimote::write_loop(std::stop_token const &stop){
+    using namespace std::chrono;
+    while (!stop.stop_requested() && m_connected.load(std::memory_order_relaxed)){
+        const auto next = service_output(steady_clock::now());
+        // Sleeps until the next slot, or while idle until output is queued, and returns early on a stop request
+        std::unique_lock lock(m_write_mutex);
+        if (next == steady_clock::time_point::max())
+            m_write_wake.wait(lock, stop, [this] { return !m_output_idle.load(); });
+        else
+            m_write_wake.wait_until(lock, stop, next, [] { return false; });
+    }
 }
 
-void wiimote::write_mem_write_report(MemWriteReport report){
-    std::scoped_lock ul(mem_req_queue.element_mutex);
-    mem_req_queue.queue.emplace(report);
+void wiimote::wake_output() {
+    if (!m_output_idle.exchange(false))
+        return;
+    if (m_reactor) {
+        m_reactor->wake(*this);
+        return;
+    }
+    // Taken so that the notification can't fall between the write thread checking for output and going to sleep
+    { std::scoped_lock lock(m_write_mutex); }
+    m_write_wake.notify_one();
 }
 
-void wiimote::mem_req_loop(){
-    auto& queue = mem_req_queue.queue;
-    while (m_running.load(std::memory_order_relaxed)){
-        std::unique_lock ul(mem_req_queue.control_mutex);
-        mem_req_queue.control_cv.wait(ul, [m = &mem_req_queue] {return (!m->wait_for_read) && (!m->wait_for_write); });
-        if (!queue.empty()){
-            std::unique_lock em(mem_req_queue.element_mutex);
-            auto& res = queue.front();
-            if (auto* p = std::get_if<MemWriteReport>(&res)){
-                write(span_of(*p));
-                mem_req_queue.wait_for_write = true;
-            }
-            else {
-                write(span_of(std::get<MemReadReport>(res)));
-                mem_req_queue.wait_for_read = true;
-            }
-            queue.pop();
-            mem_req_queue.element_cv.notify_one();
-            // To be unlocked in read thread by acknowledge (0x22) or read report (0x21)
-            ul.release();
-        }
+std::chrono::steady_clock::time_point wiimote::service_output(std::chrono::steady_clock::time_point now) {
+    using namespace std::chrono_literals;
+    // The wiimote drops reports sent too close together
+    constexpr auto output_interval = 5ms;
 
+    // Held back for the next connection, rather than timing out against a device that's gone
+    if (!m_connected.load(std::memory_order_relaxed)) {
+        m_output_idle = true;
+        return std::chrono::steady_clock::time_point::max();
     }
-}
\ No newline at end of file
+    m_memory.poll(now);
+    if (now < m_next_write)
+        return m_next_write;
+
+    // Marked idle before looking, so that output queued in the meantime still wakes the device
+    m_output_idle = true;
+    if (m_output.empty() && !m_speaker.playing() && m_memory.pending() == 0)
+        return std::chrono::steady_clock::time_point::max();
+    m_output_idle = false;
+
+    // A speaker frame takes the slot whenever waiting for the next one could make it late, allowing for the next slot
+    // being serviced a little after it opens
+    constexpr auto slot_slack = 1ms;
+    if (auto frame = m_speaker.pop_frame(now, now + output_interval + slot_slack)) {
+        (*frame)[1] |= uint8_t(get_rumble());
+        m_transport->write(*frame);
+    }
+    else if (auto res = m_output.pop(get_rumble())){
+        m_transport->write(*res);
+    }
+    m_next_write = now + output_interval;
+    return m_next_write;
+}
+
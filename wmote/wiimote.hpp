@@ -1,13 +1,15 @@
 #pragma once
 #include <condition_variable>
+#include <functional>
+#include <memory>
 #include <queue>
+#include <stop_token>
 #include <thread>
 #include <shared_mutex>
 #include <mutex>
 #include <span>
 #include <variant>
 #include <filesystem>
-#include <hidapi.h>
 #include <optional>
 #include <fmt/format.h>
 #include <fmt/ranges.h>
@@ -16,6 +18,20 @@
 #include "extensions.hpp"
 #include "enums.hpp"
 #include "writes.hpp"
+#include "output_queue.hpp"
+#include "memory_engine.hpp"
+#include "profile_cache.hpp"
+#include "transport.hpp"
+#include "reactor.hpp"
+#include "recording.hpp"
+#include "fusion.hpp"
+#include "seqlock.hpp"
+#include "ir_pointer.hpp"
+#include "report_layout.hpp"
+#include "sample_history.hpp"
+#include "latency_histogram.hpp"
+#include "speaker.hpp"
+#include "ir_camera.hpp"
 
 #define WIIMOTELIBPP_DEFINE_ENUM_FLAG_OPERATORS(T) \
     constexpr inline T operator~ (T a) { return static_cast<T>( ~static_cast<std::underlying_type<T>::type>(a) ); } \
@@ -46,6 +62,16 @@ enum class button_flags : uint16_t {
 
 WIIMOTELIBPP_DEFINE_ENUM_FLAG_OPERATORS(button_flags)
 
+// Buttons of the extension, for those that have buttons decoded
+enum class extension_button_flags : uint8_t {
+    NONE = 0x00,
+    // Nunchuk
+    C = 0x01,
+    Z = 0x02
+};
+
+WIIMOTELIBPP_DEFINE_ENUM_FLAG_OPERATORS(extension_button_flags)
+
 enum class led_flags : uint8_t {
     // This bit enables rumble
     _DO_NOT_SET = 0x01,
@@ -58,15 +84,53 @@ enum class led_flags : uint8_t {
 
 WIIMOTELIBPP_DEFINE_ENUM_FLAG_OPERATORS(led_flags)
 
-template <typename T> requires std::is_standard_layout_v<T>
-static std::span<uint8_t> span_of(T& value){
-    return {reinterpret_cast<uint8_t*>(&value), sizeof(T)};
-}
+// Data that can be reported alongside the buttons
+enum class sensor_flags : uint8_t {
+    NONE = 0x00,
+    ACCELEROMETER = 0x01,
+    IR = 0x02,
+    // Extension data, which carries motionplus as well
+    EXTENSION = 0x04,
+};
+
+WIIMOTELIBPP_DEFINE_ENUM_FLAG_OPERATORS(sensor_flags)
+
+// Counts the subscribers to each sensor. Shared by a wiimote and its subscriptions, so either can go first.
+class sensor_demand {
+public:
+    void add(sensor_flags sensors);
+    void remove(sensor_flags sensors);
+    // Sensors with at least one subscriber
+    sensor_flags active() const;
+    // Called with the active sensors whenever they change, and once straight away. Runs under the lock, so it
+    // must not add or remove subscriptions.
+    void set_listener(std::function<void(sensor_flags)> listener);
+
+private:
+    sensor_flags active_locked() const;
+
+    mutable std::mutex m_mutex;
+    std::array<uint32_t, 3> m_counts{};
+    std::function<void(sensor_flags)> m_listener;
+};
+
+// Keeps its sensors reported until it is reset or destroyed
+class sensor_subscription {
+public:
+    sensor_subscription() = default;
+    sensor_subscription(std::shared_ptr<sensor_demand> demand, sensor_flags sensors);
+    sensor_subscription(sensor_subscription &&other) noexcept;
+    sensor_subscription &operator=(sensor_subscription &&other) noexcept;
+    ~sensor_subscription();
+
+    sensor_flags sensors() const { return m_sensors; }
 
-template <typename T> requires std::is_standard_layout_v<T>
-static std::span<const uint8_t> span_of(T const& value){
-    return {reinterpret_cast<uint8_t const*>(&value), sizeof(T)};
-}
+    void reset();
+
+private:
+    std::shared_ptr<sensor_demand> m_demand;
+    sensor_flags m_sensors = sensor_flags::NONE;
+};
 
 struct ir_dot {
     vec2<uint16_t> position;
@@ -87,24 +151,73 @@ struct wiimote_status {
     led_flags leds;
 };
 
-class wiimote {
-    struct MemReadRequest {
-        size_t id;
-        address_t address{{0}};
-        size_t expected_size;
-        std::vector<uint8_t> data;
+struct wiimote_startup_times {
+    // Time from opening the device until calibration was applied from the profile cache
+    std::optional<std::chrono::microseconds> cached_calibration;
+    // Time from opening the device until calibration was read from the device
+    std::optional<std::chrono::microseconds> device_calibration;
+};
 
-    };
+// Orientation estimated from a motionplus sample, and the sample it was estimated from
+struct motion_snapshot {
+    quaternion orientation;
+    // Unit vector pointing down
+    vec3<float> gravity;
+    // Acceleration in g, and angular rate in radians per second
+    vec3<float> acc;
+    vec3<float> gyro;
+    // When the sample was read
+    std::chrono::steady_clock::time_point timestamp;
+    uint64_t samples = 0;
+};
+
+// Time from an input report being read to each stage of handling it being done
+struct pipeline_latency {
+    // Its fields decoded into the state, for every report
+    latency_histogram decoded;
+    // The history, orientation and pointer derived from it published, for reports carrying motion or IR data
+    latency_histogram published;
+};
+
+// Where an extension swap has got to. A swap starts when an extension is plugged in or out, including into the
+// motionplus passthrough port, and ends once extension data is reported in the new configuration.
+enum class extension_stage : uint8_t {
+    // Nothing detected yet
+    IDLE,
+    // Extension initialised, its id and the motionplus id being read
+    IDENTIFYING,
+    // Motionplus switched on in the mode the extension behind it needs, waiting for it to answer
+    ACTIVATING,
+    // Waiting for the motionplus calibration, which was read along with the ids
+    CALIBRATING,
+    // The report mode matches what is plugged in
+    REPORTING
+};
+
+// Time taken by each stage of an extension swap, counted from the swap starting
+struct extension_swap_latency {
+    latency_histogram identified;
+    // Only for swaps that activated a motionplus
+    latency_histogram activated;
+    latency_histogram calibrated;
+    // Report mode switched
+    latency_histogram ready;
+    // First extension data decoded
+    latency_histogram first_data;
+};
 
+class wiimote {
     struct full_state {
         wiimote_status status{};
         button_flags buttons{};
         std::array<ir_dot, 4> ir_dots;
         vec3<uint16_t> acc;
         Calibration acc_calib;
-        std::queue<MemReadRequest> read_requests;
-        size_t read_req_counter = 0u;
+        wiimote_startup_times startup;
         bool rumble = false;
+        // As last set, as status reports show what the device has, which is nothing after it reconnects.
+        // Guarded by m_status_mutex.
+        led_flags leds{};
     };
 
 public:
@@ -112,61 +225,118 @@ public:
 
     wiimote(uint16_t vendor_id, uint16_t product_id, std::wstring_view serial);
 
+    // Uses the given transport, serviced by the event loop if there is one, otherwise by a read and a write thread.
+    // Calibration is kept in the cache if there is one, hardware usually wants profile_cache::shared().
+    explicit wiimote(std::unique_ptr<hid_transport> transport, reactor *event_loop = nullptr,
+                     profile_cache *cache = nullptr);
+
     wiimote(wiimote const &) = delete;
 
     wiimote(wiimote &&) noexcept ;
 
     ~wiimote();
 
+    // False once reading from the device failed, e.g. because it was switched off or went out of range. Nothing is
+    // sent to it until it is reconnected.
+    bool connected() const;
+
+    // Carries on with a new transport to the same device, after the connection was lost. Cached calibration is
+    // applied straight away, and the reporting mode, IR camera, LEDs and rumble are restored. The speaker has to be
+    // enabled again.
+    void reconnect(std::unique_ptr<hid_transport> transport);
+
 private:
     void init();
+    // Stops the threads, or takes the device off the event loop
+    void stop();
+    // Called when reading from the transport fails
+    void lost_connection();
 
     void set_reporting_mode(bool continuous, input_reports report);
-
-    void write(std::vector<uint8_t>&& data);
-    void write(std::span<uint8_t> data);
-
-    ssize_t read(std::span<uint8_t> data);
-
-    size_t handle_extension_data(std::span<uint8_t> const data);
+    // Switches to the smallest report mode that carries every subscribed sensor, unless it is already in use
+    void update_reporting_mode(bool force = false);
+    // Brings the camera up in the given format, switches its format, or turns it off for NONE.
+    // Expects m_reporting_mode_mutex to be held.
+    void update_ir_camera(ir_format format);
+
+    void write(std::span<const uint8_t> data, output_priority priority);
+
+    // Waits a little while for reports, then takes every one already waiting
+    ssize_t read(report_batch &batch);
+
+    // Decodes a data report with the decoder generated from its layout
+    void handle_data_report(uint8_t *report);
+    template<uint8_t Id>
+    void decode_data_report(uint8_t *report);
+
+    // Decodes extension bytes into the extension state. Bound when the extension changes, rather than looked up for
+    // every report.
+    using extension_decoder = size_t (*)(wiimote &, std::span<uint8_t const>);
+    template<typename Extension, bool MotionPlus>
+    static size_t decode_extension(wiimote &self, std::span<uint8_t const> data);
+    // Expects m_extension_mutex to be held. Also updates the report mode, as extension data can only be reported
+    // while there is an extension.
+    void bind_extension_decoder();
+
+    size_t handle_extension_data(std::span<uint8_t const> data);
     size_t handle_ir_data_basic(uint8_t *);
     size_t handle_ir_data_extended(uint8_t *);
     size_t handle_ir_full(uint8_t const*, bool initial);
     size_t handle_buttons_only(uint8_t const *const r);
     size_t handle_buttons_acc(uint8_t const *const);
-    size_t handle_interleaved_a(uint8_t const*r);
-    size_t handle_interleaved_b(uint8_t const*r);
-    size_t handle_mem_read(uint8_t *r);
+    size_t handle_interleaved_acc(uint8_t const *r, bool second_half);
+    size_t handle_mem_read(uint8_t const *r);
     size_t handle_status(uint8_t const *status);
     size_t handle_acknowledgement(const uint8_t *data);
-    void handle_wiimote_calibration_data(std::span<uint8_t const> data, bool retry_on_checksum_fail = false);
+    bool handle_wiimote_calibration_data(std::span<uint8_t const> data, bool retry_on_checksum_fail = false);
+    // Expects m_extension_mutex to be held
+    void handle_motionplus_calibration_data(std::span<uint8_t const> data, bool fast);
+
+    void load_cached_calibration();
+    void store_cached_calibration(uint64_t extension, address_t address, std::span<uint8_t const> data);
 
     void mem_request_write(std::array<uint8_t, 4> address, std::vector<uint8_t>&& data);
     void mem_request_read(std::array<uint8_t, 4> address, size_t);
 
-    void write_mem_read_report(MemReadReport report);
-    void write_mem_write_report(MemWriteReport report);
-
-    void on_mem_read(const MemReadRequest &req);
+    void on_mem_read(mem_result const &res);
 
-
-    void request_extension();
     void request_wiimote_calibration(bool allow_second_attempt);
-    void request_motion_plus_calibration();
-    void detect_motionplus();
-    void activate_motionplus(MotionPlusMode mode = MotionPlusMode::MOTIONPLUS_ONLY);
-    void init_motionplus();
-    void update_motionplus();
 
-    void read_loop();
-    void write_loop();
-    void mem_req_loop();
+    // Extension swap, all expecting m_extension_mutex to be held.
+    // Starts identifying whatever is plugged in, or notes that it has to be done again after the swap under way.
+    void start_extension_swap();
+    void on_extension_id(uint32_t generation, bool motionplus, mem_result const &res);
+    void on_motionplus_calibration(uint32_t generation, mem_result const &res);
+    void on_motionplus_activated(uint32_t generation, mem_result const &res);
+    // Moves on to the next stage once the current one is done
+    void advance_extension_swap();
+    void record_swap_stage(latency_histogram &histogram);
+
+    void read_loop(std::stop_token const &stop);
+    void write_loop(std::stop_token const &stop);
+
+    // Decodes a single input report, read at the given time
+    void process_report(std::span<const uint8_t> report, std::chrono::steady_clock::time_point received);
+    // Runs the orientation filter on the latest motionplus sample, and publishes the result
+    void update_orientation(std::chrono::steady_clock::time_point timestamp);
+    // Appends the motion data of the report just decoded to the history
+    void update_history(std::chrono::steady_clock::time_point timestamp);
+    // Runs the pointer stage on the latest IR dots, and publishes the result
+    void update_pointer(std::chrono::steady_clock::time_point timestamp);
+    // Sends the next output report if its slot has come, returns when to be called again. Returns time_point::max()
+    // when there is nothing to send or wait for, until wake_output() is called.
+    std::chrono::steady_clock::time_point service_output(std::chrono::steady_clock::time_point now);
+    // Called whenever output is queued, to have an idle device serviced again
+    void wake_output();
 
     bool get_rumble() const;
 
 public:
     button_flags get_buttons() const;
 
+    // Nothing pressed without an extension. Lock free.
+    extension_button_flags get_extension_buttons() const;
+
     std::optional<std::array<ir_dot, 4>> ir_dots() const;
 
     wiimote_status status() const;
@@ -175,13 +345,68 @@ public:
 
     std::optional<vec3<float>> motionplus() const;
 
+    wiimote_startup_times startup_times() const;
+
+    // Decodes an input report as though it had been read from the transport. Must not run alongside the device's own
+    // decoding, so it suits transports that produce nothing themselves.
+    void decode(std::span<const uint8_t> report);
+
+    // Latest orientation, in the wiimote's frame: x to the right, y out of the front and z out of the top.
+    // Lock free, so it can be polled at any rate.
+    motion_snapshot snapshot() const;
+
+    // Where the wiimote points on screen, updated for every report with IR data. Lock free.
+    pointer_state pointer() const;
+
+    // Copies up to buffer.size() of the latest motion samples into buffer, without locking the history or allocating.
+    // The window reads from buffer. Check intact() before using it.
+    motion_window history(std::span<raw_motion_sample> buffer) const;
+
+    // Time taken to handle each report, from being read until each stage is done. Recorded without locks.
+    pipeline_latency const &latency() const;
+
+    // Time taken by each stage of swapping extensions, over every swap so far
+    extension_swap_latency const &swap_latency() const;
+
 public:
+    // Reports the given sensors for as long as the subscription is held. The smallest report mode carrying every
+    // subscribed sensor is used, and with no subscribers the buttons are only reported when they change.
+    // The IR camera is on while IR is subscribed.
+    [[nodiscard]] sensor_subscription subscribe(sensor_flags sensors);
+
+    // Applied straight away if the camera is on, otherwise when it is next brought up
+    void set_ir_sensitivity(ir_sensitivity level);
+
     void set_rumble(bool);
 
     void set_leds(led_flags leds);
 
     void request_status();
 
+    // Reads size bytes of memory, completing once every 0x21 report has arrived
+    std::future<mem_result> read_memory(address_t address, uint16_t size, mem_policy policy = {});
+
+    // Reads enough memory to fill the buffer, which has to outlive the returned future's completion
+    std::future<mem_result> read_memory(address_t address, std::span<uint8_t> buffer, mem_policy policy = {});
+
+    // Writes memory 16 bytes per report, completing once every report is acknowledged
+    std::future<mem_result> write_memory(address_t address, std::span<const uint8_t> data, mem_policy policy = {});
+
+    // Appends every input report to the recorder as it is read, null stops recording
+    void record_reports(std::shared_ptr<report_recorder> recorder);
+
+    // Turns the speaker on and configures it. Frames start going out once the setup writes are acknowledged,
+    // one every frame period, taking whichever output slot keeps them on time.
+    void enable_speaker(speaker_config config = {});
+
+    void disable_speaker();
+
+    // Queues 16 bit samples at the configured rate, to be played in order. Samples queued before the speaker is
+    // enabled wait for it, disabling it drops them.
+    void play_samples(std::span<const int16_t> samples);
+
+    speaker_stats speaker_statistics() const;
+
 private: // Threading
     // For buttons
     mutable std::shared_mutex m_button_mutex;
@@ -193,39 +418,98 @@ private: // Threading
     mutable std::shared_mutex m_extension_mutex;
     // For status
     mutable std::shared_mutex m_status_mutex;
-    // For keeping track of reads
-    mutable std::mutex m_mem_read_update_mutex;
     // For rumble
     mutable std::shared_mutex m_rumble_mutex;
 
-    std::thread m_read_thread;
-
-    std::thread m_write_thread;
-    std::queue<std::vector<uint8_t>> m_write_queue;
-    std::mutex m_writer_mutex;
-
-    struct {
-        std::atomic_bool wait_for_read;
-        std::atomic_bool wait_for_write;
-        std::mutex control_mutex;
-        std::condition_variable control_cv;
-
-        std::mutex element_mutex;
-        std::condition_variable_any element_cv;
-        std::queue<std::variant<MemWriteReport, MemReadReport>> queue;
-
-        std::thread thread;
-    } mem_req_queue;
-
-
-    std::atomic_bool m_running;
+    std::jthread m_read_thread;
+
+    std::jthread m_write_thread;
+    // The write thread sleeps on it between output slots, so that a stop request wakes it
+    std::mutex m_write_mutex;
+    std::condition_variable_any m_write_wake;
+    // Set while service_output has nothing to do, so that only the first output queued after it wakes anyone
+    std::atomic_bool m_output_idle = false;
+    output_queue m_output;
+
+    // Speaker frames, which bypass the output queue to go out on time
+    speaker_engine m_speaker;
+
+    // Memory reads and writes, issued through the output queue
+    memory_engine m_memory{[this](std::span<const uint8_t> report) { write(report, output_priority::MEMORY); },
+                           [this] { wake_output(); }};
+
+    profile_cache *m_cache = nullptr;
+    uint64_t m_device_key = 0;
+    std::chrono::steady_clock::time_point m_opened_at;
+    std::chrono::steady_clock::time_point m_next_write;
+    std::atomic<std::shared_ptr<report_recorder>> m_recorder;
+
+    std::shared_ptr<sensor_demand> m_demand = std::make_shared<sensor_demand>();
+    std::atomic<sensor_flags> m_subscribed = sensor_flags::NONE;
+    // Set while there is an extension or motionplus to report
+    std::atomic_bool m_extension_reportable = false;
+    // Stored by the extension decoder, cleared whenever the extension changes
+    std::atomic<extension_button_flags> m_extension_buttons = extension_button_flags::NONE;
+    // Set once a status report has said whether an extension is plugged in, guarded by m_status_mutex
+    bool m_status_received = false;
+    std::mutex m_reporting_mode_mutex;
+    std::optional<std::pair<bool, input_reports>> m_reporting_mode;
+    // Format the camera was set up for, NONE while it is off
+    ir_format m_ir_camera = ir_format::NONE;
+    ir_sensitivity m_ir_sensitivity = ir_sensitivity::LEVEL_3;
+
+
+    std::atomic_bool m_connected = true;
 private:
     full_state m_state{};
     std::variant<std::monostate, NunchukRaw, ClassicController> m_extension{};
     std::optional<MotionPlusRaw> m_motionplus;
+    extension_decoder m_extension_decoder = nullptr;
+
+    // Extension swap under way, guarded by m_extension_mutex
+    struct extension_swap {
+        extension_stage stage = extension_stage::IDLE;
+        // Bumped by every swap, so replies meant for an abandoned one are ignored
+        uint32_t generation = 0;
+        std::chrono::steady_clock::time_point started;
+        // Id reads still outstanding, and what they returned
+        unsigned pending_ids = 0;
+        std::optional<uint64_t> extension_id;
+        std::optional<uint64_t> motionplus_id;
+        bool calibrated = false;
+        // Times the activated motionplus has been asked for its id
+        unsigned activation_checks = 0;
+        // Set by the status report the motionplus sends as it takes over, and while a check waits for it
+        bool activation_announced = false;
+        bool awaiting_announcement = false;
+        // Set when something was plugged in or out again during the swap
+        bool again = false;
+        bool awaiting_data = false;
+        // Whether the motionplus said something is in its passthrough port, as of its last report
+        std::optional<bool> passthrough_port;
+    } m_swap;
+    extension_swap_latency m_swap_latency;
+
+    // Only touched while decoding
+    madgwick_filter m_fusion;
+    std::optional<std::chrono::steady_clock::time_point> m_last_sample;
+    bool m_acc_updated = false;
+    bool m_gyro_updated = false;
+    bool m_extension_updated = false;
+    motion_history m_history;
+    seqlock<motion_snapshot> m_motion;
+    ir_pointer m_pointer;
+    bool m_ir_updated = false;
+    seqlock<pointer_state> m_pointer_state;
+    pipeline_latency m_latency;
 
 
 private:
-    hid_device *m_device;
+    std::unique_ptr<hid_transport> m_transport;
+    reactor *m_reactor = nullptr;
+    // Event loop of the reactor servicing the device
+    std::atomic<size_t> m_reactor_loop = 0;
+
+    friend class reactor;
 };
 
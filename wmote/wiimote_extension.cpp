@@ -0,0 +1,220 @@
+#include <array>
+#include <chrono>
+
+#include "wiimote.hpp"
+#include "internal_logging.hpp"
+
+namespace {
+    // Byte 2 of an id is the register block it was read from, 0xa6 for a motionplus that isn't active yet
+    uint8_t id_block(uint64_t id) {
+        return uint8_t(id >> 24);
+    }
+
+    // An active motionplus answers at 0xa4 with an id ending in 0x05, the byte before it being its mode
+    bool is_active_motionplus(uint64_t id) {
+        return id_block(id) == 0xA4 && uint8_t(id) == 0x05;
+    }
+
+    MotionPlusMode mode_of(uint64_t id) {
+        switch (uint8_t(id >> 8)) {
+            case 0x05:
+                return MotionPlusMode::NUNCHUK_PASSTHROUGH;
+            case 0x07:
+                return MotionPlusMode::CLASSIC_PASSTHROUGH;
+            default:
+                return MotionPlusMode::MOTIONPLUS_ONLY;
+        }
+    }
+
+    constexpr uint8_t activation_byte(MotionPlusMode mode) {
+        switch (mode) {
+            case MotionPlusMode::NUNCHUK_PASSTHROUGH:
+                return 0x05;
+            case MotionPlusMode::CLASSIC_PASSTHROUGH:
+                return 0x07;
+            default:
+                return 0x04;
+        }
+    }
+
+    // Both motionplus calibration blocks, fast mode at 0x20 and slow mode at 0x30, are read in one go
+    constexpr uint16_t motionplus_calibration_size = 0x20;
+    constexpr size_t motionplus_slow_offset = 0x10;
+    constexpr size_t motionplus_block_size = 16;
+
+    // Times an activated motionplus is asked for its id before giving up on it
+    constexpr unsigned max_activation_checks = 4;
+}
+
+void wiimote::start_extension_swap() {
+    if (m_swap.stage != extension_stage::IDLE && m_swap.stage != extension_stage::REPORTING) {
+        m_swap.again = true;
+        return;
+    }
+    const auto generation = m_swap.generation + 1;
+    m_swap = {.stage = extension_stage::IDENTIFYING, .generation = generation,
+              .started = std::chrono::steady_clock::now(), .pending_ids = 2};
+
+    // Stop decoding the old extension while the new one is identified
+    m_extension = {};
+    m_motionplus = {};
+    bind_extension_decoder();
+
+    // Everything is queued at once, so the writes are pipelined and the reads follow straight after them.
+    // Writing 0x55 initialises the extension without encryption, and switches off an active motionplus, so that both
+    // the extension behind it and the motionplus show up under their own ids. The motionplus calibration is read on
+    // the chance there is one, saving a round trip when there is.
+    constexpr std::array<uint8_t, 1> init_1{0x55};
+    constexpr std::array<uint8_t, 1> init_2{0x00};
+    m_memory.write(addresses::extension_init_1, init_1);
+    m_memory.write(addresses::extension_init_2, init_2);
+    for (const bool motionplus: {false, true}) {
+        m_memory.read(motionplus ? addresses::motionplus_identifier : addresses::extension_identifier, 6,
+                      [this, generation, motionplus](mem_result const &res) {
+                          std::scoped_lock lock(m_extension_mutex);
+                          on_extension_id(generation, motionplus, res);
+                      });
+    }
+    m_memory.read(addresses::motionplus_calibration_fast, motionplus_calibration_size,
+                  [this, generation](mem_result const &res) {
+                      std::scoped_lock lock(m_extension_mutex);
+                      on_motionplus_calibration(generation, res);
+                  });
+}
+
+void wiimote::on_extension_id(uint32_t generation, bool motionplus, mem_result const &res) {
+    if (generation != m_swap.generation || m_swap.stage != extension_stage::IDENTIFYING)
+        return;
+    if (res && res.data.size() == 6)
+        (motionplus ? m_swap.motionplus_id : m_swap.extension_id) = vec_to_u48(res.data);
+    if (--m_swap.pending_ids)
+        return;
+    record_swap_stage(m_swap_latency.identified);
+
+    const auto extension = m_swap.extension_id.value_or(0);
+    switch (extension_id(extension)) {
+        case extension_id::NUNCHUK:
+            log_info("Detected nunchuk");
+            m_extension = NunchukRaw{};
+            break;
+        case extension_id::CLASSIC:
+        case extension_id::CLASSIC_PRO:
+            log_info("Detected classic controller");
+            m_extension = ClassicController{};
+            break;
+        default:
+            if (m_swap.extension_id && !is_active_motionplus(extension))
+                log_info("Unhandled extension {:#x}", extension);
+            break;
+    }
+
+    if (m_swap.motionplus_id && id_block(*m_swap.motionplus_id) == 0xA6) {
+        // Switched on in the mode the extension behind it needs
+        auto mode = MotionPlusMode::MOTIONPLUS_ONLY;
+        if (std::holds_alternative<NunchukRaw>(m_extension))
+            mode = MotionPlusMode::NUNCHUK_PASSTHROUGH;
+        else if (std::holds_alternative<ClassicController>(m_extension))
+            mode = MotionPlusMode::CLASSIC_PASSTHROUGH;
+        log_info("Detected motionplus, activating");
+        m_motionplus = MotionPlusRaw{.mode = mode};
+        m_swap.stage = extension_stage::ACTIVATING;
+
+        const std::array<uint8_t, 1> activate{activation_byte(mode)};
+        m_memory.write(addresses::motionplus_activate, activate);
+        m_memory.read(addresses::extension_identifier, 6, [this, generation](mem_result const &res) {
+            std::scoped_lock lock(m_extension_mutex);
+            on_motionplus_activated(generation, res);
+        });
+    }
+    else if (is_active_motionplus(extension)) {
+        // Still active, as when the write switching it off was lost
+        log_info("Detected active motionplus");
+        m_motionplus = MotionPlusRaw{.mode = mode_of(extension)};
+        if (m_motionplus->mode == MotionPlusMode::NUNCHUK_PASSTHROUGH)
+            m_extension = NunchukRaw{};
+        else if (m_motionplus->mode == MotionPlusMode::CLASSIC_PASSTHROUGH)
+            m_extension = ClassicController{};
+        m_swap.stage = extension_stage::CALIBRATING;
+    }
+    else {
+        m_swap.stage = extension_stage::CALIBRATING;
+    }
+
+    // Apply the cached calibration until it is read again
+    if (m_motionplus && m_cache) {
+        constexpr auto mpls = static_cast<uint64_t>(extension_id::MPLS);
+        if (auto block = m_cache->load(m_device_key, mpls, addresses::motionplus_calibration_fast))
+            handle_motionplus_calibration_data(*block, true);
+        if (auto block = m_cache->load(m_device_key, mpls, addresses::motionplus_calibration_slow))
+            handle_motionplus_calibration_data(*block, false);
+    }
+    advance_extension_swap();
+}
+
+void wiimote::on_motionplus_activated(uint32_t generation, mem_result const &res) {
+    if (generation != m_swap.generation || m_swap.stage != extension_stage::ACTIVATING)
+        return;
+    ++m_swap.activation_checks;
+
+    if (res && res.data.size() == 6 && is_active_motionplus(vec_to_u48(res.data))) {
+        record_swap_stage(m_swap_latency.activated);
+        m_swap.stage = extension_stage::CALIBRATING;
+        advance_extension_swap();
+        return;
+    }
+    if (m_swap.activation_checks >= max_activation_checks) {
+        log_error("Motionplus didn't activate, carrying on without it");
+        m_motionplus = {};
+        m_swap.stage = extension_stage::CALIBRATING;
+        advance_extension_swap();
+        return;
+    }
+    // It announces taking over with a status report. Until then it has nothing to answer with.
+    if (!m_swap.activation_announced) {
+        m_swap.awaiting_announcement = true;
+        return;
+    }
+    m_memory.read(addresses::extension_identifier, 6, [this, generation](mem_result const &res) {
+        std::scoped_lock lock(m_extension_mutex);
+        on_motionplus_activated(generation, res);
+    });
+}
+
+void wiimote::on_motionplus_calibration(uint32_t generation, mem_result const &res) {
+    if (generation != m_swap.generation)
+        return;
+    // Without a motionplus the read fails, and there is nothing to calibrate
+    if (res && m_motionplus && res.data.size() >= motionplus_slow_offset + motionplus_block_size) {
+        const std::span data(res.data);
+        const auto fast = data.first(motionplus_block_size);
+        const auto slow = data.subspan(motionplus_slow_offset, motionplus_block_size);
+        handle_motionplus_calibration_data(fast, true);
+        handle_motionplus_calibration_data(slow, false);
+        constexpr auto mpls = static_cast<uint64_t>(extension_id::MPLS);
+        store_cached_calibration(mpls, addresses::motionplus_calibration_fast, fast);
+        store_cached_calibration(mpls, addresses::motionplus_calibration_slow, slow);
+    }
+    m_swap.calibrated = true;
+    record_swap_stage(m_swap_latency.calibrated);
+    advance_extension_swap();
+}
+
+void wiimote::advance_extension_swap() {
+    if (m_swap.stage != extension_stage::CALIBRATING || !m_swap.calibrated)
+        return;
+
+    bind_extension_decoder();
+    m_swap.stage = extension_stage::REPORTING;
+    m_swap.awaiting_data = m_extension_reportable;
+    record_swap_stage(m_swap_latency.ready);
+    using namespace std::chrono;
+    log_info("Extension swap done after {}us",
+             duration_cast<microseconds>(steady_clock::now() - m_swap.started).count());
+
+    if (m_swap.again)
+        start_extension_swap();
+}
+
+void wiimote::record_swap_stage(latency_histogram &histogram) {
+    histogram.record(std::chrono::steady_clock::now() - m_swap.started);
+}
@@ -6,10 +6,14 @@ button_flags wiimote::get_buttons() const {
     return m_state.buttons;
 }
 
+extension_button_flags wiimote::get_extension_buttons() const {
+    return m_extension_buttons.load(std::memory_order_relaxed);
+}
+
 std::optional<std::array<ir_dot, 4>> wiimote::ir_dots() const {
     {
         std::shared_lock status_lock (m_status_mutex);
-        if (m_state.status.ir_enabled){
+        if (!m_state.status.ir_enabled){
             return {};
         }
     }
@@ -48,6 +52,49 @@ vec3<float> wiimote::accelerometer() const {
 }
 
 
+motion_snapshot wiimote::snapshot() const {
+    return m_motion.load();
+}
+
+pointer_state wiimote::pointer() const {
+    return m_pointer_state.load();
+}
+
+motion_window wiimote::history(std::span<raw_motion_sample> buffer) const {
+    motion_calibration calibration;
+    {
+        std::shared_lock acc_lock(m_acc_mutex);
+        calibration.acc = m_state.acc_calib;
+    }
+    {
+        std::shared_lock ext_lock(m_extension_mutex);
+        if (m_motionplus) {
+            calibration.gyro_fast = m_motionplus->fast_mode_calib;
+            calibration.gyro_slow = m_motionplus->slow_mode_calib;
+        }
+        if (auto nunchuk = std::get_if<NunchukRaw>(&m_extension))
+            calibration.extension_acc = nunchuk->calibration;
+    }
+    return {m_history.latest(buffer), calibration};
+}
+
+pipeline_latency const &wiimote::latency() const {
+    return m_latency;
+}
+
+extension_swap_latency const &wiimote::swap_latency() const {
+    return m_swap_latency;
+}
+
+wiimote_startup_times wiimote::startup_times() const {
+    std::shared_lock acc_lock(m_acc_mutex);
+    return m_state.startup;
+}
+
+bool wiimote::connected() const {
+    return m_connected.load(std::memory_order_relaxed);
+}
+
 bool wiimote::get_rumble() const {
     std::shared_lock rumble_lock(m_rumble_mutex);
     return m_state.rumble;
@@ -60,14 +107,19 @@ void wiimote::set_rumble(bool val) {
         // This is what actually sets the rumble
         m_state.rumble = val;
     }
-    RumbleReport rumble;
-    write(span_of(rumble));
+    // Only goes out if no other report carries the rumble bit first
+    RumbleReport rumble{};
+    write(span_of(rumble), output_priority::CONTROL);
 }
 
 void wiimote::set_leds(led_flags leds) {
+    {
+        std::scoped_lock status_lock(m_status_mutex);
+        m_state.leds = leds;
+    }
     uint8_t led_val = (static_cast<uint8_t>(leds) & 0xF0) >> 4;
     LEDReport report {.led = led_val};
-    write(span_of(report));
+    write(span_of(report), output_priority::CONTROL);
 }
 
 
@@ -1,4 +1,6 @@
 #include <numeric>
+#include <type_traits>
+#include <utility>
 
 #include "wiimote.hpp"
 #include "reads.hpp"
@@ -9,18 +11,45 @@
 size_t wiimote::handle_status(uint8_t const *const data) {
     auto status = reinterpret_cast<WiimoteStatus const *>(data);
     {
-        std::scoped_lock lock(m_status_mutex);
+        std::scoped_lock lock(m_status_mutex, m_extension_mutex);
         m_state.status.battery_very_low = status->battery_very_low;
 
-        if (std::holds_alternative<std::monostate>(m_extension) && status->extension_connected){
-            log_info("Extension connected");
-            request_extension();
-            detect_motionplus();
+        // Plugging or unplugging changes what the extension registers hold. The first report only says what was
+        // there to begin with.
+        const bool plugged = m_status_received && status->extension_connected != m_state.status.extension_connected;
+        if (plugged) {
+            m_memory.shadow().invalidate_block(addresses::extension_identifier);
+            m_memory.shadow().invalidate_block(addresses::motionplus_identifier);
         }
-        else if (!std::holds_alternative<std::monostate>(m_extension) && !status->extension_connected){
-            log_info("Extension disconnected");
-            m_extension = {};
-            m_motionplus = {};
+        m_status_received = true;
+
+        switch (m_swap.stage) {
+            case extension_stage::IDLE:
+            case extension_stage::REPORTING:
+                if (plugged && status->extension_connected) {
+                    log_info("Extension connected");
+                    start_extension_swap();
+                }
+                else if (plugged) {
+                    // Nothing left to identify
+                    log_info("Extension disconnected");
+                    m_extension = {};
+                    m_motionplus = {};
+                    bind_extension_decoder();
+                }
+                break;
+            case extension_stage::ACTIVATING:
+                m_swap.activation_announced = true;
+                if (std::exchange(m_swap.awaiting_announcement, false)) {
+                    m_memory.read(addresses::extension_identifier, 6, [this, generation = m_swap.generation](mem_result const &res) {
+                        std::scoped_lock lock(m_extension_mutex);
+                        on_motionplus_activated(generation, res);
+                    });
+                }
+                break;
+            default:
+                // Switching the motionplus off and on sends status reports, so those seen during a swap say nothing new
+                break;
         }
         m_state.status.extension_connected = status->extension_connected;
         m_state.status.speaker_enabled = status->speaker_enabled;
@@ -28,6 +57,8 @@ size_t wiimote::handle_status(uint8_t const *const data) {
         m_state.status.leds = static_cast<led_flags>(status->led_state);
         m_state.status.battery_level = status->battery_level;
     }
+    // After a status report the wiimote sends no data reports until the mode is set again
+    update_reporting_mode(true);
     return sizeof(WiimoteStatus);
 }
 
@@ -54,17 +85,17 @@ size_t wiimote::handle_buttons_acc(uint8_t const *const data) {
         m_state.acc.y = y;
         m_state.acc.z = z;
     }
+    m_acc_updated = true;
     return sizeof(ButtonsAccData);
 }
 
 size_t wiimote::handle_acknowledgement(uint8_t const *data) {
     auto ack = reinterpret_cast<Acknowledgement const *>(data);
-    if ((ack->output_report == output_reports::REP_OUT_WRITE_TO_MEMORY) && mem_req_queue.wait_for_write){
-        mem_req_queue.wait_for_write = false;
-        mem_req_queue.control_mutex.unlock();
-        mem_req_queue.control_cv.notify_one();
+    if (ack->output_report == output_reports::REP_OUT_WRITE_TO_MEMORY){
+        if (!m_memory.on_write_ack(ack->error_code))
+            log_error("Received unexpected write acknowledgement");
     }
-    if (ack->error_code) {
+    else if (ack->error_code) {
         log_error("Received error code {:#x} on report {:#x}", ack->error_code, ack->output_report);
     }
     return sizeof(Acknowledgement);
@@ -76,13 +107,14 @@ size_t wiimote::handle_ir_data_basic(uint8_t *data) {
     auto &ir = m_state.ir_dots;
 
     for (auto i = 0; i < 2; ++i) {
+        auto const &pair = pack[i];
         auto &ir_a = ir[i * 2];
         auto &ir_b = ir[i * 2 + 1];
-        ir_a.position.x = pack->x1_low | (pack->x1_high << 8);
-        ir_a.position.y = pack->y1_low | (pack->y1_high << 8);
+        ir_a.position.x = pair.x1_low | (pair.x1_high << 8);
+        ir_a.position.y = pair.y1_low | (pair.y1_high << 8);
 
-        ir_b.position.x = pack->x2_low | (pack->x2_high << 8);
-        ir_b.position.y = pack->y2_low | (pack->y2_high << 8);
+        ir_b.position.x = pair.x2_low | (pair.x2_high << 8);
+        ir_b.position.y = pair.y2_low | (pair.y2_high << 8);
 
         ir_a.size = 0;
         ir_b.size = 0;
@@ -90,6 +122,7 @@ size_t wiimote::handle_ir_data_basic(uint8_t *data) {
         ir_a.disabled = (ir_a.position.x == 0x3ffu && ir_a.position.y == 0x3ffu);
         ir_b.disabled = (ir_b.position.x == 0x3ffu && ir_b.position.y == 0x3ffu);
     }
+    m_ir_updated = true;
     return sizeof(IRBasic) * 2;
 }
 
@@ -102,7 +135,9 @@ size_t wiimote::handle_ir_data_extended(uint8_t *data) {
         dot.position.x = ir_data.x_low | (ir_data.x_high << 8);
         dot.position.y = ir_data.y_low | (ir_data.y_high << 8);
         dot.size = ir_data.size;
+        dot.disabled = (dot.position.x == 0x3ffu && dot.position.y == 0x3ffu);
     }
+    m_ir_updated = true;
     return sizeof(IRExtendedSingle) * 4;
 }
 
@@ -120,175 +155,118 @@ size_t wiimote::handle_ir_full(uint8_t const *data, bool initial) {
         dot.min.x = ir_data.x_min;
         dot.min.y = ir_data.y_min;
         dot.intensity = ir_data.intensity;
+        dot.disabled = (dot.position.x == 0x3ffu && dot.position.y == 0x3ffu);
     }
+    m_ir_updated = true;
     return sizeof(IRFullSingle) * 2;
 }
 
-size_t wiimote::handle_interleaved_a(uint8_t const *data) {
+size_t wiimote::handle_interleaved_acc(uint8_t const *data, bool second_half) {
     handle_buttons_only(data);
-    auto const button_data_ptr = reinterpret_cast<ButtonData const *>(data);
+    auto const button_data = reinterpret_cast<ButtonData const *>(data);
+    // Each half carries the top 8 bits of one axis, and 4 bits of z in the unused bits of the button bytes
+    const uint16_t axis = data[sizeof(ButtonData)] << 2;
+    const uint16_t z_bits = button_data->b0b5 | button_data->b0b6 << 1 | button_data->b1b5 << 2 | button_data->b1b6 << 3;
     {
         std::scoped_lock lock(m_acc_mutex);
-        m_state.acc.x = *(data + 1);
-        m_state.acc.z |= (button_data_ptr->b0b6 << 5) | (button_data_ptr->b0b5 << 4);
-        m_state.acc.z |= (button_data_ptr->b1b6 << 7) | (button_data_ptr->b1b5 << 6);
+        if (second_half) {
+            m_state.acc.y = axis;
+            m_state.acc.z = (m_state.acc.z & 0x3c0) | z_bits << 2;
+        } else {
+            m_state.acc.x = axis;
+            m_state.acc.z = (m_state.acc.z & 0x03c) | z_bits << 6;
+        }
     }
-
-    handle_ir_full(data + 4, true);
-    return 22;
+    m_acc_updated = true;
+    return sizeof(ButtonData) + 1;
 }
 
-size_t wiimote::handle_interleaved_b(uint8_t const *data) {
-    auto const button_data_ptr = reinterpret_cast<ButtonData const *>(data + 0);
-    data += handle_buttons_only(data);
-    {
-        std::scoped_lock lock(m_acc_mutex);
-        m_state.acc.y = *data;
-        m_state.acc.z |= (button_data_ptr->b0b6 << 5) | (button_data_ptr->b0b5 << 4);
-        m_state.acc.z |= (button_data_ptr->b1b6 << 7) | (button_data_ptr->b1b5 << 6);
+template<uint8_t Id>
+void wiimote::decode_data_report(uint8_t *report) {
+    constexpr auto layout = layout_of(Id);
+    if constexpr (!layout.valid()) {
+        log_error("Received unhandled report {:#x}", Id);
+    } else {
+        if constexpr (layout.ir == ir_format::FULL)
+            handle_interleaved_acc(report + 1, layout.second_half);
+        else if constexpr (layout.acc)
+            handle_buttons_acc(report + 1);
+        else if constexpr (layout.buttons)
+            handle_buttons_only(report + 1);
+
+        if constexpr (layout.ir == ir_format::BASIC)
+            handle_ir_data_basic(report + layout.ir_offset);
+        else if constexpr (layout.ir == ir_format::EXTENDED)
+            handle_ir_data_extended(report + layout.ir_offset);
+        else if constexpr (layout.ir == ir_format::FULL)
+            handle_ir_full(report + layout.ir_offset, !layout.second_half);
+
+        if constexpr (layout.extension_size != 0)
+            handle_extension_data({report + layout.extension_offset, layout.extension_size});
     }
-    handle_ir_full(data + 4, true);
-    return 22;
 }
 
-size_t wiimote::handle_mem_read(uint8_t *data) {
+void wiimote::handle_data_report(uint8_t *report) {
+    using decoder = void (wiimote::*)(uint8_t *);
+    // One decoder per data report id, each with its offsets resolved at compile time
+    constexpr static auto decoders = []<size_t... I>(std::index_sequence<I...>) {
+        return std::array<decoder, data_report_count>{&wiimote::decode_data_report<first_data_report + I>...};
+    }(std::make_index_sequence<data_report_count>{});
+
+    (this->*decoders[report[0] - first_data_report])(report);
+}
+
+size_t wiimote::handle_mem_read(uint8_t const *data) {
     constexpr size_t data_size = sizeof(MemoryReadData);
     auto pack = reinterpret_cast<MemoryReadData const*>(data);
     const auto error = pack->error;
     auto const address = bswap_on_le(pack->address_low_bytes_big_endian);
     auto const size = pack->size + 1;
 
-    std::scoped_lock read_requests_lock (m_mem_read_update_mutex);
-
-    if (m_state.read_requests.empty()){
+    if (!m_memory.on_read_data(address, error, {pack->data.cbegin(), pack->data.cbegin() + size})){
         log_error("Received unexpected mem read report from: {:#x}", address);
-        return data_size;
     }
-
-    auto& front = m_state.read_requests.front();
-    const auto expected_address = (bswap_on_le(front.address.as_uint32()) + front.data.size());
-    if (address != (expected_address & 0xFFFF)){
-        log_error("Received read from {:#x}, when expecting from {:#x}, ignoring.", address, expected_address);
-        return data_size;
-    }
-
-    // "Completes" the read request
-    auto do_pop = [&]{
-        if (mem_req_queue.wait_for_read){
-            mem_req_queue.wait_for_read = false;
-            mem_req_queue.control_mutex.unlock();
-            mem_req_queue.control_cv.notify_one();
-            log_info("Popped request: (ID: {}, Address: {:x}, Size: {})",front.id, bswap_on_le(front.address.as_uint32()), front.expected_size);
-        }
-        m_state.read_requests.pop();
-    };
-
-    if (error){
-        do_pop();
-        switch (error) {
-            case 7: {
-                log_error("Attempted to read from write only address {:02x}, or from disconnected expansion",
-                          expected_address);
-                break;
-            }
-            case 8: {
-                log_error("Attempted to read from nonexistent memory address with low bytes {:02x}", expected_address);
-                break;
-            }
-            default:
-                log_error("Received unknown memory read error {:02x} when reading from memory address with low bytes",
-                          expected_address);
-        }
-        return data_size;
-    }
-
-    std::copy(pack->data.cbegin(), pack->data.cbegin() + size, std::back_inserter(front.data));
-    if (front.expected_size != front.data.size()){
-        return data_size;
-    }
-
-    const MemReadRequest front_copy = front;
-    do_pop();
-    m_mem_read_update_mutex.unlock();
-    on_mem_read(front_copy);
     return data_size;
 }
 
-void wiimote::on_mem_read(MemReadRequest const &req) {
-
-    if ((req.address == addresses::extension_identifier) || (req.address == addresses::motionplus_identifier)) {
-        const auto id = vec_to_u48(req.data);
-        const auto ext_id = extension_id(id);
-        std::scoped_lock ext_lock(m_extension_mutex);
-        switch (ext_id) {
-            case extension_id::NUNCHUK:
-                log_info("Detected nunchuk");
-                m_extension = NunchukRaw{};
-                break;
-            case extension_id::BUILTIN_MPLS:
-            case extension_id::MPLS:
-                log_info("Detected motionplus");
-                m_extension = {};
-                m_motionplus->mode = MotionPlusMode::MOTIONPLUS_ONLY;
-                update_motionplus();
-                set_reporting_mode(true, input_reports::REP_IN_BUTTONS_ACC_EXT_16B);
-                break;
-            case extension_id::CLASSIC:
-                log_info("Detected classic controller");
-                m_extension = ClassicController{};
-                break;
-            case extension_id::MPLS_CLASSIC:
-                log_info("Detected classic controller passthrough");
-                m_extension = ClassicController{};
-                break;
-            case extension_id::MPLS_NUNCHUK:
-                log_info("Detected passthrough nunchuk");
-                update_motionplus();
-                m_motionplus->mode = MotionPlusMode::NUNCHUK_PASSTHROUGH;
-                m_extension = NunchukRaw{};
-                set_reporting_mode(true, input_reports::REP_IN_BUTTONS_ACC_EXT_16B);
-                break;
-            case extension_id::INACTIVE_MPLS:
-            {
-                log_info("Received inactive mpls");
-                if (std::holds_alternative<NunchukRaw>(m_extension)){
-                    activate_motionplus(MotionPlusMode::NUNCHUK_PASSTHROUGH);
-                }
-                else if (std::holds_alternative<ClassicController>(m_extension)){
-                    activate_motionplus(MotionPlusMode::CLASSIC_PASSTHROUGH);
-                }
-                else {
-                    activate_motionplus(MotionPlusMode::MOTIONPLUS_ONLY);
-                }
-//                update_motionplus();
-                break;
-            }
+void wiimote::on_mem_read(mem_result const &req) {
+    const auto address = bswap_on_le(req.address.as_uint32());
+    switch (req.error) {
+        case mem_error::NONE:
+            break;
+        case mem_error::WRITE_ONLY:
+            log_error("Attempted to read from write only address {:#x}, or from disconnected expansion", address);
+            return;
+        case mem_error::NONEXISTENT:
+            log_error("Attempted to read from nonexistent memory address {:#x}", address);
+            return;
+        case mem_error::TIMED_OUT:
+        case mem_error::CANCELLED:
+            return;
+        default:
+            log_error("Received unknown memory read error {:#x} when reading from memory address {:#x}",
+                      uint8_t(req.error), address);
+            return;
+    }
 
+    if ((req.address == addresses::wiimote_calibration) || (req.address == addresses::wiimote_calibration_mirror)) {
+        if (!handle_wiimote_calibration_data(req.data, req.address == addresses::wiimote_calibration))
+            return;
 
-            case extension_id::DEACTIVATED_MPLS_ACTIVE_EXT:
-            {
-                log_info("Detected deactivated motionplus");
-                update_motionplus();
-                m_motionplus->mode = MotionPlusMode::EXTENSION_ONLY;
-                break;
-            }
-            default:
-                log_info("Unhandled extension {:#x}", id);
-                break;
+        using namespace std::chrono;
+        const auto elapsed = duration_cast<microseconds>(steady_clock::now() - m_opened_at);
+        {
+            std::scoped_lock acc_lock(m_acc_mutex);
+            if (!m_state.startup.device_calibration)
+                m_state.startup.device_calibration = elapsed;
         }
-
-    } else if (req.address == addresses::wiimote_calibration) {
-        handle_wiimote_calibration_data(req.data, true);
-
-    } else if (req.address == addresses::wiimote_calibration_mirror) {
-        handle_wiimote_calibration_data(req.data, false);
-    }
-    else if (req.address == addresses::motionplus_calibration_fast){
+        log_info("Read calibration from device after {}us", elapsed.count());
+        store_cached_calibration(0, addresses::wiimote_calibration, req.data);
     }
     //log_info("Complete read request from {:#x}", bswap_on_le(req.address.as_uint32()));
 }
 
-void handle_motionplus_ext(NunchukRaw &nunchuk, uint8_t *data) {
+void handle_motionplus_ext(NunchukRaw &nunchuk, uint8_t const *data) {
     const auto pack = reinterpret_cast<NunchukPassthrough const *>(data);
     nunchuk.button_c = !pack->c;
     nunchuk.button_z = !pack->z;
@@ -299,12 +277,12 @@ void handle_motionplus_ext(NunchukRaw &nunchuk, uint8_t *data) {
     nunchuk.acc_raw.z = pack->acc_z_high << 2 | pack->acc_z_low << 1 | nunchuk.acc_raw.z & 1;
 }
 
-void handle_motionplus_ext(ClassicController &classic_controller, uint8_t *data) {
+void handle_motionplus_ext(ClassicController &classic_controller, uint8_t const *data) {
     const auto pack = reinterpret_cast<ClassicControllerPassthroughData const *>(data);
     log_error("Classic Controller passthrough is yet to be implemented");
 }
 
-void handle_motionplus_ext(std::monostate &, uint8_t *) {}
+void handle_motionplus_ext(std::monostate &, uint8_t const *) {}
 
 size_t handle_ext(NunchukRaw &nunchuk, uint8_t const *data) {
     auto pack = reinterpret_cast<NunchukData const *>(data);
@@ -324,30 +302,74 @@ size_t handle_ext(auto &, uint8_t const *) {
     return 0;
 }
 
-size_t wiimote::handle_extension_data(std::span<uint8_t> data) {
-    std::scoped_lock lock(m_extension_mutex);
+extension_button_flags extension_buttons(NunchukRaw const &nunchuk) {
+    return (nunchuk.button_c ? extension_button_flags::C : extension_button_flags::NONE) |
+           (nunchuk.button_z ? extension_button_flags::Z : extension_button_flags::NONE);
+}
+
+extension_button_flags extension_buttons(auto const &) {
+    return extension_button_flags::NONE;
+}
 
-    if (m_motionplus && m_motionplus->mode != MotionPlusMode::EXTENSION_ONLY) {
-        const auto pack = reinterpret_cast<MotionPlusData *>(data.data());
-        if (!pack->contains_mpls_data) {
-            std::visit([&data](auto &t) { handle_motionplus_ext(t, data.data()); }, m_extension);
+template<typename Extension, bool MotionPlus>
+size_t wiimote::decode_extension(wiimote &self, std::span<uint8_t const> data) {
+    auto &extension = std::get<Extension>(self.m_extension);
+    if constexpr (MotionPlus) {
+        const auto pack = reinterpret_cast<MotionPlusData const *>(data.data());
+        if (pack->contains_mpls_data) {
+            // An extension going into or out of the motionplus only shows in its reports
+            const bool connected = pack->extension_connected;
+            const auto previous = std::exchange(self.m_swap.passthrough_port, connected);
+            if (previous && *previous != connected && self.m_swap.stage == extension_stage::REPORTING) {
+                log_info("Extension {} the motionplus", connected ? "plugged into" : "unplugged from");
+                self.start_extension_swap();
+                return sizeof(MotionPlusData);
+            }
+        }
+        else {
+            handle_motionplus_ext(extension, data.data());
+            self.m_extension_updated = std::is_same_v<Extension, NunchukRaw>;
+            self.m_extension_buttons.store(extension_buttons(extension), std::memory_order_relaxed);
             return sizeof(MotionPlusData);
         }
 
         uint16_t yaw = pack->yaw_low | pack->yaw_high << 8;
         uint16_t roll = pack->roll_low | pack->roll_high << 8;
         uint16_t pitch = pack->pitch_low | pack->pitch_high << 8;
-        m_motionplus->gyro_raw = {yaw, pitch, roll};
-        m_motionplus->is_slow_mode = {pack->pitch_slow_mode, pack->yaw_slow_mode, pack->roll_slow_mode};
+        self.m_motionplus->gyro_raw = {yaw, pitch, roll};
+        self.m_motionplus->is_slow_mode = {pack->yaw_slow_mode, pack->pitch_slow_mode, pack->roll_slow_mode};
+        self.m_gyro_updated = true;
+        return data.size();
     } else {
-        size_t byte_count = 0;
-        std::visit([&data, &byte_count](auto &t) { byte_count = handle_ext(t, data.data()); }, m_extension);
-        return byte_count;
+        self.m_extension_updated = std::is_same_v<Extension, NunchukRaw>;
+        const auto size = handle_ext(extension, data.data());
+        self.m_extension_buttons.store(extension_buttons(extension), std::memory_order_relaxed);
+        return size;
+    }
+}
+
+void wiimote::bind_extension_decoder() {
+    const bool motionplus = m_motionplus && m_motionplus->mode != MotionPlusMode::EXTENSION_ONLY;
+    m_extension_decoder = std::visit([motionplus]<typename T>(T const &) -> extension_decoder {
+        return motionplus ? &decode_extension<T, true> : &decode_extension<T, false>;
+    }, m_extension);
+    m_extension_reportable = m_motionplus || !std::holds_alternative<std::monostate>(m_extension);
+    m_extension_buttons = extension_button_flags::NONE;
+    update_reporting_mode();
+}
+
+size_t wiimote::handle_extension_data(std::span<uint8_t const> data) {
+    std::scoped_lock lock(m_extension_mutex);
+    if (m_swap.awaiting_data) {
+        m_swap.awaiting_data = false;
+        record_swap_stage(m_swap_latency.first_data);
     }
-    return data.size();
+    return m_extension_decoder(*this, data);
 }
 
-void wiimote::handle_wiimote_calibration_data(std::span<const uint8_t> data, bool retry_on_checksum_fail) {
+bool wiimote::handle_wiimote_calibration_data(std::span<const uint8_t> data, bool retry_on_checksum_fail) {
+    if (data.size() < sizeof(WiimoteCalibrationData))
+        return false;
     const uint8_t checksum = std::accumulate(data.begin(), data.end() - 1, 0x55, std::plus<>());
 
     const auto calib_data = (WiimoteCalibrationData *) data.data();
@@ -361,7 +383,7 @@ void wiimote::handle_wiimote_calibration_data(std::span<const uint8_t> data, boo
             log_error(
                     "Wiimote calibration checksum mismatch: calculated checksum was {:#x} while retrieved checksum {:#x}",
                     checksum, calib_data->checksum);
-        return;
+        return false;
     }
 
     log_info("Calibrating wiimote");
@@ -373,6 +395,24 @@ void wiimote::handle_wiimote_calibration_data(std::span<const uint8_t> data, boo
     calib.gravity.x = calib_data->x_grav_high << 2 | calib_data->x_grav_low;
     calib.gravity.y = calib_data->y_grav_high << 2 | calib_data->y_grav_low;
     calib.gravity.z = calib_data->z_grav_high << 2 | calib_data->z_grav_low;
+    return true;
+}
+
+void wiimote::handle_motionplus_calibration_data(std::span<const uint8_t> data, bool fast) {
+    if (!m_motionplus || data.size() < sizeof(MotionPlusCalibrationData))
+        return;
+
+    const auto calib_data = reinterpret_cast<MotionPlusCalibrationData const *>(data.data());
+    auto &calib = fast ? m_motionplus->fast_mode_calib : m_motionplus->slow_mode_calib;
+    // Stored as 16 bit big endian values, while the gyro reports 14 bits
+    calib.zero.x = bswap_on_le(calib_data->yaw_zero) >> 2;
+    calib.zero.y = bswap_on_le(calib_data->pitch_zero) >> 2;
+    calib.zero.z = bswap_on_le(calib_data->roll_zero) >> 2;
+    calib.gravity.x = bswap_on_le(calib_data->yaw_scale) >> 2;
+    calib.gravity.y = bswap_on_le(calib_data->pitch_scale) >> 2;
+    calib.gravity.z = bswap_on_le(calib_data->roll_scale) >> 2;
+    calib.degrees_div_6 = calib_data->degrees_div_6;
+    log_info("Calibrating motionplus ({} mode)", fast ? "fast" : "slow");
 }
 
 
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <thread>
+#include <hidapi.h>
+
+#include "wiimote_manager.hpp"
+#include "internal_logging.hpp"
+#include "hidraw_transport.hpp"
+
+wiimote_manager::wiimote_manager(reactor *event_loop)
+        : m_reactor(event_loop) {
+}
+
+std::vector<std::string> wiimote_manager::enumerate() {
+    std::vector<std::string> paths;
+    for (const auto product_id: product_ids) {
+        auto devices = hid_enumerate(vendor_id, product_id);
+        for (auto info = devices; info; info = info->next) {
+            if (std::find(paths.begin(), paths.end(), info->path) == paths.end())
+                paths.emplace_back(info->path);
+        }
+        hid_free_enumeration(devices);
+    }
+    return paths;
+}
+
+bool wiimote_manager::is_wiimote(std::filesystem::path const &path) {
+    // Linux keeps the ids of a hidraw node in sysfs, which saves enumerating every device
+    std::ifstream uevent(std::filesystem::path("/sys/class/hidraw") / path.filename() / "device" / "uevent");
+    if (!uevent) {
+        const auto paths = enumerate();
+        return std::find(paths.begin(), paths.end(), path.string()) != paths.end();
+    }
+    for (std::string line; std::getline(uevent, line);) {
+        // Bus, vendor and product, in hex
+        unsigned bus, vendor, product;
+        if (std::sscanf(line.c_str(), "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3)
+            return vendor == vendor_id && std::find(product_ids.begin(), product_ids.end(), product) != product_ids.end();
+    }
+    return false;
+}
+
+std::unique_ptr<hid_transport> wiimote_manager::open(std::string const &path) const {
+    if (m_reactor)
+        return std::make_unique<hidraw_transport>(path);
+    return std::make_unique<hidapi_transport>(std::filesystem::path(path));
+}
+
+std::vector<size_t> wiimote_manager::discover() {
+    std::scoped_lock open_lock(m_open_mutex);
+    auto paths = enumerate();
+    {
+        std::scoped_lock lock(m_mutex);
+        std::erase_if(paths, [this](std::string const &path) {
+            return std::any_of(m_devices.begin(), m_devices.end(), [&](entry const &e) { return e.path == path; });
+        });
+    }
+    if (paths.empty())
+        return {};
+
+    // Opening a device can take a while, so they are opened side by side
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::future<std::unique_ptr<hid_transport>>> pending;
+    pending.reserve(paths.size());
+    for (auto const &path: paths)
+        pending.push_back(std::async(std::launch::async, [this, path] { return open(path); }));
+
+    std::vector<size_t> added;
+    for (auto i = 0u; i < pending.size(); ++i) {
+        try {
+            if (auto id = connect(paths[i], pending[i].get()))
+                added.push_back(*id);
+        } catch (std::exception const &e) {
+            log_error("Failed to open wiimote at {}: {}", paths[i], e.what());
+        }
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    log_info("Opened {} of {} wiimotes in {}ms", added.size(), paths.size(), elapsed.count());
+    return added;
+}
+
+std::optional<size_t> wiimote_manager::connect(std::string const &path, std::unique_ptr<hid_transport> transport) {
+    auto identifier = transport->identifier();
+    std::shared_ptr<wiimote> lost;
+    size_t id;
+    {
+        std::scoped_lock lock(m_mutex);
+        auto it = std::find_if(m_devices.begin(), m_devices.end(), [&](entry const &e) {
+            return e.identifier == identifier && !e.device->connected();
+        });
+        if (it != m_devices.end()) {
+            it->path = path;
+            lost = it->device;
+            id = it->id;
+        }
+    }
+    if (lost) {
+        using namespace std::chrono;
+        const auto start = steady_clock::now();
+        lost->reconnect(std::move(transport));
+        log_info("Reconnected wiimote {} at {} in {}us", id, path,
+                 duration_cast<microseconds>(steady_clock::now() - start).count());
+        return std::nullopt;
+    }
+
+    auto device = std::make_shared<wiimote>(std::move(transport), m_reactor, profile_cache::shared());
+    {
+        std::scoped_lock lock(m_mutex);
+        id = m_next_id++;
+        m_devices.push_back({id, path, std::move(identifier), device});
+    }
+    device->set_leds(player_leds(id));
+    log_info("Registered wiimote {} at {}", id, path);
+    return id;
+}
+
+void wiimote_manager::watch_hotplug() {
+    if (m_monitor)
+        return;
+    m_monitor = std::make_unique<hotplug_monitor>([this](hotplug_monitor::change change, std::filesystem::path const &path) {
+        on_hotplug(change, path);
+    });
+}
+
+void wiimote_manager::on_hotplug(hotplug_monitor::change change, std::filesystem::path const &path) {
+    if (change == hotplug_monitor::change::REMOVED) {
+        // The wiimote notices itself, as reading from it fails
+        std::scoped_lock lock(m_mutex);
+        for (auto &e: m_devices) {
+            if (e.path == path.string()) {
+                e.path.clear();
+                log_info("Wiimote {} at {} went away", e.id, path.string());
+            }
+        }
+        return;
+    }
+    if (!is_wiimote(path))
+        return;
+
+    std::scoped_lock open_lock(m_open_mutex);
+    {
+        std::scoped_lock lock(m_mutex);
+        if (std::any_of(m_devices.begin(), m_devices.end(), [&](entry const &e) { return e.path == path.string(); }))
+            return;
+    }
+
+    // The kernel announces the node before udev has given it its permissions, which takes a few milliseconds
+    using namespace std::chrono;
+    constexpr auto open_window = 1s;
+    constexpr auto open_retry = 5ms;
+    const auto give_up = steady_clock::now() + open_window;
+    for (;;) {
+        try {
+            connect(path.string(), open(path.string()));
+            return;
+        } catch (std::exception const &e) {
+            if (steady_clock::now() >= give_up) {
+                log_error("Failed to open wiimote at {}: {}", path.string(), e.what());
+                return;
+            }
+        }
+        std::this_thread::sleep_for(open_retry);
+    }
+}
+
+std::shared_ptr<wiimote> wiimote_manager::get(size_t id) const {
+    std::scoped_lock lock(m_mutex);
+    auto it = std::find_if(m_devices.begin(), m_devices.end(), [id](entry const &e) { return e.id == id; });
+    if (it == m_devices.end())
+        return nullptr;
+    return it->device;
+}
+
+std::vector<size_t> wiimote_manager::ids() const {
+    std::scoped_lock lock(m_mutex);
+    std::vector<size_t> out;
+    out.reserve(m_devices.size());
+    for (auto const &e: m_devices)
+        out.push_back(e.id);
+    return out;
+}
+
+size_t wiimote_manager::size() const {
+    std::scoped_lock lock(m_mutex);
+    return m_devices.size();
+}
+
+led_flags wiimote_manager::player_leds(size_t id) {
+    const auto single = [](size_t n) { return static_cast<led_flags>(uint8_t(led_flags::ONE) << n); };
+    if (id < 4)
+        return single(id);
+    // Players past the fourth light the fourth LED alongside one of the others
+    return led_flags::FOUR | single((id - 4) % 3);
+}
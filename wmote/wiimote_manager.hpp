@@ -0,0 +1,70 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "wiimote.hpp"
+#include "reactor.hpp"
+#include "hotplug_monitor.hpp"
+
+// Finds every connected wiimote, opens them concurrently and keeps them in a registry.
+// Ids are assigned in order of discovery and are never reused, and each id is shown on the player LEDs. A wiimote that
+// loses its connection keeps its id, and is reconnected under it when it comes back.
+class wiimote_manager {
+public:
+    constexpr static uint16_t vendor_id = 0x057e;
+    // Original wiimote, and the wiimote with built in motionplus
+    constexpr static std::array<uint16_t, 2> product_ids = {0x0306, 0x0330};
+
+    // Wiimotes are serviced by the event loop if there is one, opening their hidraw nodes directly
+    explicit wiimote_manager(reactor *event_loop = nullptr);
+
+    wiimote_manager(wiimote_manager const &) = delete;
+
+    // Opens every wiimote that isn't registered yet, returns the ids of the new devices
+    std::vector<size_t> discover();
+
+    // From now on registers wiimotes as they are connected, and reconnects those that come back
+    void watch_hotplug();
+
+    // Returns null if no device has this id
+    std::shared_ptr<wiimote> get(size_t id) const;
+
+    std::vector<size_t> ids() const;
+
+    size_t size() const;
+
+    static led_flags player_leds(size_t id);
+
+private:
+    struct entry {
+        size_t id;
+        // Empty once the node is gone
+        std::string path;
+        // Of the transport, which stays the same across connections
+        std::string identifier;
+        std::shared_ptr<wiimote> device;
+    };
+
+    // Paths of every wiimote hidapi can see
+    static std::vector<std::string> enumerate();
+    static bool is_wiimote(std::filesystem::path const &path);
+    std::unique_ptr<hid_transport> open(std::string const &path) const;
+    // Reconnects the wiimote the transport's device was last connected to, or registers it as a new one.
+    // Returns the id if it is new.
+    std::optional<size_t> connect(std::string const &path, std::unique_ptr<hid_transport> transport);
+    void on_hotplug(hotplug_monitor::change change, std::filesystem::path const &path);
+
+    mutable std::mutex m_mutex;
+    std::vector<entry> m_devices;
+    size_t m_next_id = 0;
+    reactor *m_reactor;
+    // Held while opening devices, so discovery and hotplug don't both open the same one
+    std::mutex m_open_mutex;
+    // Last, so it stops before anything it calls into goes away
+    std::unique_ptr<hotplug_monitor> m_monitor;
+};
@@ -1,7 +1,21 @@
 #pragma once
 
+#include <array>
+#include <span>
+#include <type_traits>
+
 #include "reports.hpp"
 
+template <typename T> requires std::is_standard_layout_v<T>
+static std::span<uint8_t> span_of(T& value){
+    return {reinterpret_cast<uint8_t*>(&value), sizeof(T)};
+}
+
+template <typename T> requires std::is_standard_layout_v<T>
+static std::span<const uint8_t> span_of(T const& value){
+    return {reinterpret_cast<uint8_t const*>(&value), sizeof(T)};
+}
+
 #pragma pack(push, 1)
 struct RumbleReport {
     output_reports report = output_reports::REP_OUT_RUMBLE;